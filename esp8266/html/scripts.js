@@ -54,3 +54,18 @@ function set_systime() {
 	var params = "?seconds=" + d.getSeconds() + "&minutes=" + d.getMinutes() + "&hours=" + d.getHours() + "&date=" + d.getDate() + "&month=" + d.getMonth() + "&year=" + d.getFullYear() % 1000 + "&dow=" + (d.getDay() == 0 ? 7 : d.getDay());
 	api_action("systime_set" + params, api_okmessage);
 }
+
+// Live state of the coop, pushed by the server whenever it changes
+function events_init() {
+	if (!window.EventSource) return;
+
+	var events = new EventSource("events");
+	var names = ["slider", "time", "opentime", "battery"];
+	names.forEach(function(name) {
+		events.addEventListener(name, function(e) {
+			document.getElementById("status_" + name).textContent = e.data;
+		});
+	});
+}
+
+window.addEventListener("load", events_init);
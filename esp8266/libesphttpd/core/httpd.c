@@ -13,58 +13,279 @@ Esp8266 http server - core routines
 
 
 #include <esp8266.h>
+#include <limits.h>
 #include "httpd.h"
+#include "mimetypes.h"
 
 
-//Max length of request head
-#define MAX_HEAD_LEN 1024
-//Max amount of connections
-#define MAX_CONN 8
+//Max length of the head of one request. A request with a longer head gets a 431.
+#ifndef HTTPD_MAX_HEAD_LEN
+#define HTTPD_MAX_HEAD_LEN 1024
+#endif
+//Size of the arena the heads of requests are stored in. A connection only takes room from it
+//while it has a request: a head starts small and grows as it comes in, and once it's complete
+//it gives back what it didn't use. So this only has to be big enough for the heads that are
+//being received at the same time plus those of the requests being answered.
+#ifndef HTTPD_HEAD_ARENA
+#define HTTPD_HEAD_ARENA 4096
+#endif
+//Room a request head starts out with. It doubles every time it's full, up to HTTPD_MAX_HEAD_LEN.
+#define HEAD_MIN_LEN 256
+//Max amount of request headers that are indexed for httpdGetHeader. Headers beyond this can
+//still be found, but that takes a walk through the head.
+#define MAX_HEADERS 24
+//Max amount of GET and POST args that are indexed for httpdGetArg
+#define MAX_ARGS 12
+//Max amount of connections. This is the size of the connection arena; slots are only taken
+//into use as they're needed, so a large value costs RAM but no time.
+#ifndef HTTPD_MAX_CONNECTIONS
+#define HTTPD_MAX_CONNECTIONS 8
+#endif
+#define MAX_CONN HTTPD_MAX_CONNECTIONS
 //Max post buffer len
 #define MAX_POST 1024
+//Max amount of bytes of pipelined requests kept per connection while the current request is
+//still being answered
+#define MAX_BACKLOG 1024
 //Max send buffer len
 #define MAX_SENDBUFF_LEN 2048
+//Extra room in the send buffer for the framing headers and chunk markers httpd inserts itself
+#define SENDBUFF_SLACK 80
+//Size of the TCP segments httpd tries to fill before it hands data to espconn. espconn doesn't
+//tell what MSS was negotiated for a connection, so this is the TCP_MSS of the SDK's lwIP.
+#ifndef HTTPD_MSS
+#define HTTPD_MSS 1460
+#endif
+//While what a cgi made is less than a segment and no more than this, the cgi is called again
+//right away to add to it, instead of after it's sent. That's how the headers go out together
+//with the start of the body. It's also the most a cgi can find in the send buffer when it's
+//called.
+#ifndef HTTPD_COALESCE_MAX
+#define HTTPD_COALESCE_MAX 512
+#endif
+//Max amount of unused send buffers kept around for the next response, instead of being
+//handed back to the heap
+#ifndef HTTPD_SPARE_SENDBUFFS
+#define HTTPD_SPARE_SENDBUFFS 2
+#endif
+//Max amount of requests served over one persistent connection before it's closed
+#ifndef HTTPD_MAX_KEEPALIVE_REQS
+#define HTTPD_MAX_KEEPALIVE_REQS 16
+#endif
+//Time, in seconds, an idle persistent connection is kept open
+#ifndef HTTPD_KEEPALIVE_TIMEOUT
+#define HTTPD_KEEPALIVE_TIMEOUT 10
+#endif
+//Time, in seconds, a client gets to send the complete head of a request. For the first
+//request this counts from the moment it connects.
+#ifndef HTTPD_HEAD_TIMEOUT
+#define HTTPD_HEAD_TIMEOUT 5
+#endif
+//Max time, in seconds, between two pieces of a request body
+#ifndef HTTPD_BODY_TIMEOUT
+#define HTTPD_BODY_TIMEOUT 10
+#endif
+//Time, in seconds, after which the stack closes a connection nothing went over, whatever
+//state it is in. Catches responses that got stuck; the timeouts above are enforced by httpd
+//itself.
+#ifndef HTTPD_STALL_TIMEOUT
+#define HTTPD_STALL_TIMEOUT 60
+#endif
+//Interval, in ms, at which connections are checked for passed deadlines
+#define HTTPD_REAPER_INTERVAL 1000
+//Amount of connections the stack takes on top of the pool, so clients that come in when
+//every slot is busy can be told to come back later instead of just being refused
+#ifndef HTTPD_BUSY_CONNS
+#define HTTPD_BUSY_CONNS 2
+#endif
+//Seconds a client that got the busy response is asked to wait before trying again
+#ifndef HTTPD_BUSY_RETRY_AFTER
+#define HTTPD_BUSY_RETRY_AFTER 2
+#endif
+//A response that has sent this many bytes is a bulk transfer, like a big file or a flash dump.
+//Responses that are shorter always get to send right away.
+#ifndef HTTPD_BULK_BYTES
+#define HTTPD_BULK_BYTES 4096
+#endif
+//Bulk transfers only get to send more while less than this many bytes of all connections
+//together are in flight. They take turns, one call of their cgi each.
+#ifndef HTTPD_SEND_BUDGET
+#define HTTPD_SEND_BUDGET 4096
+#endif
+
+#define HTTPD_STR(x) #x
+#define HTTPD_XSTR(x) HTTPD_STR(x)
 
 //This gets set at init time.
 static HttpdBuiltInUrl *builtInUrls;
 
+//Amount of hash buckets for the literal urls in the router
+#define ROUTE_BUCKETS 16
+//Max amount of internal rewrites for one request
+#define MAX_REWRITES 4
+
+//Counters for the requests answered by an entry of builtInUrls. Latency is from the first
+//byte of the request to the last byte of the response being sent, or the connection closing.
+typedef struct {
+	uint32_t count; //requests answered
+	uint32_t cgiCalls; //times the cgi got called, including for requests it passed on
+	uint64_t totalUs;
+	uint32_t maxUs;
+	uint32_t bytes; //bytes sent, headers included
+} HttpdRouteStats;
+
+//Router info for an entry of builtInUrls, precomputed at init time so matching a request url
+//doesn't need to look at the url strings of entries that can't match.
+typedef struct {
+	uint16_t hash; //hash of the url, for literal urls
+	uint16_t len; //length of the url, minus the '*' for wildcard urls
+	char wild; //1 if this is a wildcard url
+	short next; //index of the next entry in the same bucket/wildcard list, or -1
+	HttpdRouteStats stats;
+} HttpdRoute;
+
+static HttpdRoute *routes;
+static int routeCnt;
+//Counters for the requests no entry wanted to answer
+static HttpdRouteStats notFoundStats;
+//Value of HttpdPriv.route for requests that get a 404
+#define ROUTE_NOTFOUND (-2)
+//Literal urls, by hash. Each list is in builtInUrls order.
+static short routeBucket[ROUTE_BUCKETS];
+//All wildcard urls, in builtInUrls order.
+static short routeWild;
+
+//State of a walk through the entries that match an url
+typedef struct {
+	const char *url;
+	int len;
+	uint16_t hash;
+	short lit;
+	short wild;
+} HttpdRouteIter;
+
+//States of the request head parser. The parser is fed byte-by-byte and can stop and resume
+//at any point, so headers split over several TCP segments don't need any special care.
+#define HST_METHOD 0
+#define HST_URL 1
+#define HST_QUERY 2
+#define HST_VERSION 3
+#define HST_LINESTART 4
+#define HST_NAME 5
+#define HST_VALSTART 6
+#define HST_VALUE 7
+#define HST_DONE 8
+
+//Flags for the state of the request and the response to it
+#define HFL_CLIENTKEEPALIVE (1<<0) //Client can do persistent connections
+#define HFL_STATUSSENT (1<<1) //A status line has been sent for this response
+#define HFL_HAVELEN (1<<2) //The response has a Content-Length header
+#define HFL_CONNHDR (1<<3) //The cgi has sent its own Connection header
+#define HFL_KEEPALIVE (1<<4) //Connection stays open after this response
+#define HFL_SENDPENDING (1<<5) //Waiting for the sent callback of data we gave to espconn
+#define HFL_CLIENT11 (1<<6) //Client speaks HTTP/1.1, so it understands chunked encoding
+#define HFL_HDRPENDING (1<<7) //Headers are ended but the framing of the body isn't decided yet
+#define HFL_CHUNKED (1<<8) //Response body is sent with chunked transfer-encoding
+#define HFL_CGIDONE (1<<9) //The cgi is done with this request
+#define HFL_INBODY (1<<10) //The headers are ended; what the cgi sends now is body
+#define HFL_CGIPENDING (1<<11) //The cgi is waiting for something and calls httpdResume when it's there
+#define HFL_WAITTURN (1<<12) //Bulk transfer that waits for its turn to send more
+#define HFL_FLUSH (1<<13) //The cgi wants what it made so far sent right away
+#define HFL_ABORTED (1<<14) //The cgi broke off the response; the client mustn't take it as complete
+#define HFL_HEADTOOBIG (1<<15) //The request head doesn't fit in HTTPD_MAX_HEAD_LEN
+#define HFL_BODYCODED (1<<16) //The request body has a Transfer-Encoding, so httpd can't tell where it ends
+
+//What the deadline of a connection is for. Idle and head connections can be evicted to make
+//room for a new client.
+#define HDL_NONE 0 //Request is being answered; no deadline
+#define HDL_HEAD 1 //Waiting for the head of a request
+#define HDL_BODY 2 //Waiting for more of the request body
+#define HDL_IDLE 3 //Persistent connection waiting for the next request
+
+//Where an arg of the request lives. Offsets are into the head for GET args, and into the
+//POST buffer for POST args.
+typedef struct {
+	uint16_t nameOff;
+	uint16_t valOff;
+	uint16_t valLen;
+	uint8_t nameLen;
+	uint8_t inPost;
+} HttpdArg;
+
 //Private data for http connection
 struct HttpdPriv {
-	char head[MAX_HEAD_LEN];
+	char *head; //room for the request head in headArena, or NULL if there's no request
+	int headSize;
 	int headPos;
-	char *sendBuff;
+	char headState;
+	int lineStart; //offset in head of the name of the header being parsed
+	uint32_t nameHash; //hash of the header name being parsed, so far
+	uint16_t hdrHash[MAX_HEADERS]; //hashes of the names of the headers in head...
+	uint16_t hdrOff[MAX_HEADERS]; //...and the offsets of those names
+	int hdrCnt;
+	HttpdArg args[MAX_ARGS];
+	int argCnt; //amount of entries in args, or -1 if the args haven't been looked at yet
+	int flags;
+	int reqCount; //amount of requests handled on this connection
+	char *sendBuff; //output waiting for espconn, taken from the send buffer pool when needed
 	int sendBuffLen;
+	int hdrEndPos; //offset in sendBuff where the framing headers go, if HFL_HDRPENDING
+	int chunkStart; //offset in sendBuff where the body data of the next chunk starts
+	char *backlog; //data received after the end of the current request, if any
+	int backlogLen;
+	short route; //entry of builtInUrls answering the request, ROUTE_NOTFOUND, or -1 if none yet
+	short status; //status code of the response, or 0 if the cgi hasn't sent a status line
+	int bodyStart; //offset in sendBuff where the response body starts
+	int bodySkipped; //amount of body bytes dropped because the request is a HEAD
+	int postChunk; //size of the POST chunks the cgi asked for with httpdSetPostChunk, or 0
+	int postStart; //body offset from which those are counted
+	uint32_t reqStart; //system_get_time() of the first byte of the request
+	int respBytes; //amount of bytes of the response handed to espconn so far
+	int inFlight; //amount of bytes handed to espconn that it hasn't reported sent yet
+	char deadlineKind; //one of HDL_*
+	uint32_t deadline; //system_get_time() at which the connection gets closed
 };
 
 //Connection pool
 static HttpdPriv connPrivData[MAX_CONN];
 static HttpdConnData connData[MAX_CONN];
 static HttpdPostData connPostData[MAX_CONN];
+//Amount of slots at the start of the pool that have ever been used
+static int connUsed;
+//Stack of indexes of retired slots, ready for re-use
+static int connFree[MAX_CONN];
+static int connFreeCnt;
+
+//Where the heads of the requests live
+static char headArena[HTTPD_HEAD_ARENA];
+
+//Send buffers that aren't in use by any connection
+static char *sendBuffSpare[HTTPD_SPARE_SENDBUFFS];
+static int sendBuffSpareCnt;
 
 //Listening connection data
 static struct espconn httpdConn;
 static esp_tcp httpdTcp;
 
-//Struct to keep extension->mime data in
-typedef struct {
-	const char *ext;
-	const char *mimetype;
-} MimeMap;
-
-//The mappings from file extensions to mime types. If you need an extra mime type,
-//add it here.
-static const MimeMap mimeTypes[]={
-	{"htm", "text/htm"},
-	{"html", "text/html"},
-	{"css", "text/css"},
-	{"js", "text/javascript"},
-	{"txt", "text/plain"},
-	{"jpg", "image/jpeg"},
-	{"jpeg", "image/jpeg"},
-	{"png", "image/png"},
-	{"svg", "image/svg+xml"},
-	{NULL, "text/html"}, //default value
-};
+//Timer that closes connections that are past their deadline. Only runs while there are any.
+static ETSTimer reaperTimer;
+static int reaperArmed;
+
+//Amount of bytes in flight on all connections together, and the slot where the scheduler
+//starts looking for a bulk transfer that can send more
+static int sendInFlight;
+static int sendTurn;
+
+//Canned response for clients that connect while all slots are busy. It's sent without taking
+//a slot, so it can't be built up the usual way.
+static const char busyResponse[]="HTTP/1.1 503 Service Unavailable\r\nServer: esp8266-httpd/"HTTPDVER"\r\n"
+		"Retry-After: "HTTPD_XSTR(HTTPD_BUSY_RETRY_AFTER)"\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+//Same, for a request with a head that's longer than HTTPD_MAX_HEAD_LEN
+static const char headTooBigResponse[]="HTTP/1.1 431 Request Header Fields Too Large\r\nServer: esp8266-httpd/"HTTPDVER"\r\n"
+		"Content-Length: 0\r\nConnection: close\r\n\r\n";
+//And for a request with a body in a Transfer-Encoding, like chunked, that httpd doesn't do
+static const char codedBodyResponse[]="HTTP/1.1 501 Not Implemented\r\nServer: esp8266-httpd/"HTTPDVER"\r\n"
+		"Content-Length: 0\r\nConnection: close\r\n\r\n";
 
 //Returns a static char* to a mime type for a given url to a file.
 const char ICACHE_FLASH_ATTR *httpdGetMimetype(char *url) {
@@ -79,13 +300,27 @@ const char ICACHE_FLASH_ATTR *httpdGetMimetype(char *url) {
 	return mimeTypes[i].mimetype;
 }
 
+//Returns the pool slot the espconn points to through its reverse pointer, or NULL if that
+//doesn't lead to a live slot for this very espconn.
+static HttpdConnData ICACHE_FLASH_ATTR *httpdSlotFromEspconn(struct espconn *espconn) {
+	HttpdConnData *c=(HttpdConnData *)espconn->reverse;
+	if (c<&connData[0] || c>=&connData[connUsed]) return NULL;
+	if (c->conn!=espconn) return NULL;
+	return c;
+}
+
 //Looks up the connData info for a specific esp connection
 static HttpdConnData ICACHE_FLASH_ATTR *httpdFindConnData(void *arg) {
 	struct espconn *espconn = arg;
-	for (int i=0; i<MAX_CONN; i++) {
-		if (connData[i].remote_port == espconn->proto.tcp->remote_port &&
+	HttpdConnData *c=httpdSlotFromEspconn(espconn);
+	int i;
+	if (c!=NULL) return c;
+	//Not found through the reverse pointer. Fall back to looking at the remote address.
+	for (i=0; i<connUsed; i++) {
+		if (connData[i].conn!=NULL && connData[i].remote_port == espconn->proto.tcp->remote_port &&
 						os_memcmp(connData[i].remote_ip, espconn->proto.tcp->remote_ip, 4) == 0) {
 			if (arg != connData[i].conn) connData[i].conn = arg; // yes, this happens!?
+			espconn->reverse=&connData[i];
 			return &connData[i];
 		}
 	}
@@ -95,14 +330,284 @@ static HttpdConnData ICACHE_FLASH_ATTR *httpdFindConnData(void *arg) {
 }
 
 
+//Get a send buffer from the pool. Returns NULL if there's no memory for one.
+static char ICACHE_FLASH_ATTR *httpdSendBuffGet(void) {
+	if (sendBuffSpareCnt>0) return sendBuffSpare[--sendBuffSpareCnt];
+	return (char*)os_malloc(MAX_SENDBUFF_LEN+SENDBUFF_SLACK);
+}
+
+//Hand the send buffer of a connection back to the pool. Anything still in it is lost.
+static void ICACHE_FLASH_ATTR httpdSendBuffRelease(HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	if (priv->sendBuff!=NULL) {
+		if (sendBuffSpareCnt<HTTPD_SPARE_SENDBUFFS) {
+			sendBuffSpare[sendBuffSpareCnt++]=priv->sendBuff;
+		} else {
+			os_free(priv->sendBuff);
+		}
+	}
+	priv->sendBuff=NULL;
+	priv->sendBuffLen=0;
+	priv->chunkStart=0;
+	priv->bodyStart=0;
+}
+
+//Returns the counters for a route, as stored in HttpdPriv.route, or NULL for none.
+static HttpdRouteStats ICACHE_FLASH_ATTR *httpdRouteStats(int route) {
+	if (route==ROUTE_NOTFOUND) return &notFoundStats;
+	if (route<0) return NULL;
+	return &routes[route].stats;
+}
+
+//Adds the request that's being answered to the counters of its route.
+static void ICACHE_FLASH_ATTR httpdStatsDone(HttpdConnData *conn) {
+	HttpdRouteStats *st=httpdRouteStats(conn->priv->route);
+	uint32_t t;
+	if (st==NULL) return;
+	t=system_get_time()-conn->priv->reqStart;
+	st->count++;
+	st->totalUs+=t;
+	if (t>st->maxUs) st->maxUs=t;
+	conn->priv->route=-1;
+}
+
+//Counts bytes handed to espconn for the request that's being answered.
+static void ICACHE_FLASH_ATTR httpdStatsSent(HttpdConnData *conn, int len) {
+	HttpdRouteStats *st=httpdRouteStats(conn->priv->route);
+	if (st!=NULL) st->bytes+=len;
+	conn->priv->respBytes+=len;
+	conn->priv->inFlight+=len;
+	sendInFlight+=len;
+}
+
+//Forgets about the bytes of a connection that were in flight: they're sent, or they never will be.
+static void ICACHE_FLASH_ATTR httpdInFlightDone(HttpdConnData *conn) {
+	sendInFlight-=conn->priv->inFlight;
+	conn->priv->inFlight=0;
+}
+
+//Returns where the free room in the arena from offset start on ends: where the first head after
+//it starts, not counting the head of skip.
+static int ICACHE_FLASH_ATTR httpdHeadRoomEnd(int start, HttpdPriv *skip) {
+	int i, end=HTTPD_HEAD_ARENA;
+	for (i=0; i<connUsed; i++) {
+		char *head=connPrivData[i].head;
+		if (head==NULL || &connPrivData[i]==skip) continue;
+		if (head-headArena>=start && head-headArena<end) end=head-headArena;
+	}
+	return end;
+}
+
+//Looks for a stretch of free room in the arena of at least want bytes; the room the head of skip
+//takes counts as free. Of the stretches that are big enough it returns the offset of the first
+//one if first is set, or else of the biggest one; -1 if there's none.
+static int ICACHE_FLASH_ATTR httpdHeadFind(HttpdPriv *skip, int want, int first) {
+	int i, start, len, best=-1, bestLen=0;
+	//A free stretch starts at the start of the arena or at the end of a head.
+	for (i=-1; i<connUsed; i++) {
+		if (i<0) {
+			start=0;
+		} else if (connPrivData[i].head!=NULL && &connPrivData[i]!=skip) {
+			start=connPrivData[i].head-headArena+connPrivData[i].headSize;
+		} else {
+			continue;
+		}
+		len=httpdHeadRoomEnd(start, skip)-start;
+		if (len<want) continue;
+		if (best<0 || (first?start<best:len>bestLen)) {
+			best=start;
+			bestLen=len;
+		}
+	}
+	return best;
+}
+
+//Takes HEAD_MIN_LEN bytes of room for a request head from the arena, at the start of its biggest
+//free stretch so it has room to grow. Returns 0 if there's no stretch that big.
+static int ICACHE_FLASH_ATTR httpdHeadAlloc(HttpdPriv *priv) {
+	int start=httpdHeadFind(NULL, HEAD_MIN_LEN, 0);
+	if (start<0) return 0;
+	priv->head=headArena+start;
+	priv->headSize=HEAD_MIN_LEN;
+	return 1;
+}
+
+//Moves a request head to offset to in the arena. The parts of the request that are pointers
+//into the head rather than offsets go along. Only done before the cgi gets to see the request.
+static void ICACHE_FLASH_ATTR httpdHeadMove(HttpdConnData *conn, int to) {
+	HttpdPriv *priv=conn->priv;
+	int d=(headArena+to)-priv->head;
+	if (d==0) return;
+	os_memmove(headArena+to, priv->head, priv->headPos);
+	priv->head+=d;
+	if (conn->url!=NULL) conn->url+=d;
+	if (conn->getArgs!=NULL) conn->getArgs+=d;
+	if (conn->hostName!=NULL) conn->hostName+=d;
+	if (conn->post->multipartBoundary!=NULL) conn->post->multipartBoundary+=d;
+}
+
+//Gives a request head that's full twice the room, up to HTTPD_MAX_HEAD_LEN. That's in place if
+//the arena after it is free; otherwise the head moves to the biggest stretch that fits it. If
+//there's no stretch that big, it makes do with the biggest one there is. Returns 0 if there's
+//no more room for it anywhere.
+static int ICACHE_FLASH_ATTR httpdHeadGrow(HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	int at=priv->head-headArena, size=priv->headSize*2;
+	if (size>HTTPD_MAX_HEAD_LEN) size=HTTPD_MAX_HEAD_LEN;
+	if (httpdHeadRoomEnd(at, priv)-at<size) {
+		at=httpdHeadFind(priv, size, 0);
+		if (at<0) {
+			at=httpdHeadFind(priv, priv->headSize+1, 0);
+			if (at<0) return 0;
+			size=httpdHeadRoomEnd(at, priv)-at;
+		}
+		httpdHeadMove(conn, at);
+	}
+	priv->headSize=size;
+	return 1;
+}
+
+//Gives back the room a complete head didn't use, and moves the head down to the first free room
+//that fits it. That way the heads of requests that are being answered, which can stay around
+//for a long time, are packed at the start of the arena and don't cut up the room that's left.
+static void ICACHE_FLASH_ATTR httpdHeadTrim(HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	int at;
+	priv->headSize=(priv->headPos>0)?priv->headPos:1;
+	at=httpdHeadFind(priv, priv->headSize, 1);
+	if (at>=0 && at<priv->head-headArena) httpdHeadMove(conn, at);
+}
+
+//Hands the room for the request head back to the arena.
+static void ICACHE_FLASH_ATTR httpdHeadRelease(HttpdPriv *priv) {
+	priv->head=NULL;
+	priv->headSize=0;
+	priv->headPos=0;
+}
+
+//Resets the per-request state of a connection, so it's ready to receive a new request.
+static void ICACHE_FLASH_ATTR httpdResetRequest(HttpdConnData *conn) {
+	conn->priv->route=-1;
+	conn->priv->status=0;
+	conn->priv->bodyStart=0;
+	conn->priv->bodySkipped=0;
+	conn->priv->postChunk=0;
+	conn->priv->postStart=0;
+	conn->priv->respBytes=0;
+	httpdHeadRelease(conn->priv);
+	conn->priv->headState=HST_METHOD;
+	conn->priv->hdrCnt=0;
+	conn->priv->argCnt=-1;
+	conn->priv->flags=0;
+	if (conn->post->buff!=NULL) os_free(conn->post->buff);
+	conn->post->buff=NULL;
+	conn->post->buffLen=0;
+	conn->post->received=0;
+	conn->post->len=0;
+	conn->post->multipartBoundary=NULL;
+	conn->requestType=0;
+	conn->url=NULL;
+	conn->getArgs=NULL;
+	conn->hostName=NULL;
+	conn->cgi=NULL;
+	conn->cgiData=NULL;
+	conn->cgiPrivData=NULL;
+	conn->recvHdl=NULL;
+}
+
 //Retires a connection for re-use
 static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
+	httpdStatsDone(conn); //in case it got closed halfway through a response
 	if (conn->post->buff!=NULL) os_free(conn->post->buff);
 	conn->post->buff=NULL;
+	if (conn->priv->backlog!=NULL) os_free(conn->priv->backlog);
+	conn->priv->backlog=NULL;
+	conn->priv->backlogLen=0;
+	httpdHeadRelease(conn->priv);
 	conn->cgi=NULL;
 	conn->conn=NULL;
+	conn->priv->flags&=~HFL_WAITTURN;
+	httpdInFlightDone(conn);
+	httpdSendBuffRelease(conn);
 	conn->remote_port=0;
 	os_memset(conn->remote_ip, 0, 4);
+	connFree[connFreeCnt++]=conn-connData;
+}
+
+//Gives a connection timeout seconds from now to get through what it's doing; kind is one of
+//the HDL_* values.
+static void ICACHE_FLASH_ATTR httpdSetDeadline(HttpdConnData *conn, char kind, int timeout) {
+	conn->priv->deadlineKind=kind;
+	conn->priv->deadline=system_get_time()+timeout*1000000;
+}
+
+//Closes a connection from our side and retires its slot right away. The disconnect callback
+//comes in later, but by then the slot doesn't belong to that espconn anymore.
+static void ICACHE_FLASH_ATTR httpdKillConn(HttpdConnData *conn) {
+	struct espconn *espconn=conn->conn;
+	conn->conn=NULL;
+	if (conn->cgi!=NULL) conn->cgi(conn); //let the cgi clean up
+	httpdRetireConn(conn);
+	espconn_disconnect(espconn);
+}
+
+//Picks the connection to close to make room: of those that aren't working on a request, the one
+//that has been at it the longest. Those are the idle ones and the ones still sending a request
+//head, or with heads set only the latter that have room in the head arena. except is never
+//picked. Returns NULL if there's none.
+static HttpdConnData ICACHE_FLASH_ATTR *httpdEvictPick(int heads, HttpdConnData *except) {
+	HttpdConnData *victim=NULL;
+	uint32_t since, victimSince=0;
+	int i;
+	for (i=0; i<connUsed; i++) {
+		HttpdPriv *priv=connData[i].priv;
+		if (connData[i].conn==NULL || connData[i].cgi!=NULL || (priv->flags&HFL_SENDPENDING)) continue;
+		if (&connData[i]==except) continue;
+		if (priv->deadlineKind==HDL_IDLE && !heads) {
+			since=priv->deadline-HTTPD_KEEPALIVE_TIMEOUT*1000000;
+		} else if (priv->deadlineKind==HDL_HEAD && (priv->head!=NULL || !heads)) {
+			since=priv->deadline-HTTPD_HEAD_TIMEOUT*1000000;
+		} else {
+			continue;
+		}
+		if (victim==NULL || (int32_t)(since-victimSince)<0) {
+			victim=&connData[i];
+			victimSince=since;
+		}
+	}
+	return victim;
+}
+
+//Makes room in the head arena for the request of conn by closing the connection that has been
+//sending its request head the longest. Returns 0 if there's none.
+static int ICACHE_FLASH_ATTR httpdHeadEvict(HttpdConnData *conn) {
+	HttpdConnData *victim=httpdEvictPick(1, conn);
+	if (victim==NULL) return 0;
+	os_printf("Head arena full. Evicting conn %p.\n", victim->conn);
+	httpdKillConn(victim);
+	return 1;
+}
+
+//Case-insensitive compare of two zero-terminated strings. Returns 1 if they're the same.
+static int ICACHE_FLASH_ATTR httpdStrEqNoCase(const char *a, const char *b) {
+	while (*a!=0 && *b!=0) {
+		char ca=*a++, cb=*b++;
+		if (ca>='A' && ca<='Z') ca+='a'-'A';
+		if (cb>='A' && cb<='Z') cb+='a'-'A';
+		if (ca!=cb) return 0;
+	}
+	return (*a==*b);
+}
+
+//Case-insensitive check if string s starts with prefix. Returns 1 if it does.
+static int ICACHE_FLASH_ATTR httpdStrPrefixNoCase(const char *s, const char *prefix) {
+	while (*prefix!=0) {
+		char cs=*s++, cp=*prefix++;
+		if (cs>='A' && cs<='Z') cs+='a'-'A';
+		if (cp>='A' && cp<='Z') cp+='a'-'A';
+		if (cs!=cp) return 0;
+	}
+	return 1;
 }
 
 //Stupid li'l helper function that returns the value of a hex char.
@@ -160,44 +665,202 @@ int ICACHE_FLASH_ATTR httpdFindArg(char *line, char *arg, char *buff, int buffLe
 		p=(char*)os_strstr(p, "&");
 		if (p!=NULL) p+=1;
 	}
-	os_printf("Finding %s in %s: Not found :/\n", arg, line);
 	return -1; //not found
 }
 
-//Get the value of a certain header in the HTTP client head
-int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
-	char *p=conn->priv->head;
-	p=p+strlen(p)+1; //skip GET/POST part
-	p=p+strlen(p)+1; //skip HTTP part
-	while (p<(conn->priv->head+conn->priv->headPos)) {
-		while(*p<=32 && *p!=0) p++; //skip crap at start
-		//See if this is the header
-		if (os_strncmp(p, header, strlen(header))==0 && p[strlen(header)]==':') {
-			//Skip 'key:' bit of header line
-			p=p+strlen(header)+1;
-			//Skip past spaces after the colon
-			while(*p==' ') p++;
-			//Copy from p to end
-			while (*p!=0 && *p!='\r' && *p!='\n' && retLen>1) {
-				*ret++=*p++;
-				retLen--;
-			}
-			//Zero-terminate string
-			*ret=0;
-			//All done :)
+//Splits the next arg off a string of get- or post-data that starts at *p, and moves *p past it.
+//Offsets in *a are from base. Args without a name, or that are too long for the arg table, are
+//skipped. Returns 0 if there are no more args in the string.
+static int ICACHE_FLASH_ATTR httpdArgNext(char **p, char *base, int inPost, HttpdArg *a) {
+	char *n, *e, *v;
+	while (**p!=0 && **p!='\r' && **p!='\n') {
+		n=*p;
+		while (**p!=0 && **p!='=' && **p!='&' && **p!='\r' && **p!='\n') (*p)++;
+		e=v=*p;
+		if (**p=='=') {
+			v=++(*p);
+			while (**p!=0 && **p!='&' && **p!='\r' && **p!='\n') (*p)++;
+		}
+		if (e-n>0 && e-n<256 && *p-v<0x10000) {
+			a->nameOff=n-base;
+			a->nameLen=e-n;
+			a->valOff=v-base;
+			a->valLen=*p-v;
+			a->inPost=inPost;
+			if (**p=='&') (*p)++;
 			return 1;
 		}
-		p+=strlen(p)+1; //Skip past end of string and \0 terminator
+		if (**p=='&') (*p)++;
 	}
 	return 0;
 }
 
+//Add the args in a string of get- or post-data to the arg table of the request, as far as they
+//fit. The string is only split up here; values are url-decoded when they're asked for.
+static void ICACHE_FLASH_ATTR httpdArgsScan(HttpdPriv *priv, char *line, char *base, int inPost) {
+	char *p=line;
+	while (priv->argCnt<MAX_ARGS && httpdArgNext(&p, base, inPost, &priv->args[priv->argCnt])) priv->argCnt++;
+}
+
+//Returns 1 if the POST data can have args: it's urlencoded and all of it is in the POST buffer.
+static int ICACHE_FLASH_ATTR httpdPostHasArgs(HttpdConnData *conn) {
+	HttpdPostData *post=conn->post;
+	return post->buff!=NULL && post->received==post->len && post->len<=post->buffSize &&
+			post->multipartBoundary==NULL;
+}
+
+//Find an arg of the request. The first time this is called, the GET args and the POST data,
+//if it has args, are split up into the arg table. Returns 1 and fills in *ret if the arg is
+//there, 0 if it's not.
+static int ICACHE_FLASH_ATTR httpdArgFind(HttpdConnData *conn, const char *name, HttpdArg *ret) {
+	HttpdPriv *priv=conn->priv;
+	HttpdPostData *post=conn->post;
+	HttpdArg *a;
+	char *base, *p;
+	int i, inPost, len=os_strlen(name);
+	if (priv->argCnt<0) {
+		priv->argCnt=0;
+		if (conn->getArgs!=NULL) httpdArgsScan(priv, conn->getArgs, priv->head, 0);
+		if (httpdPostHasArgs(conn)) httpdArgsScan(priv, post->buff, post->buff, 1);
+	}
+	for (i=0; i<priv->argCnt; i++) {
+		a=&priv->args[i];
+		base=a->inPost?post->buff:priv->head;
+		if (a->nameLen==len && os_strncmp(base+a->nameOff, name, len)==0) {
+			*ret=*a;
+			return 1;
+		}
+	}
+	if (priv->argCnt<MAX_ARGS) return 0;
+	//Table is full, so there may be more args after the last one in it: the rest of its string,
+	//and the POST args if it's a GET arg. Go through those the slow way.
+	a=&priv->args[MAX_ARGS-1];
+	inPost=a->inPost;
+	base=inPost?post->buff:priv->head;
+	p=base+a->valOff+a->valLen;
+	while (1) {
+		while (httpdArgNext(&p, base, inPost, ret)) {
+			if (ret->nameLen==len && os_strncmp(base+ret->nameOff, name, len)==0) return 1;
+		}
+		if (inPost || !httpdPostHasArgs(conn)) return 0;
+		inPost=1;
+		base=p=post->buff;
+	}
+}
+
+//Get the value of an arg of the request, from the GET args or from urlencoded POST data.
+//The url-decoded, zero-terminated value is written in buff, using at most buffLen bytes.
+//Returns the length of the value, or -1 if the arg isn't there.
+int ICACHE_FLASH_ATTR httpdGetArg(HttpdConnData *conn, const char *name, char *buff, int buffLen) {
+	HttpdArg a;
+	char *base;
+	int len;
+	if (buffLen<=0) return -1;
+	if (!httpdArgFind(conn, name, &a)) {
+		buff[0]=0;
+		return -1;
+	}
+	base=a.inPost?conn->post->buff:conn->priv->head;
+	len=httpdUrlDecode(base+a.valOff, a.valLen, buff, buffLen-1);
+	buff[len]=0;
+	return len;
+}
+
+//Get the value of an arg of the request as an integer. Returns def if the arg isn't there
+//or is empty.
+int ICACHE_FLASH_ATTR httpdGetArgInt(HttpdConnData *conn, const char *name, int def) {
+	char buff[16];
+	if (httpdGetArg(conn, name, buff, sizeof(buff))<=0) return def;
+	return atoi(buff);
+}
+
+//One step of the hash of header names. Header names are case-insensitive, so this hashes
+//the lowercase version of c.
+static uint32_t ICACHE_FLASH_ATTR httpdHdrHashStep(uint32_t h, char c) {
+	if (c>='A' && c<='Z') c+='a'-'A';
+	return (h^(uint8_t)c)*16777619u;
+}
+
+//Get the value of a certain header in the HTTP client head. The parser keeps an index of the
+//hashes of the header names, so this only needs to compare strings for headers that are very
+//likely to be the right one. Header names are compared case-insensitively.
+int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
+	HttpdPriv *priv=conn->priv;
+	char *p=NULL, *end, *v;
+	uint32_t h=2166136261u;
+	uint16_t hash;
+	int i;
+	for (i=0; header[i]!=0; i++) h=httpdHdrHashStep(h, header[i]);
+	hash=(uint16_t)(h^(h>>16));
+	for (i=0; i<priv->hdrCnt; i++) {
+		if (priv->hdrHash[i]==hash && httpdStrEqNoCase(priv->head+priv->hdrOff[i], header)) {
+			p=priv->head+priv->hdrOff[i];
+			break;
+		}
+	}
+	if (p==NULL && priv->hdrCnt==MAX_HEADERS) {
+		//Index is full, so there may be more headers after the last indexed one. These are
+		//stored as consecutive zero-terminated name and value strings.
+		p=priv->head+priv->hdrOff[MAX_HEADERS-1];
+		p+=os_strlen(p)+1;
+		p+=os_strlen(p)+1;
+		end=priv->head+priv->headPos;
+		while (p<end && !httpdStrEqNoCase(p, header)) {
+			p+=os_strlen(p)+1; //Skip past name...
+			p+=os_strlen(p)+1; //...and value
+		}
+		if (p>=end) p=NULL;
+	}
+	if (p==NULL) return 0;
+	v=p+os_strlen(p)+1;
+	//Copy value to ret
+	while (*v!=0 && retLen>1) {
+		*ret++=*v++;
+		retLen--;
+	}
+	//Zero-terminate string
+	*ret=0;
+	//All done :)
+	return 1;
+}
+
+//Returns the reason phrase for a status code.
+static const char ICACHE_FLASH_ATTR *httpdStatusText(int code) {
+	switch (code) {
+	case 101: return "Switching Protocols";
+	case 200: return "OK";
+	case 206: return "Partial Content";
+	case 302: return "Found";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 401: return "Unauthorized";
+	case 404: return "Not Found";
+	case 416: return "Range Not Satisfiable";
+	case 500: return "Internal Server Error";
+	case 501: return "Not Implemented";
+	case 503: return "Service Unavailable";
+	default: return "OK";
+	}
+}
+
 //Start the response headers.
 void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code) {
 	char buff[128];
 	int l;
-	l=os_sprintf(buff, "HTTP/1.0 %d OK\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\n", code);
+	l=os_sprintf(buff, "HTTP/1.1 %d %s\r\nServer: esp8266-httpd/"HTTPDVER"\r\n", code, httpdStatusText(code));
 	httpdSend(conn, buff, l);
+	conn->priv->flags|=HFL_STATUSSENT;
+	conn->priv->status=code;
+}
+
+//Start the response with ready-made headers, like the ones mkespfsimage stores with a file:
+//the status line for code, then header lines. Give hasLen if there's a Content-Length among
+//them. Add any other headers and end them as usual.
+void ICACHE_FLASH_ATTR httpdStartResponseHeaders(HttpdConnData *conn, int code, const char *hdrs, int len, int hasLen) {
+	httpdSend(conn, hdrs, len);
+	conn->priv->flags|=HFL_STATUSSENT;
+	if (hasLen) conn->priv->flags|=HFL_HAVELEN;
+	conn->priv->status=code;
 }
 
 //Send a http header.
@@ -205,13 +868,153 @@ void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const
 	char buff[256];
 	int l;
 
+	if (httpdStrEqNoCase(field, "Content-Length")) conn->priv->flags|=HFL_HAVELEN;
+	if (httpdStrEqNoCase(field, "Connection")) conn->priv->flags|=HFL_CONNHDR;
 	l=os_sprintf(buff, "%s: %s\r\n", field, val);
 	httpdSend(conn, buff, l);
 }
 
-//Finish the headers.
+//Send a Content-Length header for a response body of len bytes.
+void ICACHE_FLASH_ATTR httpdSendLength(HttpdConnData *conn, int len) {
+	char buff[16];
+	os_sprintf(buff, "%d", len);
+	httpdHeader(conn, "Content-Length", buff);
+}
+
+//Returns 1 if the connection can be kept open after the current response.
+static int ICACHE_FLASH_ATTR httpdCanKeepAlive(HttpdConnData *conn) {
+	return (conn->priv->flags&HFL_CLIENTKEEPALIVE) && conn->priv->reqCount<HTTPD_MAX_KEEPALIVE_REQS-1;
+}
+
+//Finish the headers. This also decides if the connection can stay open after the response:
+//that needs a client that supports it and a response of which the end can be found. If the
+//cgi didn't send a Content-Length, that decision is made when the send buffer is flushed: by
+//then we know if the complete response is in the buffer or if the cgi is going to stream it.
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	if (!(priv->flags&HFL_CONNHDR)) {
+		if (!(priv->flags&HFL_HAVELEN)) {
+			priv->flags|=HFL_HDRPENDING;
+			priv->hdrEndPos=priv->sendBuffLen;
+		} else if (httpdCanKeepAlive(conn)) {
+			priv->flags|=HFL_KEEPALIVE;
+			httpdSend(conn, "Connection: keep-alive\r\n", -1);
+		} else {
+			httpdSend(conn, "Connection: close\r\n", -1);
+		}
+	}
 	httpdSend(conn, "\r\n", -1);
+	priv->bodyStart=priv->sendBuffLen;
+	priv->flags|=HFL_INBODY;
+}
+
+//Parses a number at *p and moves *p past it. Returns -1 if there's no number there, or if it's
+//too big for an int; *p is left in the middle of it then, so it doesn't look like it ended.
+static int ICACHE_FLASH_ATTR httpdParseNum(char **p) {
+	int n=0, d;
+	if (**p<'0' || **p>'9') return -1;
+	while (**p>='0' && **p<='9') {
+		d=**p-'0';
+		if (n>(INT_MAX-d)/10) return -1;
+		n=n*10+d;
+		(*p)++;
+	}
+	return n;
+}
+
+//Looks at the Range header for a resource of size bytes. Returns 1 and sets *start and *len
+//if it asks for a single range that's (partly) in the resource, -1 if the range is past the
+//end of it, or 0 if the whole resource should be sent: there's no Range, it has more than
+//one range, it doesn't make sense, or it depends on an If-Range that doesn't match etag.
+static int ICACHE_FLASH_ATTR httpdParseRange(HttpdConnData *conn, int size, const char *etag, int *start, int *len) {
+	char buff[64];
+	char *p;
+	int first, last;
+	if (!httpdGetHeader(conn, "Range", buff, sizeof(buff))) return 0;
+	if (!httpdStrPrefixNoCase(buff, "bytes=") || os_strchr(buff, ',')!=NULL) return 0;
+	p=buff+6;
+	first=httpdParseNum(&p);
+	if (*p++!='-') return 0;
+	last=httpdParseNum(&p);
+	if (*p!=0 || (first<0 && last<0) || (last>=0 && last<first)) return 0;
+	//A date in If-Range can't be checked; only send the range if it names our etag.
+	if (httpdGetHeader(conn, "If-Range", buff, sizeof(buff)) && (etag==NULL || os_strcmp(buff, etag)!=0)) return 0;
+	if (first<0) {
+		//Suffix range: the last bytes of the resource
+		if (last==0) return -1;
+		first=(last>size)?0:size-last;
+		last=size-1;
+	}
+	if (first>=size) return -1;
+	if (last<0 || last>=size) last=size-1;
+	*start=first;
+	*len=last-first+1;
+	return 1;
+}
+
+//Starts the response for a resource of size bytes that can be sent in parts, and sends its
+//Content-Length. If the client asked for a part, that's a 206 with *start and *len set to the
+//part to send. A part that isn't in the resource gets a 416 and *len is 0; otherwise it's a 200
+//for the whole thing. etag is the ETag of the resource, or NULL if it has none. Returns the
+//status code; add any other headers and end them as usual.
+int ICACHE_FLASH_ATTR httpdStartRangeResponse(HttpdConnData *conn, int size, const char *etag, int *start, int *len) {
+	char buff[48];
+	int r=httpdParseRange(conn, size, etag, start, len);
+	if (r>0) {
+		httpdStartResponse(conn, 206);
+		os_sprintf(buff, "bytes %d-%d/%d", *start, *start+*len-1, size);
+	} else if (r<0) {
+		httpdStartResponse(conn, 416);
+		os_sprintf(buff, "bytes */%d", size);
+		*start=0;
+		*len=0;
+	} else {
+		httpdStartResponse(conn, 200);
+		*start=0;
+		*len=size;
+	}
+	httpdHeader(conn, "Accept-Ranges", "bytes");
+	if (r!=0) httpdHeader(conn, "Content-Range", buff);
+	httpdSendLength(conn, *len);
+	return conn->priv->status;
+}
+
+//Insert the framing headers for a response that was ended with httpdEndHeaders without a
+//Content-Length. If the cgi is done, the whole body is in the send buffer and we can just
+//tell its length. If not, the body is sent in chunks, if the client understands that.
+static void ICACHE_FLASH_ATTR httpdFinishHeaders(HttpdConnData *conn, int done) {
+	HttpdPriv *priv=conn->priv;
+	char buff[80];
+	int l;
+	if (!(priv->flags&HFL_HDRPENDING)) return;
+	priv->flags&=~HFL_HDRPENDING;
+	if (priv->sendBuff==NULL) return; //headers never made it into the buffer
+	if (conn->requestType==HTTPD_METHOD_HEAD) {
+		//No body follows, so the connection can stay open without any framing. The length of
+		//the body is only known if the cgi went all the way through it.
+		l=0;
+		if (done) l=os_sprintf(buff, "Content-Length: %d\r\n", priv->bodySkipped);
+		if (httpdCanKeepAlive(conn)) {
+			l+=os_sprintf(buff+l, "Connection: keep-alive\r\n");
+			priv->flags|=HFL_KEEPALIVE;
+		} else {
+			l+=os_sprintf(buff+l, "Connection: close\r\n");
+		}
+	} else if (done && httpdCanKeepAlive(conn)) {
+		l=os_sprintf(buff, "Content-Length: %d\r\nConnection: keep-alive\r\n", priv->sendBuffLen-priv->hdrEndPos-2);
+		priv->flags|=HFL_KEEPALIVE;
+	} else if (!done && httpdCanKeepAlive(conn) && (priv->flags&HFL_CLIENT11)) {
+		l=os_sprintf(buff, "Transfer-Encoding: chunked\r\nConnection: keep-alive\r\n");
+		priv->flags|=HFL_KEEPALIVE|HFL_CHUNKED;
+	} else {
+		l=os_sprintf(buff, "Connection: close\r\n");
+	}
+	os_memmove(priv->sendBuff+priv->hdrEndPos+l, priv->sendBuff+priv->hdrEndPos, priv->sendBuffLen-priv->hdrEndPos);
+	os_memcpy(priv->sendBuff+priv->hdrEndPos, buff, l);
+	priv->sendBuffLen+=l;
+	//The body starts after the empty line that ends the headers.
+	priv->chunkStart=priv->hdrEndPos+l+2;
+	priv->bodyStart=priv->chunkStart;
 }
 
 //ToDo: sprintf->snprintf everywhere... esp doesn't have snprintf tho' :/
@@ -219,10 +1022,25 @@ void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn) {
 void ICACHE_FLASH_ATTR httpdRedirect(HttpdConnData *conn, char *newUrl) {
 	char buff[1024];
 	int l;
-	l=os_sprintf(buff, "HTTP/1.1 302 Found\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nLocation: %s\r\n\r\nMoved to %s\r\n", newUrl, newUrl);
+	l=os_sprintf(buff, "Moved to %s\r\n", newUrl);
+	httpdStartResponse(conn, 302);
+	httpdHeader(conn, "Location", newUrl);
+	httpdSendLength(conn, l);
+	httpdEndHeaders(conn);
 	httpdSend(conn, buff, l);
 }
 
+//Use this as a cgi function to serve the request as if it were for another url, without
+//bothering the client with a redirect. The new url is the cgiArg.
+int ICACHE_FLASH_ATTR cgiRewrite(HttpdConnData *connData) {
+	if (connData->conn==NULL) {
+		//Connection aborted. Clean up.
+		return HTTPD_CGI_DONE;
+	}
+	connData->url=(char*)connData->cgiArg;
+	return HTTPD_CGI_REWRITE;
+}
+
 //Use this as a cgi function to redirect one url to another.
 int ICACHE_FLASH_ATTR cgiRedirect(HttpdConnData *connData) {
 	if (connData->conn==NULL) {
@@ -288,56 +1106,396 @@ int ICACHE_FLASH_ATTR cgiRedirectApClientToHostname(HttpdConnData *connData) {
 }
 
 
+//Makes room for len more bytes at the end of the send buffer. Returns where they go, or NULL
+//if they don't fit.
+static char ICACHE_FLASH_ATTR *httpdSendReserve(HttpdConnData *conn, int len) {
+	HttpdPriv *priv=conn->priv;
+	char *p;
+	if (priv->sendBuffLen+len>MAX_SENDBUFF_LEN) return NULL;
+	if (priv->sendBuff==NULL) {
+		priv->sendBuff=httpdSendBuffGet();
+		if (priv->sendBuff==NULL) {
+			os_printf("Out of memory for send buffer!\n");
+			return NULL;
+		}
+	}
+	p=priv->sendBuff+priv->sendBuffLen;
+	priv->sendBuffLen+=len;
+	return p;
+}
+
+//Add data from a number of places to the send buffer, all at once: either all of it is
+//queued or none of it is.
+//Returns 1 for success, 0 if it doesn't fit. If that happens, the data that's already waiting
+//needs to leave first. A cgi should return HTTPD_CGI_MORE and try again when it's called
+//next; that's after the buffer has been sent. When a cgi is called, there's always room for
+//at least MAX_SENDBUFF_LEN-HTTPD_COALESCE_MAX bytes.
+int ICACHE_FLASH_ATTR httpdSendv(HttpdConnData *conn, const HttpdSendVec *vec, int cnt) {
+	HttpdPriv *priv=conn->priv;
+	int i, len=0;
+	char *p;
+	for (i=0; i<cnt; i++) len+=vec[i].len;
+	if ((priv->flags&HFL_INBODY) && conn->requestType==HTTPD_METHOD_HEAD) {
+		//The answer to a HEAD has no body; only count it.
+		priv->bodySkipped+=len;
+		return 1;
+	}
+	p=httpdSendReserve(conn, len);
+	if (p==NULL) return 0;
+	for (i=0; i<cnt; i++) {
+		os_memcpy(p, vec[i].data, vec[i].len);
+		p+=vec[i].len;
+	}
+	return 1;
+}
+
 //Add data to the send buffer. len is the length of the data. If len is -1
 //the data is seen as a C-string.
-//Returns 1 for success, 0 for out-of-memory.
+//Returns 1 for success, 0 if it doesn't fit; see httpdSendv.
 int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len) {
+	HttpdSendVec v;
 	if (len<0) len=strlen(data);
-	if (conn->priv->sendBuffLen+len>MAX_SENDBUFF_LEN) return 0;
-	os_memcpy(conn->priv->sendBuff+conn->priv->sendBuffLen, data, len);
-	conn->priv->sendBuffLen+=len;
-	return 1;
+	v.data=data;
+	v.len=len;
+	return httpdSendv(conn, &v, 1);
+}
+
+//Returns the amount of bytes that can be added to the send buffer right now.
+int ICACHE_FLASH_ATTR httpdSendSpace(HttpdConnData *conn) {
+	return MAX_SENDBUFF_LEN-conn->priv->sendBuffLen;
+}
+
+//For cgis that wrap other cgis: tells what the response the wrapped cgi built looks like.
+//Returns its status code, or 0 if it didn't send a status line, and points *body at the part
+//of the body that's in the send buffer. Returns -1 if some of the response already went out.
+int ICACHE_FLASH_ATTR httpdGetResponse(HttpdConnData *conn, const char **body, int *bodyLen) {
+	HttpdPriv *priv=conn->priv;
+	if ((priv->flags&HFL_SENDPENDING) || priv->sendBuff==NULL) {
+		*body=NULL;
+		*bodyLen=0;
+		return (priv->flags&HFL_SENDPENDING)?-1:priv->status;
+	}
+	*body=priv->sendBuff+priv->bodyStart;
+	*bodyLen=priv->sendBuffLen-priv->bodyStart;
+	return priv->status;
+}
+
+//Give the send buffer to espconn, if it isn't busy sending earlier data. If it is, the data
+//stays in the buffer and goes out from the sent callback.
+static void ICACHE_FLASH_ATTR httpdSendOut(HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	if (priv->sendBuffLen==0 || (priv->flags&HFL_SENDPENDING) || conn->conn==NULL) return;
+	espconn_sent(conn->conn, (uint8_t*)priv->sendBuff, priv->sendBuffLen);
+	httpdStatsSent(conn, priv->sendBuffLen);
+	priv->sendBuffLen=0;
+	priv->chunkStart=0;
+	priv->bodyStart=0;
+	priv->flags|=HFL_SENDPENDING;
+}
+
+//Send out the send buffer. If the response is chunked, the body data in the buffer is framed
+//as a chunk first, and if the cgi is done the terminating empty chunk is added.
+static void ICACHE_FLASH_ATTR httpdFlushResponse(HttpdConnData *conn, int done) {
+	HttpdPriv *priv=conn->priv;
+	httpdFinishHeaders(conn, done);
+	if (priv->flags&HFL_CHUNKED) {
+		char buff[16];
+		int len=priv->sendBuffLen-priv->chunkStart;
+		if (len>0) {
+			int l=os_sprintf(buff, "%x\r\n", len);
+			os_memmove(priv->sendBuff+priv->chunkStart+l, priv->sendBuff+priv->chunkStart, len);
+			os_memcpy(priv->sendBuff+priv->chunkStart, buff, l);
+			priv->sendBuffLen+=l;
+			os_memcpy(priv->sendBuff+priv->sendBuffLen, "\r\n", 2);
+			priv->sendBuffLen+=2;
+		}
+		//A response that's broken off doesn't get the empty chunk that says it's complete.
+		if (done && priv->sendBuff!=NULL && !(priv->flags&HFL_ABORTED)) {
+			os_memcpy(priv->sendBuff+priv->sendBuffLen, "0\r\n\r\n", 5);
+			priv->sendBuffLen+=5;
+		}
+	}
+	//Everything up to here is framed; whatever gets added later is a new chunk.
+	priv->chunkStart=priv->sendBuffLen;
+	httpdSendOut(conn);
+}
+
+//Asks for what the cgi made so far to go out as soon as the cgi returns, instead of the cgi
+//being called again to fill up the TCP segment first. Use this in cgis whose client waits
+//for a part of the response before the rest is there, like the headers of a websocket
+//handshake or an event stream.
+void ICACHE_FLASH_ATTR httpdFlush(HttpdConnData *conn) {
+	conn->priv->flags|=HFL_FLUSH;
+}
+
+//For a cgi that can't finish the response it started, e.g. because its data turns out to be
+//broken halfway. What's sent so far still goes out, but then the connection is closed, so the
+//client can tell from the Content-Length or the missing last chunk that it didn't get it all.
+//Return HTTPD_CGI_DONE after calling this.
+void ICACHE_FLASH_ATTR httpdAbortResponse(HttpdConnData *conn) {
+	os_printf("Conn %p: response broken off. Closing.\n", conn->conn);
+	conn->priv->flags&=~(HFL_CLIENTKEEPALIVE|HFL_KEEPALIVE);
+	conn->priv->flags|=HFL_ABORTED;
 }
 
 //Function to send any data in conn->priv->sendBuff. Do not use in CGIs unless you know what you
-//are doing!
+//are doing; httpdFlush is what a cgi wants. This can be called outside of the httpd callbacks,
+//e.g. from a timer; if espconn is still busy with earlier data, the buffer is sent as soon as
+//that's done.
 void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdConnData *conn) {
-	if (conn->priv->sendBuffLen!=0) {
-		espconn_sent(conn->conn, (uint8_t*)conn->priv->sendBuff, conn->priv->sendBuffLen);
-		conn->priv->sendBuffLen=0;
+	httpdFlushResponse(conn, 0);
+}
+
+//Send data straight to the socket, bypassing the send buffer. Use this in a cgi for big blocks
+//of data that are already in memory. If the data can't go out as-is, because it needs chunk
+//framing or there's other data waiting to be sent, it gets copied into the send buffer
+//instead. Returns 1 for success, 0 if it doesn't fit.
+//Data can also come from the memory-mapped flash, if it's 32-bit aligned and a multiple of 4
+//bytes long; if it has to be copied, that's done a word at a time.
+int ICACHE_FLASH_ATTR httpdSendDirect(HttpdConnData *conn, const char *data, int len) {
+	char *p;
+	uint32_t w;
+	int i;
+	if (len<=0) return 1;
+	if ((conn->priv->flags&HFL_INBODY) && conn->requestType==HTTPD_METHOD_HEAD) {
+		conn->priv->bodySkipped+=len;
+		return 1;
+	}
+	httpdFinishHeaders(conn, 0);
+	if ((conn->priv->flags&(HFL_CHUNKED|HFL_SENDPENDING)) || conn->priv->sendBuffLen!=0) {
+		if (((uint32_t)data&3)!=0 || (len&3)!=0) return httpdSend(conn, data, len);
+		//Could be flash, which only does aligned word reads; the send buffer may not be aligned.
+		p=httpdSendReserve(conn, len);
+		if (p==NULL) return 0;
+		for (i=0; i<len; i+=4) {
+			w=*(const uint32_t*)(data+i);
+			os_memcpy(p+i, &w, 4);
+		}
+		return 1;
+	}
+	espconn_sent(conn->conn, (uint8_t*)data, len);
+	httpdStatsSent(conn, len);
+	conn->priv->flags|=HFL_SENDPENDING;
+	return 1;
+}
+
+static void httpdRecvData(HttpdConnData *conn, char *data, int len);
+
+//Called when the response to a request has been sent completely. Either closes the
+//connection or gets it ready for the next request. If the client already sent the next
+//request, that's handled right away.
+static void ICACHE_FLASH_ATTR httpdRequestDone(HttpdConnData *conn) {
+	if (conn->priv->flags&HFL_KEEPALIVE) {
+		char *backlog=conn->priv->backlog;
+		os_printf("Conn %p is done. Keeping it open.\n", conn->conn);
+		httpdStatsDone(conn);
+		conn->priv->reqCount++;
+		httpdResetRequest(conn);
+		httpdSendBuffRelease(conn);
+		httpdSetDeadline(conn, HDL_IDLE, HTTPD_KEEPALIVE_TIMEOUT);
+		if (backlog!=NULL) {
+			//Take the backlog away from the connection first: if the next request can't be
+			//answered right away, what's after it needs to go into a new backlog.
+			conn->priv->backlog=NULL;
+			httpdRecvData(conn, backlog, conn->priv->backlogLen);
+			os_free(backlog);
+		}
+	} else {
+		os_printf("Conn %p is done. Closing.\n", conn->conn);
+		espconn_disconnect(conn->conn);
+		httpdRetireConn(conn);
+	}
+}
+
+//Marks the cgi of a connection as done. The request is finished as soon as all the data of
+//the response has left.
+static void ICACHE_FLASH_ATTR httpdCgiDone(HttpdConnData *conn) {
+	conn->cgi=NULL;
+	conn->priv->flags|=HFL_CGIDONE;
+	//If the cgi bailed out before the whole request body came in, the rest of the body would
+	//be mistaken for a new request. Close the connection instead.
+	if (conn->post->received<conn->post->len) conn->priv->flags&=~HFL_KEEPALIVE;
+	if (!(conn->priv->flags&HFL_SENDPENDING)) httpdRequestDone(conn);
+}
+
+//The answer to a HEAD is complete as soon as the headers are, but a cgi that streams its
+//body would keep on making it. Once it's past the headers it gets called once more the way it
+//would for an aborted connection, so it can clean up. Returns 1 if that happened.
+static int ICACHE_FLASH_ATTR httpdHeadCut(HttpdConnData *conn) {
+	struct espconn *espconn=conn->conn;
+	if (conn->requestType!=HTTPD_METHOD_HEAD || !(conn->priv->flags&HFL_INBODY)) return 0;
+	conn->conn=NULL;
+	conn->cgi(conn);
+	conn->conn=espconn;
+	return 1;
+}
+
+//The cgi returned HTTPD_CGI_PENDING. What it made so far goes out, so that it has the send buffer
+//to itself again when it carries on. If it ended its headers without a Content-Length, that
+//means the body gets chunked framing, or the connection closes after it.
+static void ICACHE_FLASH_ATTR httpdCgiPending(HttpdConnData *conn) {
+	conn->priv->flags|=HFL_CGIPENDING;
+	httpdFlushResponse(conn, 0);
+}
+
+//The cgi returned HTTPD_CGI_MORE after adding before..sendBuffLen to the send buffer. As long
+//as what's in there is only a bit, like the headers or a small file, the cgi gets to add more
+//right away, so that doesn't take a TCP segment and a round trip of its own. Returns what the
+//cgi returned last.
+static int ICACHE_FLASH_ATTR httpdCgiFill(HttpdConnData *conn, int r, int before) {
+	HttpdPriv *priv=conn->priv;
+	while (r==HTTPD_CGI_MORE && !(priv->flags&(HFL_FLUSH|HFL_SENDPENDING)) && priv->sendBuffLen>before &&
+			priv->sendBuffLen<HTTPD_MSS && priv->sendBuffLen<=HTTPD_COALESCE_MAX) {
+		before=priv->sendBuffLen;
+		if (priv->route>=0) routes[priv->route].stats.cgiCalls++;
+		r=conn->cgi(conn);
+	}
+	priv->flags&=~HFL_FLUSH;
+	return r;
+}
+
+//Sends what the cgi made, and deals with what it returned.
+static void ICACHE_FLASH_ATTR httpdCgiResult(HttpdConnData *conn, int r) {
+	if (r==HTTPD_CGI_PENDING) {
+		httpdCgiPending(conn);
+		return;
+	}
+	if (r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) {
+		os_printf("ERROR! CGI fn returns code %d after sending data! Bad CGI!\n", r);
+		//Response is in an unknown state; don't try to reuse the connection.
+		conn->priv->flags&=~HFL_KEEPALIVE;
+	}
+	httpdFlushResponse(conn, r!=HTTPD_CGI_MORE);
+	if (r!=HTTPD_CGI_MORE || httpdHeadCut(conn)) httpdCgiDone(conn);
+}
+
+//Calls the cgi of a request that's being answered, and sends what it made.
+static void ICACHE_FLASH_ATTR httpdCgiStep(HttpdConnData *conn) {
+	int r, before=conn->priv->sendBuffLen;
+	if (conn->priv->route>=0) routes[conn->priv->route].stats.cgiCalls++;
+	r=conn->cgi(conn); //Execute cgi fn.
+	httpdCgiResult(conn, httpdCgiFill(conn, r, before));
+}
+
+//Lets a cgi that returned HTTPD_CGI_PENDING carry on. Call this from the timer or other callback
+//that got what the cgi was waiting for, not from the cgi itself. The cgi is called again right
+//away, or as soon as the data it sent earlier has left.
+void ICACHE_FLASH_ATTR httpdResume(HttpdConnData *conn) {
+	if (conn->conn==NULL || conn->cgi==NULL || !(conn->priv->flags&HFL_CGIPENDING)) return;
+	conn->priv->flags&=~HFL_CGIPENDING;
+	if (!(conn->priv->flags&HFL_SENDPENDING)) httpdCgiStep(conn);
+}
+
+//Lets bulk transfers that wait for their turn send more, as long as the send budget allows.
+//They're served round-robin, starting after the last one that got a turn.
+static void ICACHE_FLASH_ATTR httpdSchedule(void) {
+	int n, i, start=sendTurn;
+	for (n=0; n<connUsed && sendInFlight<HTTPD_SEND_BUDGET; n++) {
+		i=(start+n)%connUsed;
+		if (!(connData[i].priv->flags&HFL_WAITTURN)) continue;
+		connData[i].priv->flags&=~HFL_WAITTURN;
+		sendTurn=(i+1)%connUsed;
+		httpdCgiStep(&connData[i]);
 	}
 }
 
 //Callback called when the data on a socket has been successfully
 //sent.
 static void ICACHE_FLASH_ATTR httpdSentCb(void *arg) {
-	int r;
 	HttpdConnData *conn=httpdFindConnData(arg);
-	char sendBuff[MAX_SENDBUFF_LEN];
 
 	if (conn==NULL) return;
-	conn->priv->sendBuff=sendBuff;
-	conn->priv->sendBuffLen=0;
+	conn->priv->flags&=~HFL_SENDPENDING;
+	httpdInFlightDone(conn);
 
-	if (conn->cgi==NULL) { //Marked for destruction?
-		os_printf("Conn %p is done. Closing.\n", conn->conn);
-		espconn_disconnect(conn->conn);
-		httpdRetireConn(conn);
-		return; //No need to call httpdFlushSendBuffer.
+	if (conn->priv->sendBuffLen!=0) {
+		//Data got queued while espconn was busy. Send that first; the cgi gets called again
+		//when it's gone, so it starts with an empty send buffer.
+		httpdSendOut(conn);
+	} else if (conn->cgi==NULL) { //Response done?
+		httpdRequestDone(conn);
+	} else if (conn->priv->flags&HFL_CGIPENDING) {
+		//A cgi that's waiting gets called from httpdResume.
+	} else if (conn->priv->respBytes>=HTTPD_BULK_BYTES) {
+		//Bulk transfer: wait in line with the others.
+		conn->priv->flags|=HFL_WAITTURN;
+	} else {
+		httpdCgiStep(conn);
 	}
+	//Bytes went out, so there may be room for bulk transfers now.
+	httpdSchedule();
+}
 
-	r=conn->cgi(conn); //Execute cgi fn.
-	if (r==HTTPD_CGI_DONE) {
-		conn->cgi=NULL; //mark for destruction.
+//Hash used by the router. Case-sensitive, like urls.
+static uint16_t ICACHE_FLASH_ATTR httpdUrlHash(const char *url, int len) {
+	uint32_t h=2166136261u;
+	while (len--) {
+		h^=(uint8_t)*url++;
+		h*=16777619u;
 	}
-	if (r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) {
-		os_printf("ERROR! CGI fn returns code %d after sending data! Bad CGI!\n", r);
-		conn->cgi=NULL; //mark for destruction.
+	return (uint16_t)(h^(h>>16));
+}
+
+//Builds the router data for the built-in url table.
+static void ICACHE_FLASH_ATTR httpdCompileRoutes(void) {
+	short bucketTail[ROUTE_BUCKETS];
+	short wildTail=-1;
+	int i, n=0;
+	while (builtInUrls[n].url!=NULL) n++;
+	routes=(HttpdRoute *)os_malloc(sizeof(HttpdRoute)*(n>0?n:1));
+	os_memset(routes, 0, sizeof(HttpdRoute)*(n>0?n:1));
+	os_memset(&notFoundStats, 0, sizeof(notFoundStats));
+	routeCnt=n;
+	for (i=0; i<ROUTE_BUCKETS; i++) routeBucket[i]=bucketTail[i]=-1;
+	routeWild=-1;
+	for (i=0; i<n; i++) {
+		int len=os_strlen(builtInUrls[i].url);
+		routes[i].next=-1;
+		if (len>0 && builtInUrls[i].url[len-1]=='*') {
+			routes[i].wild=1;
+			routes[i].len=len-1;
+			routes[i].hash=0;
+			if (wildTail<0) routeWild=i; else routes[wildTail].next=i;
+			wildTail=i;
+		} else {
+			int b;
+			routes[i].wild=0;
+			routes[i].len=len;
+			routes[i].hash=httpdUrlHash(builtInUrls[i].url, len);
+			b=routes[i].hash%ROUTE_BUCKETS;
+			if (bucketTail[b]<0) routeBucket[b]=i; else routes[bucketTail[b]].next=i;
+			bucketTail[b]=i;
+		}
 	}
-	httpdFlushSendBuffer(conn);
 }
 
-static const char *httpNotFoundHeader="HTTP/1.0 404 Not Found\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 12\r\n\r\nNot Found.\r\n";
+//Start a walk through the entries of builtInUrls that match url.
+static void ICACHE_FLASH_ATTR httpdRouteStart(HttpdRouteIter *it, const char *url) {
+	it->url=url;
+	it->len=os_strlen(url);
+	it->hash=httpdUrlHash(url, it->len);
+	it->lit=routeBucket[it->hash%ROUTE_BUCKETS];
+	it->wild=routeWild;
+}
+
+//Returns the index of the next entry that matches the url, in builtInUrls order, or -1 if
+//there are no more.
+static int ICACHE_FLASH_ATTR httpdRouteNext(HttpdRouteIter *it) {
+	int i;
+	while (it->lit>=0 && (routes[it->lit].hash!=it->hash || routes[it->lit].len!=it->len ||
+			os_strcmp(builtInUrls[it->lit].url, it->url)!=0)) it->lit=routes[it->lit].next;
+	while (it->wild>=0 && (routes[it->wild].len>it->len ||
+			os_strncmp(builtInUrls[it->wild].url, it->url, routes[it->wild].len)!=0)) it->wild=routes[it->wild].next;
+	if (it->lit<0 && it->wild<0) return -1;
+	if (it->wild<0 || (it->lit>=0 && it->lit<it->wild)) {
+		i=it->lit;
+		it->lit=routes[i].next;
+	} else {
+		i=it->wild;
+		it->wild=routes[i].next;
+	}
+	return i;
+}
 
 //This is called when the headers have been received and the connection is ready to send
 //the result headers and data.
@@ -345,108 +1503,151 @@ static const char *httpNotFoundHeader="HTTP/1.0 404 Not Found\r\nServer: esp8266
 //find the next cgi function, wait till the cgi data is sent or close up the connection.
 static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
 	int r;
-	int i=0;
+	int i;
+	int rewrites=0;
+	int method=conn->requestType;
+	HttpdRouteIter it;
 	if (conn->url==NULL) {
 		os_printf("WtF? url = NULL\n");
 		return; //Shouldn't happen
 	}
+	//Entries that do GET do HEAD as well.
+	if (method==HTTPD_METHOD_HEAD) method|=HTTPD_METHOD_GET;
+	httpdRouteStart(&it, conn->url);
 	//See if we can find a CGI that's happy to handle the request.
 	while (1) {
 		//Look up URL in the built-in URL table.
-		while (builtInUrls[i].url!=NULL) {
-			int match=0;
-			//See if there's a literal match
-			if (os_strcmp(builtInUrls[i].url, conn->url)==0) match=1;
-			//See if there's a wildcard match
-			if (builtInUrls[i].url[os_strlen(builtInUrls[i].url)-1]=='*' &&
-					os_strncmp(builtInUrls[i].url, conn->url, os_strlen(builtInUrls[i].url)-1)==0) match=1;
-			if (match) {
-				os_printf("Is url index %d\n", i);
-				conn->cgiData=NULL;
-				conn->cgi=builtInUrls[i].cgiCb;
-				conn->cgiArg=builtInUrls[i].cgiArg;
-				break;
-			}
-			i++;
+		i=httpdRouteNext(&it);
+		if (i>=0 && builtInUrls[i].methods!=0 && !(builtInUrls[i].methods&method)) {
+			//Url matches, but the entry doesn't do this method.
+			continue;
 		}
-		if (builtInUrls[i].url==NULL) {
+		if (i<0) {
 			//Drat, we're at the end of the URL table. This usually shouldn't happen. Well, just
 			//generate a built-in 404 to handle this.
 			os_printf("%s not found. 404!\n", conn->url);
-			httpdSend(conn, httpNotFoundHeader, -1);
-			httpdFlushSendBuffer(conn);
-			conn->cgi=NULL; //mark for destruction
+			conn->priv->route=ROUTE_NOTFOUND;
+			httpdStartResponse(conn, 404);
+			httpdHeader(conn, "Content-Type", "text/plain");
+			httpdSendLength(conn, 12);
+			httpdEndHeaders(conn);
+			httpdSend(conn, "Not Found.\r\n", -1);
+			httpdFlushResponse(conn, 1);
+			httpdCgiDone(conn);
 			return;
 		}
-		
+		os_printf("Is url index %d\n", i);
+		conn->cgiData=NULL;
+		conn->cgi=builtInUrls[i].cgiCb;
+		conn->cgiArg=builtInUrls[i].cgiArg;
+		conn->priv->route=i;
+
 		//Okay, we have a CGI function that matches the URL. See if it wants to handle the
 		//particular URL we're supposed to handle.
+		routes[i].stats.cgiCalls++;
 		r=conn->cgi(conn);
 		if (r==HTTPD_CGI_MORE) {
-			//Yep, it's happy to do so and has more data to send.
-			httpdFlushSendBuffer(conn);
+			//Yep, it's happy to do so and has more data to send. Probably only the headers so
+			//far; see if that can go out with some of the body.
+			httpdCgiResult(conn, httpdCgiFill(conn, r, 0));
 			return;
 		} else if (r==HTTPD_CGI_DONE) {
 			//Yep, it's happy to do so and already is done sending data.
-			httpdFlushSendBuffer(conn);
-			conn->cgi=NULL; //mark conn for destruction
+			httpdFlushResponse(conn, 1);
+			httpdCgiDone(conn);
 			return;
-		} else if (r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) {
-			//URL doesn't want to handle the request: either the data isn't found or there's no
-			//need to generate a login screen.
-			i++; //look at next url the next iteration of the loop.
+		} else if (r==HTTPD_CGI_PENDING) {
+			//It's happy to do so, but needs to wait for something first.
+			httpdCgiPending(conn);
+			return;
+		} else if (r==HTTPD_CGI_REWRITE && rewrites<MAX_REWRITES) {
+			//The cgi changed the url of the request. Start looking from the top for the new one.
+			rewrites++;
+			httpdRouteStart(&it, conn->url);
 		}
+		//Otherwise, the URL doesn't want to handle the request: either the data isn't found
+		//or there's no need to generate a login screen. Look at the next url.
 	}
 }
 
-//Parse a line of header data and modify the connection data accordingly.
-static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
-	int i;
-	char firstLine=0;
-	
-	if (os_strncmp(h, "GET ", 4)==0) {
-		conn->requestType = HTTPD_METHOD_GET;
-		firstLine=1;
-	} else if (os_strncmp(h, "Host:", 5)==0) {
-		i=5;
-		while (h[i]==' ') i++;
-		conn->hostName=&h[i];
-	} else if (os_strncmp(h, "POST ", 5)==0) {
-		conn->requestType = HTTPD_METHOD_POST;
-		firstLine=1;
-	}
-
-	if (firstLine) {
-		char *e;
-		
-		//Skip past the space after POST/GET
-		i=0;
-		while (h[i]!=' ') i++;
-		conn->url=h+i+1;
-
-		//Figure out end of url.
-		e=(char*)os_strstr(conn->url, " ");
-		if (e==NULL) return; //wtf?
-		*e=0; //terminate url part
-
-		os_printf("URL = %s\n", conn->url);
-		//Parse out the URL part before the GET parameters.
-		conn->getArgs=(char*)os_strstr(conn->url, "?");
-		if (conn->getArgs!=0) {
-			*conn->getArgs=0;
-			conn->getArgs++;
-			os_printf("GET args = %s\n", conn->getArgs);
-		} else {
-			conn->getArgs=NULL;
-		}
+//Cgi that shows the counters of all entries of the url table, and of the requests none of
+//them answered, as JSON. Total latency is in ms, max latency in us.
+int ICACHE_FLASH_ATTR cgiHttpdStats(HttpdConnData *connData) {
+	char buff[128];
+	int i=(int)(intptr_t)connData->cgiData; //next entry to send
+	HttpdRouteStats *st;
+	if (connData->conn==NULL) return HTTPD_CGI_DONE;
+	if (i==0) {
+		httpdStartResponse(connData, 200);
+		httpdHeader(connData, "Content-Type", "application/json");
+		httpdHeader(connData, "Cache-Control", "no-cache");
+		httpdEndHeaders(connData);
+		httpdSend(connData, "{\"routes\":[", -1);
+	}
+	while (i<routeCnt && httpdSendSpace(connData)>=(int)(sizeof(buff)+os_strlen(builtInUrls[i].url)+16)) {
+		st=&routes[i].stats;
+		httpdSend(connData, (i==0)?"{\"url\":\"":",{\"url\":\"", -1);
+		httpdSend(connData, builtInUrls[i].url, -1);
+		os_sprintf(buff, "\",\"count\":%u,\"cgiCalls\":%u,\"totalMs\":%u,\"maxUs\":%u,\"bytes\":%u}",
+				(unsigned)st->count, (unsigned)st->cgiCalls, (unsigned)(st->totalUs/1000), (unsigned)st->maxUs, (unsigned)st->bytes);
+		httpdSend(connData, buff, -1);
+		i++;
+	}
+	connData->cgiData=(void*)(intptr_t)i;
+	if (i<routeCnt || httpdSendSpace(connData)<(int)sizeof(buff)) return HTTPD_CGI_MORE;
+	st=&notFoundStats;
+	os_sprintf(buff, "],\"notFound\":{\"count\":%u,\"totalMs\":%u,\"maxUs\":%u,\"bytes\":%u}}",
+			(unsigned)st->count, (unsigned)(st->totalUs/1000), (unsigned)st->maxUs, (unsigned)st->bytes);
+	httpdSend(connData, buff, -1);
+	return HTTPD_CGI_DONE;
+}
+
+//Store a byte of the request head. Always leaves room for a terminating zero; if the head
+//doesn't fit, it's marked as too big.
+static void ICACHE_FLASH_ATTR httpdHeadPut(HttpdPriv *priv, char c) {
+	if (priv->headPos<priv->headSize-1) priv->head[priv->headPos++]=c; else priv->flags|=HFL_HEADTOOBIG;
+}
 
-	} else if (os_strncmp(h, "Content-Length:", 15)==0) {
-		i=15;
-		//Skip trailing spaces
-		while (h[i]==' ') i++;
-		//Get POST data length
-		conn->post->len=atoi(h+i);
+//Terminate the string that's being stored in the request head.
+static void ICACHE_FLASH_ATTR httpdHeadEnd(HttpdPriv *priv) {
+	if (priv->headPos<priv->headSize) priv->head[priv->headPos++]=0; else priv->flags|=HFL_HEADTOOBIG;
+}
 
+//Called when a complete header line has been stored. Picks out the headers httpd itself
+//cares about.
+static void ICACHE_FLASH_ATTR httpdHeaderDone(HttpdConnData *conn, char *name, char *val) {
+	if (httpdStrEqNoCase(name, "Host")) {
+		conn->hostName=val;
+	} else if (httpdStrEqNoCase(name, "Connection")) {
+		if (httpdStrPrefixNoCase(val, "close")) conn->priv->flags&=~HFL_CLIENTKEEPALIVE;
+		if (httpdStrPrefixNoCase(val, "keep-alive")) conn->priv->flags|=HFL_CLIENTKEEPALIVE;
+	} else if (httpdStrEqNoCase(name, "Content-Length")) {
+		conn->post->len=atoi(val);
+	} else if (httpdStrEqNoCase(name, "Transfer-Encoding")) {
+		//The body comes in chunks, or worse. Taking it as a body of Content-Length bytes, or as
+		//none at all, would make the rest of it look like the next request.
+		if (!httpdStrEqNoCase(val, "identity")) conn->priv->flags|=HFL_BODYCODED;
+	} else if (httpdStrEqNoCase(name, "Content-Type")) {
+		if (os_strstr(val, "multipart/form-data")) {
+			// It's multipart form data so let's pull out the boundary for future use
+			char *b;
+			if ((b = os_strstr(val, "boundary=")) != NULL) {
+				conn->post->multipartBoundary = b + 7; // move the pointer 2 chars before boundary then fill them with dashes
+				conn->post->multipartBoundary[0] = '-';
+				conn->post->multipartBoundary[1] = '-';
+				os_printf("boundary = %s\n", conn->post->multipartBoundary);
+			}
+		}
+	}
+}
+
+//Called when the empty line terminating the request head has been received.
+static void ICACHE_FLASH_ATTR httpdHeadDone(HttpdConnData *conn) {
+	//The head is complete; the room it didn't use can go to other requests.
+	httpdHeadTrim(conn);
+	if (conn->url!=NULL) os_printf("URL = %s\n", conn->url);
+	if (conn->getArgs!=NULL) os_printf("GET args = %s\n", conn->getArgs);
+	if (conn->post->len>0) {
 		// Allocate the buffer
 		if (conn->post->len > MAX_POST) {
 			// we'll stream this in in chunks
@@ -457,97 +1658,339 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
 		os_printf("Mallocced buffer for %d + 1 bytes of post data.\n", conn->post->buffSize);
 		conn->post->buff=(char*)os_malloc(conn->post->buffSize + 1);
 		conn->post->buffLen=0;
-	} else if (os_strncmp(h, "Content-Type: ", 14)==0) {
-		if (os_strstr(h, "multipart/form-data")) {
-			// It's multipart form data so let's pull out the boundary for future use
-			char *b;
-			if ((b = os_strstr(h, "boundary=")) != NULL) {
-				conn->post->multipartBoundary = b + 7; // move the pointer 2 chars before boundary then fill them with dashes
-				conn->post->multipartBoundary[0] = '-';
-				conn->post->multipartBoundary[1] = '-';
-				os_printf("boundary = %s\n", conn->post->multipartBoundary);
+	}
+}
+
+//Feed request head bytes into the parser. Every byte is looked at exactly once: the request
+//line is split into method, url and GET args, and every header line is stored as a name
+//and a value string and classified as soon as its end of line comes in. Returns the amount
+//of bytes consumed; that is less than len if the head ended within the data, or if it turned
+//out to be too big (HFL_HEADTOOBIG). Returns -1 if the head needs more room and there's none
+//to be had in the arena.
+static int ICACHE_FLASH_ATTR httpdParseHead(HttpdConnData *conn, char *data, int len) {
+	HttpdPriv *priv=conn->priv;
+	int x;
+	for (x=0; x<len && priv->headState!=HST_DONE && !(priv->flags&HFL_HEADTOOBIG); x++) {
+		char c=data[x];
+		//Every byte adds at most one byte to the head; there has to be room for that and for a
+		//terminating zero. A head that's at HTTPD_MAX_HEAD_LEN can't grow anymore.
+		while (priv->headPos>=priv->headSize-2 && priv->headSize<HTTPD_MAX_HEAD_LEN && !httpdHeadGrow(conn)) {
+			if (!httpdHeadEvict(conn)) return -1;
+		}
+		switch (priv->headState) {
+		case HST_METHOD:
+			if (c==' ') {
+				httpdHeadEnd(priv);
+				if (os_strcmp(priv->head, "GET")==0) conn->requestType=HTTPD_METHOD_GET;
+				else if (os_strcmp(priv->head, "POST")==0) conn->requestType=HTTPD_METHOD_POST;
+				else if (os_strcmp(priv->head, "HEAD")==0) conn->requestType=HTTPD_METHOD_HEAD;
+				conn->url=&priv->head[priv->headPos];
+				priv->headState=HST_URL;
+			} else if (c!='\r' && c!='\n') {
+				httpdHeadPut(priv, c);
+			}
+			break;
+		case HST_URL:
+		case HST_QUERY:
+			if (c==' ' || c=='\r' || c=='\n') {
+				httpdHeadEnd(priv);
+				priv->headState=(c=='\n')?HST_LINESTART:HST_VERSION;
+				priv->lineStart=priv->headPos;
+			} else if (c=='?' && priv->headState==HST_URL) {
+				httpdHeadEnd(priv);
+				conn->getArgs=&priv->head[priv->headPos];
+				priv->headState=HST_QUERY;
+			} else {
+				httpdHeadPut(priv, c);
+			}
+			break;
+		case HST_VERSION:
+			if (c=='\n') {
+				httpdHeadEnd(priv);
+				//HTTP/1.1 clients do persistent connections unless they tell us otherwise.
+				if (os_strcmp(&priv->head[priv->lineStart], "HTTP/1.1")==0) priv->flags|=HFL_CLIENTKEEPALIVE|HFL_CLIENT11;
+				priv->headState=HST_LINESTART;
+			} else if (c!='\r') {
+				httpdHeadPut(priv, c);
 			}
+			break;
+		case HST_LINESTART:
+			if (c=='\n') {
+				//Empty line: end of head.
+				priv->headState=HST_DONE;
+				httpdHeadDone(conn);
+			} else if (c!='\r') {
+				priv->lineStart=priv->headPos;
+				priv->nameHash=httpdHdrHashStep(2166136261u, c);
+				httpdHeadPut(priv, c);
+				priv->headState=HST_NAME;
+			}
+			break;
+		case HST_NAME:
+			if (c==':') {
+				httpdHeadEnd(priv);
+				priv->headState=HST_VALSTART;
+			} else if (c=='\n') {
+				//Header line without a colon. Ditch it.
+				priv->headPos=priv->lineStart;
+				priv->headState=HST_LINESTART;
+			} else if (c!='\r') {
+				priv->nameHash=httpdHdrHashStep(priv->nameHash, c);
+				httpdHeadPut(priv, c);
+			}
+			break;
+		case HST_VALSTART:
+			if (c==' ' || c=='\t') break;
+			priv->headState=HST_VALUE;
+			//fall through
+		case HST_VALUE:
+			if (c=='\n') {
+				char *name=&priv->head[priv->lineStart];
+				char *val=name+os_strlen(name)+1;
+				httpdHeadEnd(priv);
+				//A line that didn't fit is cut off somewhere; its value may not even be in the
+				//head. Leave it out; the request gets a 431 anyway.
+				if (!(priv->flags&HFL_HEADTOOBIG)) {
+					if (priv->hdrCnt<MAX_HEADERS) {
+						priv->hdrHash[priv->hdrCnt]=(uint16_t)(priv->nameHash^(priv->nameHash>>16));
+						priv->hdrOff[priv->hdrCnt]=priv->lineStart;
+						priv->hdrCnt++;
+					}
+					httpdHeaderDone(conn, name, val);
+				}
+				priv->headState=HST_LINESTART;
+			} else if (c!='\r') {
+				httpdHeadPut(priv, c);
+			}
+			break;
 		}
 	}
+	return x;
 }
 
 
-//Callback called when there's data available on a socket.
-static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short len) {
-	int x;
-	char *p, *e;
-	char sendBuff[MAX_SENDBUFF_LEN];
-	HttpdConnData *conn=httpdFindConnData(arg);
-	if (conn==NULL) return;
-	conn->priv->sendBuff=sendBuff;
-	conn->priv->sendBuffLen=0;
-
-	//This is slightly evil/dirty: we abuse conn->post->len as a state variable for where in the http communications we are:
-	//<0 (-1): Post len unknown because we're still receiving headers
-	//==0: No post data
-	//>0: Need to receive post data
-	//ToDo: See if we can use something more elegant for this.
-
-	for (x=0; x<len; x++) {
-		if (conn->post->len<0) {
-			//This byte is a header byte.
-			if (conn->priv->headPos!=MAX_HEAD_LEN) conn->priv->head[conn->priv->headPos++]=data[x];
-			conn->priv->head[conn->priv->headPos]=0;
-			//Scan for /r/n/r/n. Receiving this indicate the headers end.
-			if (data[x]=='\n' && (char *)os_strstr(conn->priv->head, "\r\n\r\n")!=NULL) {
-				//Indicate we're done with the headers.
-				conn->post->len=0;
-				//Reset url data
-				conn->url=NULL;
-				//Iterate over all received headers and parse them.
-				p=conn->priv->head;
-				while(p<(&conn->priv->head[conn->priv->headPos-4])) {
-					e=(char *)os_strstr(p, "\r\n"); //Find end of header line
-					if (e==NULL) break;			//Shouldn't happen.
-					e[0]=0;						//Zero-terminate header
-					httpdParseHeader(p, conn);	//and parse it.
-					p=e+2;						//Skip /r/n (now /0/n)
-				}
-				//If we don't need to receive post data, we can send the response now.
-				if (conn->post->len==0) {
-					httpdProcessRequest(conn);
+//Sent callback for a client that got a canned response
+static void ICACHE_FLASH_ATTR httpdCannedSentCb(void *arg) {
+	espconn_disconnect((struct espconn *)arg);
+}
+
+//Send one of the canned responses to a client that has no slot (anymore), and hang up.
+static void ICACHE_FLASH_ATTR httpdSendCanned(struct espconn *conn, const char *resp, int len) {
+	conn->reverse=NULL;
+	espconn_regist_sentcb(conn, httpdCannedSentCb);
+	espconn_regist_time(conn, HTTPD_HEAD_TIMEOUT, 1);
+	if (espconn_sent(conn, (uint8 *)resp, len)!=ESPCONN_OK) espconn_disconnect(conn);
+}
+
+//Tell a client we have no slot for to come back later, and hang up.
+static void ICACHE_FLASH_ATTR httpdSendBusy(struct espconn *conn) {
+	os_printf("Aiee, conn pool overflow! Sending 503 to %p.\n", conn);
+	httpdSendCanned(conn, busyResponse, sizeof(busyResponse)-1);
+}
+
+//Tell a client there's no room for the head of its request right now, and hang up. Its slot
+//is retired right away; the connection goes on like one that never got a slot.
+static void ICACHE_FLASH_ATTR httpdHeadFull(HttpdConnData *conn) {
+	struct espconn *espconn=conn->conn;
+	os_printf("No room for the head of a request.\n");
+	conn->conn=NULL;
+	httpdRetireConn(conn);
+	httpdSendBusy(espconn);
+}
+
+//Turn down a request httpd can't handle with one of the canned responses, and hang up. What's
+//left of the request can't be told apart from the one after it, so the connection can't be used
+//anymore. Its slot is retired right away.
+static void ICACHE_FLASH_ATTR httpdReject(HttpdConnData *conn, const char *resp, int len) {
+	struct espconn *espconn=conn->conn;
+	conn->conn=NULL;
+	httpdRetireConn(conn);
+	httpdSendCanned(espconn, resp, len);
+}
+
+//Lets a cgi pick the chunks it gets the POST body in, e.g. to have every chunk fill a flash
+//sector. From the next chunk on, chunks end where the body offset minus start is a multiple
+//of size, or at the end of the body; apart from the first one after start, they're exactly
+//size bytes. Call it from the cgi; the chunk that's being handled is left alone.
+void ICACHE_FLASH_ATTR httpdSetPostChunk(HttpdConnData *conn, int size, int start) {
+	if (size<=0) return;
+	conn->priv->postChunk=size;
+	conn->priv->postStart=start;
+}
+
+//Returns how many body bytes are left until the end of the chunk the cgi asked for.
+static int ICACHE_FLASH_ATTR httpdPostToBoundary(HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	int d=(conn->post->received-priv->postStart)%priv->postChunk;
+	if (d<0) d+=priv->postChunk;
+	return priv->postChunk-d;
+}
+
+//Gets the POST buffer ready for the next chunk. If the cgi asked for another chunk size,
+//that's when the buffer changes size; if there's no memory for it, chunks stay as they were.
+static void ICACHE_FLASH_ATTR httpdPostNextChunk(HttpdConnData *conn) {
+	HttpdPostData *post=conn->post;
+	HttpdPriv *priv=conn->priv;
+	int size;
+	char *buff;
+	post->buffLen=0;
+	if (priv->postChunk==0 || post->buff==NULL || post->received>=post->len) return;
+	size=priv->postChunk;
+	if (size>post->len-post->received) size=post->len-post->received;
+	if (size==post->buffSize) return;
+	buff=(char*)os_malloc(size+1);
+	if (buff==NULL) {
+		os_printf("No memory for POST chunks of %d bytes.\n", priv->postChunk);
+		priv->postChunk=0;
+		return;
+	}
+	os_free(post->buff);
+	post->buff=buff;
+	post->buffSize=size;
+}
+
+//Keep data that came in after the end of the request that's being answered. Clients that
+//pipeline their requests send the next one without waiting for the response.
+static void ICACHE_FLASH_ATTR httpdBacklogAdd(HttpdConnData *conn, char *data, int len) {
+	HttpdPriv *priv=conn->priv;
+	if (priv->backlog==NULL) {
+		priv->backlog=(char*)os_malloc(MAX_BACKLOG);
+		priv->backlogLen=0;
+	}
+	if (priv->backlog==NULL || priv->backlogLen+len>MAX_BACKLOG) {
+		//Can't keep it all. Drop it and close the connection after this response; the client
+		//will send the requests that weren't answered again.
+		os_printf("Conn %p: pipelined data doesn't fit. Closing after this response.\n", conn->conn);
+		priv->flags&=~(HFL_CLIENTKEEPALIVE|HFL_KEEPALIVE);
+		return;
+	}
+	os_memcpy(priv->backlog+priv->backlogLen, data, len);
+	priv->backlogLen+=len;
+}
+
+//Handle data that came in over a connection. This can be the end of one request and the
+//start of the next, so this keeps going until all the data is used.
+static void ICACHE_FLASH_ATTR httpdRecvData(HttpdConnData *conn, char *data, int len) {
+	HttpdPostData *post=conn->post;
+	int x=0;
+	while (x<len) {
+		if (conn->conn==NULL) return; //connection got closed
+		if (conn->priv->headState!=HST_DONE) {
+			int n;
+			//Still receiving the request head. The clock for it starts with its first byte.
+			if (conn->priv->deadlineKind==HDL_IDLE) httpdSetDeadline(conn, HDL_HEAD, HTTPD_HEAD_TIMEOUT);
+			if (conn->priv->head==NULL) {
+				conn->priv->reqStart=system_get_time();
+				//If the arena is full, the head that's taking the longest goes first.
+				while (!httpdHeadAlloc(conn->priv)) {
+					if (!httpdHeadEvict(conn)) {
+						httpdHeadFull(conn);
+						return;
+					}
 				}
 			}
-		} else if (conn->post->len!=0) {
-			//This byte is a POST byte.
-			conn->post->buff[conn->post->buffLen++]=data[x];
-			conn->post->received++;
+			n=httpdParseHead(conn, data+x, len-x);
+			if (n<0) {
+				httpdHeadFull(conn);
+				return;
+			}
+			if (conn->priv->flags&HFL_HEADTOOBIG) {
+				os_printf("Conn %p: request head is more than %d bytes. Sending 431.\n", conn->conn, HTTPD_MAX_HEAD_LEN);
+				httpdReject(conn, headTooBigResponse, sizeof(headTooBigResponse)-1);
+				return;
+			}
+			x+=n;
+			if (conn->priv->headState!=HST_DONE) return;
+			if (conn->priv->flags&HFL_BODYCODED) {
+				os_printf("Conn %p: request body has a Transfer-Encoding. Sending 501.\n", conn->conn);
+				httpdReject(conn, codedBodyResponse, sizeof(codedBodyResponse)-1);
+				return;
+			}
+			//If we don't need to receive post data, we can send the response now.
+			if (post->len<=0) {
+				conn->priv->deadlineKind=HDL_NONE;
+				httpdProcessRequest(conn);
+			} else {
+				httpdSetDeadline(conn, HDL_BODY, HTTPD_BODY_TIMEOUT);
+			}
+		} else if (post->received<post->len) {
+			int n;
+			//The cgi gave up on this request; the rest of the body is of no use.
+			if (conn->priv->flags&HFL_CGIDONE) return;
+			//These bytes are POST bytes.
+			n=len-x;
+			if (n>post->buffSize-post->buffLen) n=post->buffSize-post->buffLen;
+			if (n>post->len-post->received) n=post->len-post->received;
+			if (conn->priv->postChunk>0 && n>httpdPostToBoundary(conn)) n=httpdPostToBoundary(conn);
+			if (post->buff!=NULL) os_memcpy(post->buff+post->buffLen, data+x, n);
+			post->buffLen+=n;
+			post->received+=n;
+			x+=n;
 			conn->hostName=NULL;
-			if (conn->post->buffLen >= conn->post->buffSize || conn->post->received == conn->post->len) {
+			if (post->received==post->len) {
+				conn->priv->deadlineKind=HDL_NONE;
+			} else {
+				httpdSetDeadline(conn, HDL_BODY, HTTPD_BODY_TIMEOUT);
+			}
+			if (post->buffLen >= post->buffSize || post->received == post->len ||
+					(conn->priv->postChunk>0 && httpdPostToBoundary(conn)==conn->priv->postChunk)) {
 				//Received a chunk of post data
-				conn->post->buff[conn->post->buffLen]=0; //zero-terminate, in case the cgi handler knows it can use strings
+				if (post->buff!=NULL) post->buff[post->buffLen]=0; //zero-terminate, in case the cgi handler knows it can use strings
+				conn->priv->argCnt=-1; //POST args may have changed
 				//Send the response.
 				httpdProcessRequest(conn);
-				conn->post->buffLen = 0;
+				httpdPostNextChunk(conn);
 			}
+		} else if (conn->recvHdl) {
+			//Let cgi handle data if it registered a recvHdl callback.
+			conn->recvHdl(conn, data+x, len-x);
+			return;
 		} else {
-			//Let cgi handle data if it registered a recvHdl callback. If not, ignore.
-			if (conn->recvHdl) {
-				conn->recvHdl(conn, data+x, len-x);
-				break;
-			}
+			//The request is complete but still being answered. Keep the rest for later.
+			httpdBacklogAdd(conn, data+x, len-x);
+			return;
 		}
 	}
 }
 
-static void ICACHE_FLASH_ATTR httpdReconCb(void *arg, sint8 err) {
+//Callback called when there's data available on a socket.
+static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short len) {
 	HttpdConnData *conn=httpdFindConnData(arg);
-	os_printf("ReconCb\n");
 	if (conn==NULL) return;
-	//Yeah... No idea what to do here. ToDo: figure something out.
+	if (conn->priv->backlog!=NULL) {
+		//Still working through earlier requests; this goes after them.
+		httpdBacklogAdd(conn, data, len);
+		return;
+	}
+	httpdRecvData(conn, data, len);
+}
+
+//Called instead of the disconnect callback when the connection is aborted because of an
+//error, e.g. a reset from the client or a send that timed out. The espconn is gone after this.
+static void ICACHE_FLASH_ATTR httpdReconCb(void *arg, sint8 err) {
+	HttpdConnData *conn=httpdSlotFromEspconn((struct espconn *)arg);
+	os_printf("ReconCb %p, err %d\n", arg, err);
+	if (conn==NULL) return;
+	conn->conn=NULL;
+	if (conn->cgi!=NULL) conn->cgi(conn); //flush cgi data
+	httpdRetireConn(conn);
+	httpdSchedule();
 }
 
 static void ICACHE_FLASH_ATTR httpdDisconCb(void *arg) {
-	//The esp sdk passes through wrong arg here, namely the one of the *listening* socket.
-	//That is why we can't use (HttpdConnData)arg->sock here.
-	//Just look at all the sockets and kill the slot if needed.
 	int i;
-	for (i=0; i<MAX_CONN; i++) {
+	HttpdConnData *c=httpdSlotFromEspconn((struct espconn *)arg);
+	if (c!=NULL) {
+		//Arg is the espconn of the connection that went away. Kill its slot.
+		c->conn=NULL;
+		if (c->cgi!=NULL) c->cgi(c); //flush cgi data
+		httpdRetireConn(c);
+		httpdSchedule();
+		return;
+	}
+	//Some esp sdks pass through the wrong arg here, namely the one of the *listening* socket.
+	//Just look at all the sockets and kill the slot if needed.
+	for (i=0; i<connUsed; i++) {
 		if (connData[i].conn!=NULL) {
 			//Why the >=ESPCONN_CLOSE and not ==? Well, seems the stack sometimes de-allocates
 			//espconns under our noses, especially when connections are interrupted. The memory
@@ -560,36 +2003,81 @@ static void ICACHE_FLASH_ATTR httpdDisconCb(void *arg) {
 			}
 		}
 	}
+	httpdSchedule();
 }
 
 
+//Closes the connections that are past their deadline. Disarms itself when there are no
+//connections left.
+static void ICACHE_FLASH_ATTR httpdReaperCb(void *arg) {
+	uint32_t now=system_get_time();
+	int i, live=0;
+	for (i=0; i<connUsed; i++) {
+		HttpdPriv *priv=connData[i].priv;
+		if (connData[i].conn==NULL) continue;
+		if (priv->deadlineKind!=HDL_NONE && (int32_t)(now-priv->deadline)>=0) {
+			os_printf("Conn %p timed out (%d). Closing.\n", connData[i].conn, priv->deadlineKind);
+			httpdKillConn(&connData[i]);
+		} else {
+			live++;
+		}
+	}
+	if (live==0) {
+		os_timer_disarm(&reaperTimer);
+		reaperArmed=0;
+	}
+	httpdSchedule();
+}
+
+//Makes room in a full pool by closing a connection that isn't working on a request: of the
+//idle ones and the ones still sending a request head, the one that has been at it the
+//longest. Returns the freed slot, or -1 if every connection is getting an answer.
+static int ICACHE_FLASH_ATTR httpdEvictConn(void) {
+	HttpdConnData *victim=httpdEvictPick(0, NULL);
+	if (victim==NULL) return -1;
+	os_printf("Pool full. Evicting conn %p.\n", victim->conn);
+	httpdKillConn(victim);
+	return connFree[--connFreeCnt];
+}
+
 static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
 	struct espconn *conn=arg;
 	int i;
-	//Find empty conndata in pool
-	for (i=0; i<MAX_CONN; i++) if (connData[i].conn==NULL) break;
-	os_printf("Con req, conn=%p, pool slot %d\n", conn, i);
-	if (i==MAX_CONN) {
-		os_printf("Aiee, conn pool overflow!\n");
-		espconn_disconnect(conn);
+	//Grab a retired slot, or take a fresh one from the arena. If there's none, see if there's
+	//a connection that can make room.
+	if (connFreeCnt>0) {
+		i=connFree[--connFreeCnt];
+	} else if (connUsed<MAX_CONN) {
+		i=connUsed++;
+	} else if ((i=httpdEvictConn())<0) {
+		httpdSendBusy(conn);
 		return;
 	}
+	os_printf("Con req, conn=%p, pool slot %d\n", conn, i);
 	connData[i].priv=&connPrivData[i];
 	connData[i].conn=conn;
-	connData[i].priv->headPos=0;
 	connData[i].post=&connPostData[i];
 	connData[i].post->buff=NULL;
-	connData[i].post->buffLen=0;
-	connData[i].post->received=0;
-	connData[i].post->len=-1;
-	connData[i].hostName=NULL;
+	connData[i].priv->sendBuff=NULL;
+	connData[i].priv->sendBuffLen=0;
+	connData[i].priv->backlog=NULL;
+	connData[i].priv->backlogLen=0;
+	connData[i].priv->reqCount=0;
+	httpdResetRequest(&connData[i]);
+	httpdSetDeadline(&connData[i], HDL_HEAD, HTTPD_HEAD_TIMEOUT);
 	connData[i].remote_port=conn->proto.tcp->remote_port;
 	os_memcpy(connData[i].remote_ip, conn->proto.tcp->remote_ip, 4);
+	conn->reverse=&connData[i];
 
 	espconn_regist_recvcb(conn, httpdRecvCb);
 	espconn_regist_reconcb(conn, httpdReconCb);
 	espconn_regist_disconcb(conn, httpdDisconCb);
 	espconn_regist_sentcb(conn, httpdSentCb);
+	espconn_regist_time(conn, HTTPD_STALL_TIMEOUT, 1);
+	if (!reaperArmed) {
+		os_timer_arm(&reaperTimer, HTTPD_REAPER_INTERVAL, 1);
+		reaperArmed=1;
+	}
 }
 
 //Httpd initialization routine. Call this to kick off webserver functionality.
@@ -599,14 +2087,20 @@ void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port) {
 	for (i=0; i<MAX_CONN; i++) {
 		connData[i].conn=NULL;
 	}
+	connUsed=0;
+	connFreeCnt=0;
 	httpdConn.type=ESPCONN_TCP;
 	httpdConn.state=ESPCONN_NONE;
 	httpdTcp.local_port=port;
 	httpdConn.proto.tcp=&httpdTcp;
 	builtInUrls=fixedUrls;
+	httpdCompileRoutes();
+	os_timer_disarm(&reaperTimer);
+	os_timer_setfn(&reaperTimer, httpdReaperCb, NULL);
+	reaperArmed=0;
 
 	os_printf("Httpd init, conn=%p\n", &httpdConn);
 	espconn_regist_connectcb(&httpdConn, httpdConnectCb);
 	espconn_accept(&httpdConn);
-	espconn_tcp_set_max_con_allow(&httpdConn, MAX_CONN);
+	espconn_tcp_set_max_con_allow(&httpdConn, MAX_CONN+HTTPD_BUSY_CONNS);
 }
@@ -17,27 +17,40 @@ Connector to let httpd use the espfs filesystem to serve the files in it.
 #include "espfsformat.h"
 
 // The static files marked with FLAG_GZIP are compressed and will be served with GZIP compression.
-// If the client does not advertise that he accepts GZIP send following warning message (telnet users for e.g.)
+// If the client does not advertise that he accepts GZIP, they're unpacked on the fly; if that can't
+// be done (no memory, or a library built without GZIP_COMPRESSION) send following warning message.
 static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 52\r\n\r\nYour browser does not accept gzip-compressed data.\r\n";
 
 
+//State of cgiEspFsHook while it sends a file
+typedef struct {
+	EspFsFile *file;
+	int left; //amount of bytes still to send; less than the rest of the file for a Range request
+} EspFsSendState;
+
 //This is a catch-all cgi function. It takes the url passed to it, looks up the corresponding
 //path in the filesystem and if it exists, passes the file through. This simulates what a normal
-//webserver would do with static files.
+//webserver would do with static files. A single byte range of a file can be asked for with
+//a Range header.
 int ICACHE_FLASH_ATTR cgiEspFsHook(HttpdConnData *connData) {
-	EspFsFile *file=connData->cgiData;
-	int len;
+	EspFsSendState *st=connData->cgiData;
+	EspFsFile *file;
+	int len, start, hdrLen, entity, gunzip;
+	const char *map;
 	char buff[1024];
 	char acceptEncodingBuffer[64];
-	int isGzip;
+	char etag[16], ifNoneMatch[64], range[8];
 	
 	if (connData->conn==NULL) {
 		//Connection aborted. Clean up.
-		espFsClose(file);
+		if (st!=NULL) {
+			espFsClose(st->file);
+			os_free(st);
+		}
 		return HTTPD_CGI_DONE;
 	}
 
-	if (file==NULL) {
+	if (st==NULL) {
 		//First call to this cgi. Open the file so we can read it.
 		file=espFsOpen(connData->url);
 		if (file==NULL) {
@@ -50,35 +63,132 @@ int ICACHE_FLASH_ATTR cgiEspFsHook(HttpdConnData *connData) {
 		// If there are no gzipped files in the image, the code bellow will not cause any harm.
 
 		// Check if requested file was GZIP compressed
-		isGzip = espFsFlags(file) & FLAG_GZIP;
-		if (isGzip) {
+		gunzip=0;
+		if (espFsFlags(file) & FLAG_GZIP) {
 			// Check the browser's "Accept-Encoding" header. If the client does not
-			// advertise that he accepts GZIP send a warning message (telnet users for e.g.)
-			httpdGetHeader(connData, "Accept-Encoding", acceptEncodingBuffer, 64);
-			if (os_strstr(acceptEncodingBuffer, "gzip") == NULL) {
+			// advertise that he accepts GZIP, unpack the file for it (telnet users for e.g.)
+			if (!httpdGetHeader(connData, "Accept-Encoding", acceptEncodingBuffer, 64) ||
+					os_strstr(acceptEncodingBuffer, "gzip") == NULL) {
 				//No Accept-Encoding: gzip header present
-				httpdSend(connData, gzipNonSupportedMessage, -1);
-				espFsClose(file);
-				return HTTPD_CGI_DONE;
+				gunzip=espFsGunzip(file);
+				if (!gunzip) {
+					httpdSend(connData, gzipNonSupportedMessage, -1);
+					espFsClose(file);
+					return HTTPD_CGI_DONE;
+				}
 			}
 		}
 
-		connData->cgiData=file;
-		httpdStartResponse(connData, 200);
-		httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
-		if (isGzip) {
-			httpdHeader(connData, "Content-Encoding", "gzip");
+		// If the client already has this version of the file, tell it so. That doesn't need a
+		// single byte of the file itself, so it doesn't get decompressed either. The unpacked
+		// file isn't the same thing as the gzipped one, so it gets an ETag of its own: a cache
+		// that has one of them can't be told it has the other.
+		os_sprintf(etag, gunzip?"\"%08x-gz\"":"\"%08x\"", (unsigned int)espFsHash(file));
+		if (httpdGetHeader(connData, "If-None-Match", ifNoneMatch, sizeof(ifNoneMatch)) &&
+				(os_strstr(ifNoneMatch, etag)!=NULL || os_strcmp(ifNoneMatch, "*")==0)) {
+			httpdStartResponse(connData, 304);
+			//What the client has depends on what it accepts, same as for the 200.
+			if (espFsFlags(file)&FLAG_GZIP) httpdHeader(connData, "Vary", "Accept-Encoding");
+			httpdHeader(connData, "ETag", etag);
+			httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+			httpdSendLength(connData, espFsSize(file));
+			httpdEndHeaders(connData);
+			espFsClose(file);
+			return HTTPD_CGI_DONE;
+		}
+
+		//mkespfsimage already made the headers; the ones about the file itself are also
+		//what goes with a part of it.
+		hdrLen=espFsHeaders(file, buff, sizeof(buff), &entity);
+		if (hdrLen<0) {
+			espFsClose(file);
+			return HTTPD_CGI_NOTFOUND;
+		}
+
+		st=(EspFsSendState*)os_malloc(sizeof(EspFsSendState));
+		if (st==NULL) {
+			espFsClose(file);
+			return HTTPD_CGI_NOTFOUND;
+		}
+		st->file=file;
+		connData->cgiData=st;
+		if (gunzip) {
+			//The stored headers are about the gzipped file, not about what this client gets.
+			if (httpdStartRangeResponse(connData, espFsSize(file), etag, &start, &st->left)==206) {
+				espFsSkip(file, start);
+			}
+			httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
+			httpdHeader(connData, "Vary", "Accept-Encoding");
+			httpdHeader(connData, "ETag", etag);
+			httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+		} else if (httpdGetHeader(connData, "Range", range, sizeof(range))) {
+			if (httpdStartRangeResponse(connData, espFsSize(file), etag, &start, &st->left)==206) {
+				//Compressed files have to be decompressed up to the start of the range; the
+				//others just move their read position.
+				espFsSkip(file, start);
+			}
+			httpdSend(connData, buff+entity, hdrLen-entity);
+		} else {
+			//Plain request for the whole file: its headers go out as they are.
+			httpdStartResponseHeaders(connData, 200, buff, hdrLen, 1);
+			st->left=espFsSize(file);
 		}
-		httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
 		httpdEndHeaders(connData);
+		if (st->left==0) {
+			//Empty file, or a range that isn't in it
+			espFsClose(file);
+			os_free(st);
+			return HTTPD_CGI_DONE;
+		}
 		return HTTPD_CGI_MORE;
 	}
 
-	len=espFsRead(file, buff, 1024);
-	if (len>0) espconn_sent(connData->conn, (uint8 *)buff, len);
-	if (len!=1024) {
+	map=espFsMap(st->file, &len);
+	if (len>st->left) len=st->left;
+	if (map!=NULL && len>=4) {
+		//Uncompressed data can go straight from the flash mapping to espconn, without a copy in
+		//between. Only whole words are sent from there; the last few bytes of the file are read
+		//the normal way. A range can start anywhere in the file, so that may have to be done
+		//for its first few bytes too, until the read position is aligned.
+		if (((uint32_t)map&3)==0) {
+			if (len>1024) len=1024;
+			len&=~3;
+			//If it doesn't fit in the send buffer, the read position stays where it is and
+			//this is tried again once the buffer has been sent.
+			if (!httpdSendDirect(connData, map, len)) return HTTPD_CGI_MORE;
+			espFsSkip(st->file, len);
+			st->left-=len;
+			return HTTPD_CGI_MORE;
+		}
+		len=4-((uint32_t)map&3);
+	} else {
+		len=(st->left>1024)?1024:st->left;
+	}
+
+	//What's read can't be put back, so only read as much as can be sent. The send buffer
+	//only has less room than that if it holds data that's waiting to go out.
+	if (len>httpdSendSpace(connData)) len=httpdSendSpace(connData);
+	if (len==0 && st->left>0) return HTTPD_CGI_MORE;
+	len=espFsRead(st->file, buff, len);
+	if (len>0 && !httpdSendDirect(connData, buff, len)) {
+		//No memory for a send buffer. The data is gone, so the response can't be finished.
+		os_printf("cgiEspFsHook: can't send %s\n", connData->url);
+		httpdAbortResponse(connData);
+		espFsClose(st->file);
+		os_free(st);
+		return HTTPD_CGI_DONE;
+	}
+	st->left-=(len>0)?len:0;
+	if (len<=0 && st->left>0) {
+		//The file couldn't be unpacked all the way, so the client doesn't get what the
+		//Content-Length promised. Closing the connection is the only way to tell it that.
+		os_printf("cgiEspFsHook: %s is broken, %d bytes short\n", connData->url, st->left);
+		httpdAbortResponse(connData);
+	}
+	if (len<=0 || st->left==0) {
 		//We're done.
-		espFsClose(file);
+		espFsClose(st->file);
+		os_free(st);
 		return HTTPD_CGI_DONE;
 	} else {
 		//Ok, till next time.
@@ -94,16 +204,17 @@ typedef struct {
 	void *tplArg;
 	char token[64];
 	int tokenPos;
+	char buff[1024]; //the part of the file that's being sent
+	int buffLen; //bytes in buff
+	int buffPos; //first byte in buff that hasn't been sent yet
 } TplData;
 
 typedef void (* TplCallback)(HttpdConnData *connData, char *token, void **arg);
 
 int ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 	TplData *tpd=connData->cgiData;
-	int len;
 	int x, sp=0;
-	char *e=NULL;
-	char buff[1025];
+	char *e;
 
 	if (connData->conn==NULL) {
 		//Connection aborted. Clean up.
@@ -116,9 +227,12 @@ int ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 	if (tpd==NULL) {
 		//First call to this cgi. Open the file so we can read it.
 		tpd=(TplData *)os_malloc(sizeof(TplData));
+		if (tpd==NULL) return HTTPD_CGI_NOTFOUND;
 		tpd->file=espFsOpen(connData->url);
 		tpd->tplArg=NULL;
 		tpd->tokenPos=-1;
+		tpd->buffLen=0;
+		tpd->buffPos=0;
 		if (tpd->file==NULL) {
 			espFsClose(tpd->file);
 			os_free(tpd);
@@ -137,45 +251,55 @@ int ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 		return HTTPD_CGI_MORE;
 	}
 
-	len=espFsRead(tpd->file, buff, 1024);
-	if (len>0) {
-		sp=0;
-		e=buff;
-		for (x=0; x<len; x++) {
-			if (tpd->tokenPos==-1) {
-				//Inside ordinary text.
-				if (buff[x]=='%') {
-					//Send raw data up to now
-					if (sp!=0) httpdSend(connData, e, sp);
-					sp=0;
-					//Go collect token chars.
-					tpd->tokenPos=0;
-				} else {
-					sp++;
-				}
+	if (tpd->buffPos==tpd->buffLen) {
+		//All of the last part went out; read the next one.
+		tpd->buffLen=espFsRead(tpd->file, tpd->buff, sizeof(tpd->buff));
+		if (tpd->buffLen<0) tpd->buffLen=0;
+		tpd->buffPos=0;
+	}
+	//What a token callback sends can fill up the send buffer. If something doesn't fit, this
+	//stops at it and carries on from there the next time, when the buffer has been sent.
+	e=&tpd->buff[tpd->buffPos];
+	for (x=tpd->buffPos; x<tpd->buffLen; x++) {
+		if (tpd->tokenPos==-1) {
+			//Inside ordinary text.
+			if (tpd->buff[x]=='%') {
+				//Send raw data up to now
+				if (sp!=0 && !httpdSend(connData, e, sp)) break;
+				sp=0;
+				//Go collect token chars.
+				tpd->tokenPos=0;
 			} else {
-				if (buff[x]=='%') {
-					if (tpd->tokenPos==0) {
-						//This is the second % of a %% escape string.
-						//Send a single % and resume with the normal program flow.
-						httpdSend(connData, "%", 1);
-					} else {
-						//This is an actual token.
-						tpd->token[tpd->tokenPos++]=0; //zero-terminate token
-						((TplCallback)(connData->cgiArg))(connData, tpd->token, &tpd->tplArg);
-					}
-					//Go collect normal chars again.
-					e=&buff[x+1];
-					tpd->tokenPos=-1;
+				sp++;
+			}
+		} else {
+			if (tpd->buff[x]=='%') {
+				if (tpd->tokenPos==0) {
+					//This is the second % of a %% escape string.
+					//Send a single % and resume with the normal program flow.
+					if (!httpdSend(connData, "%", 1)) break;
 				} else {
-					if (tpd->tokenPos<(sizeof(tpd->token)-1)) tpd->token[tpd->tokenPos++]=buff[x];
+					//This is an actual token.
+					tpd->token[tpd->tokenPos++]=0; //zero-terminate token
+					((TplCallback)(connData->cgiArg))(connData, tpd->token, &tpd->tplArg);
 				}
+				//Go collect normal chars again.
+				e=&tpd->buff[x+1];
+				tpd->tokenPos=-1;
+			} else {
+				if (tpd->tokenPos<(sizeof(tpd->token)-1)) tpd->token[tpd->tokenPos++]=tpd->buff[x];
 			}
 		}
 	}
 	//Send remaining bit.
-	if (sp!=0) httpdSend(connData, e, sp);
-	if (len!=1024) {
+	if (x==tpd->buffLen && sp!=0 && !httpdSend(connData, e, sp)) x=e-tpd->buff;
+	if (x<tpd->buffLen) {
+		//Didn't fit; it's sent from where it stopped the next time.
+		tpd->buffPos=(tpd->tokenPos==-1)?e-tpd->buff:x;
+		return HTTPD_CGI_MORE;
+	}
+	tpd->buffPos=tpd->buffLen;
+	if (tpd->buffLen!=sizeof(tpd->buff)) {
 		//We're done.
 		((TplCallback)(connData->cgiArg))(connData, NULL, &tpd->tplArg);
 		espFsClose(tpd->file);
@@ -0,0 +1,309 @@
+/*
+Incremental parser for POST bodies. Takes the body in whatever pieces it comes in and calls back
+for every form field, every start of an uploaded file and every piece of file data, so a cgi never
+needs to have more than one chunk of the body in memory.
+*/
+
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <esp8266.h>
+#include "httpdpost.h"
+
+//Kinds of body
+#define PT_RAW 0
+#define PT_URLENC 1
+#define PT_MULTIPART 2
+
+//Parser states
+#define PST_PREAMBLE 0 //multipart: before the first boundary
+#define PST_DELIMEND 1 //multipart: after a boundary, looking for the end of its line
+#define PST_PARTHDR 2 //multipart: in the headers of a part
+#define PST_PARTDATA 3 //multipart: in the data of a part
+#define PST_EPILOGUE 4 //multipart: after the final boundary
+#define PST_NAME 5 //urlencoded: in the name of a field
+#define PST_VALUE 6 //urlencoded: in the value of a field
+#define PST_RAW 7 //raw: everything is data
+
+struct HttpdPostParser {
+	const HttpdPostCallbacks *cb;
+	void *arg;
+	HttpdConnData *conn;
+	char type;
+	char state;
+	char started; //fileStart has been called, for raw bodies
+	char isFile; //current multipart part is a file
+	char esc; //url decoding: amount of hex digits of an escape seen so far, plus one
+	char escVal;
+	char dashes; //amount of dashes after a boundary
+	int left; //amount of body bytes that haven't been parsed yet
+	char delim[80]; //boundary, with the CRLF and dashes in front of it
+	int delimLen;
+	int match; //amount of bytes of delim matched so far
+	char line[128]; //current line of the part headers
+	int lineLen;
+	char name[32];
+	int nameLen;
+	char filename[64];
+	char val[HTTPD_POST_MAX_VAL+1];
+	int valLen;
+};
+
+static int ICACHE_FLASH_ATTR postHexVal(char c) {
+	if (c>='0' && c<='9') return c-'0';
+	if (c>='A' && c<='F') return c-'A'+10;
+	if (c>='a' && c<='f') return c-'a'+10;
+	return 0;
+}
+
+//Case-insensitive check if s starts with prefix.
+static int ICACHE_FLASH_ATTR postPrefixNoCase(const char *s, const char *prefix) {
+	while (*prefix!=0) {
+		char cs=*s++, cp=*prefix++;
+		if (cs>='A' && cs<='Z') cs+='a'-'A';
+		if (cp>='A' && cp<='Z') cp+='a'-'A';
+		if (cs!=cp) return 0;
+	}
+	return 1;
+}
+
+//Start a parser for the body of the POST request on connData. The kind of body is decided by its
+//Content-Type: urlencoded forms and multipart forms are split into fields and files, anything
+//else is passed as one big file.
+HttpdPostParser ICACHE_FLASH_ATTR *httpdPostParserNew(HttpdConnData *connData, const HttpdPostCallbacks *cb, void *arg) {
+	HttpdPostParser *p;
+	char type[40];
+	p=(HttpdPostParser*)os_malloc(sizeof(HttpdPostParser));
+	if (p==NULL) return NULL;
+	os_memset(p, 0, sizeof(HttpdPostParser));
+	p->cb=cb;
+	p->arg=arg;
+	p->conn=connData;
+	p->left=connData->post->len;
+	if (connData->post->multipartBoundary!=NULL) {
+		//The boundary is stored as "--boundary"; it may still be quoted and have other
+		//parameters after it.
+		char *b=connData->post->multipartBoundary+2;
+		p->type=PT_MULTIPART;
+		p->state=PST_PREAMBLE;
+		os_memcpy(p->delim, "\r\n--", 4);
+		p->delimLen=4;
+		if (*b=='"') b++;
+		while (*b!=0 && *b!='"' && *b!=';' && *b!=' ' && p->delimLen<sizeof(p->delim)-1) p->delim[p->delimLen++]=*b++;
+		//The first boundary doesn't have a CRLF in front of it.
+		p->match=2;
+	} else if (httpdGetHeader(connData, "Content-Type", type, sizeof(type)) &&
+			postPrefixNoCase(type, "application/x-www-form-urlencoded")) {
+		p->type=PT_URLENC;
+		p->state=PST_NAME;
+	} else {
+		p->type=PT_RAW;
+		p->state=PST_RAW;
+	}
+	return p;
+}
+
+void ICACHE_FLASH_ATTR httpdPostParserFree(HttpdPostParser *p) {
+	if (p!=NULL) os_free(p);
+}
+
+//Hand a field that's complete to the callback.
+static void ICACHE_FLASH_ATTR postField(HttpdPostParser *p) {
+	p->name[p->nameLen]=0;
+	p->val[p->valLen]=0;
+	if (p->cb->field) p->cb->field(p->conn, p->arg, p->name, p->val);
+	p->nameLen=0;
+	p->valLen=0;
+}
+
+//Data for the current multipart part.
+static void ICACHE_FLASH_ATTR postPartData(HttpdPostParser *p, char *data, int len) {
+	if (len<=0) return;
+	if (p->isFile) {
+		if (p->cb->data) p->cb->data(p->conn, p->arg, data, len);
+	} else {
+		if (len>HTTPD_POST_MAX_VAL-p->valLen) len=HTTPD_POST_MAX_VAL-p->valLen;
+		os_memcpy(p->val+p->valLen, data, len);
+		p->valLen+=len;
+	}
+}
+
+//Copy the value of a parameter of a header line, like the name in 'form-data; name="foo"',
+//into out. Returns 1 if the parameter is there.
+static int ICACHE_FLASH_ATTR postHdrParam(char *line, const char *param, char *out, int outLen) {
+	char *p=line;
+	int plen=os_strlen(param), i=0;
+	while ((p=(char*)os_strstr(p, ";"))!=NULL) {
+		p++;
+		while (*p==' ') p++;
+		if (postPrefixNoCase(p, param) && p[plen]=='=') {
+			p+=plen+1;
+			if (*p=='"') {
+				p++;
+				while (*p!=0 && *p!='"' && i<outLen-1) out[i++]=*p++;
+			} else {
+				while (*p!=0 && *p!=';' && *p!=' ' && i<outLen-1) out[i++]=*p++;
+			}
+			out[i]=0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//A line of the headers of a multipart part is in. The only one that matters is the
+//Content-Disposition, which tells the name of the field and if it's a file.
+static void ICACHE_FLASH_ATTR postPartHeader(HttpdPostParser *p) {
+	p->line[p->lineLen]=0;
+	if (!postPrefixNoCase(p->line, "Content-Disposition:")) return;
+	postHdrParam(p->line, "name", p->name, sizeof(p->name));
+	p->nameLen=os_strlen(p->name);
+	if (postHdrParam(p->line, "filename", p->filename, sizeof(p->filename))) p->isFile=1;
+}
+
+//Add a byte of a urlencoded form to buff, decoding it on the way. Escapes can be cut in
+//half by the end of a chunk, so the decoding state lives in the parser.
+static void ICACHE_FLASH_ATTR postUrlDecodePut(HttpdPostParser *p, char c, char *buff, int *len, int max) {
+	if (p->esc==1) {
+		p->escVal=postHexVal(c)<<4;
+		p->esc=2;
+		return;
+	} else if (p->esc==2) {
+		c=p->escVal+postHexVal(c);
+		p->esc=0;
+	} else if (c=='%') {
+		p->esc=1;
+		return;
+	} else if (c=='+') {
+		c=' ';
+	}
+	if (*len<max) buff[(*len)++]=c;
+}
+
+//Feed a piece of the body into the parser. Returns 1 if that was the end of the body.
+int ICACHE_FLASH_ATTR httpdPostParse(HttpdPostParser *p, char *data, int len) {
+	int i, start=0;
+	if (p==NULL) return 1;
+	if (len>p->left) len=p->left;
+	for (i=0; i<len; i++) {
+		char c=data[i];
+		switch (p->state) {
+		case PST_RAW:
+			if (!p->started && p->cb->fileStart) p->cb->fileStart(p->conn, p->arg, NULL, NULL);
+			p->started=1;
+			if (p->cb->data) p->cb->data(p->conn, p->arg, data, len);
+			i=len;
+			break;
+		case PST_NAME:
+			if (c=='=') {
+				p->esc=0;
+				p->state=PST_VALUE;
+			} else if (c=='&') {
+				if (p->nameLen>0) postField(p);
+				p->esc=0;
+			} else if (c!='\r' && c!='\n') {
+				postUrlDecodePut(p, c, p->name, &p->nameLen, sizeof(p->name)-1);
+			}
+			break;
+		case PST_VALUE:
+			if (c=='&') {
+				postField(p);
+				p->esc=0;
+				p->state=PST_NAME;
+			} else if (c!='\r' && c!='\n') {
+				postUrlDecodePut(p, c, p->val, &p->valLen, HTTPD_POST_MAX_VAL);
+			}
+			break;
+		case PST_PREAMBLE:
+			if (c==p->delim[p->match]) {
+				p->match++;
+				if (p->match==p->delimLen) {
+					p->match=0;
+					p->dashes=0;
+					p->state=PST_DELIMEND;
+				}
+			} else {
+				p->match=(c=='\r')?1:0;
+			}
+			break;
+		case PST_DELIMEND:
+			if (c=='-') {
+				if (++p->dashes==2) p->state=PST_EPILOGUE;
+			} else if (c=='\n') {
+				p->lineLen=0;
+				p->nameLen=0;
+				p->valLen=0;
+				p->isFile=0;
+				p->filename[0]=0;
+				p->state=PST_PARTHDR;
+			}
+			break;
+		case PST_PARTHDR:
+			if (c=='\n') {
+				if (p->lineLen==0) {
+					//Empty line: the data of the part starts here.
+					p->name[p->nameLen]=0;
+					if (p->isFile && p->cb->fileStart) p->cb->fileStart(p->conn, p->arg, p->name, p->filename);
+					p->match=0;
+					p->state=PST_PARTDATA;
+					start=i+1;
+				} else {
+					postPartHeader(p);
+					p->lineLen=0;
+				}
+			} else if (c!='\r' && p->lineLen<sizeof(p->line)-1) {
+				p->line[p->lineLen++]=c;
+			}
+			break;
+		case PST_PARTDATA:
+			if (p->match>0) {
+				if (c==p->delim[p->match]) {
+					p->match++;
+					if (p->match==p->delimLen) {
+						//End of the part.
+						if (p->isFile) {
+							if (p->cb->data) p->cb->data(p->conn, p->arg, NULL, 0);
+						} else {
+							postField(p);
+						}
+						p->match=0;
+						p->dashes=0;
+						p->state=PST_DELIMEND;
+					}
+					break;
+				}
+				//Wasn't the boundary after all; what matched so far is data.
+				postPartData(p, p->delim, p->match);
+				p->match=0;
+				start=i;
+			}
+			//Boundary names can't contain a CR, so the only place a match can start is at
+			//the CR at the start of delim.
+			if (c=='\r') {
+				postPartData(p, data+start, i-start);
+				p->match=1;
+			}
+			break;
+		case PST_EPILOGUE:
+			i=len;
+			break;
+		}
+	}
+	//Data of the part that's left in this piece
+	if (p->state==PST_PARTDATA && p->match==0) postPartData(p, data+start, len-start);
+	p->left-=len;
+	if (p->left>0) return 0;
+	//End of the body.
+	if (p->type==PT_URLENC && (p->nameLen>0 || p->state==PST_VALUE)) postField(p);
+	if (p->type==PT_RAW) {
+		if (!p->started && p->cb->fileStart) p->cb->fileStart(p->conn, p->arg, NULL, NULL);
+		if (p->cb->data) p->cb->data(p->conn, p->arg, NULL, 0);
+	}
+	return 1;
+}
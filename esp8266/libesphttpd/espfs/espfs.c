@@ -45,6 +45,13 @@ It's written for use with httpd, but doesn't need to be used as such.
 #include "heatshrink_decoder.h"
 #endif
 
+#ifdef GZIP_COMPRESSION
+#include "gunzip.h"
+#endif
+
+//Not a compression of the image: how a gzipped file is read after espFsGunzip.
+#define COMPRESS_GUNZIP 0x7f
+
 static char* espFsData = NULL;
 
 
@@ -123,7 +130,75 @@ int ICACHE_FLASH_ATTR espFsFlags(EspFsFile *fh) {
 	return (int)flags;
 }
 
-//Open a file and return a pointer to the file desc struct.
+// Returns the amount of bytes espFsRead will return for the opened file, in total.
+int ICACHE_FLASH_ATTR espFsSize(EspFsFile *fh) {
+	int32_t len;
+	if (fh == NULL) return -1;
+	if (fh->decompressor==COMPRESS_NONE) {
+		readFlashUnaligned((char*)&len, (char*)&fh->header->fileLenComp, 4);
+	} else {
+		readFlashUnaligned((char*)&len, (char*)&fh->header->fileLenDecomp, 4);
+	}
+	return (int)len;
+}
+
+// Returns the hash mkespfsimage made of the contents of the opened file. It changes when the
+// file does, so it can be used as an ETag.
+uint32_t ICACHE_FLASH_ATTR espFsHash(EspFsFile *fh) {
+	uint32_t hash;
+	if (fh == NULL) return 0;
+	readFlashUnaligned((char*)&hash, (char*)&fh->header->hash, 4);
+	return hash;
+}
+
+//Copies the response headers mkespfsimage made for the opened file into buff: the status line
+//and headers for sending the whole file, without the empty line that ends them. Returns their
+//length, or -1 if they don't fit in len bytes. *entity is set to where the headers about the
+//file itself start, for use with other answers than a plain 200.
+int ICACHE_FLASH_ATTR espFsHeaders(EspFsFile *fh, char *buff, int len, int *entity) {
+	EspFsHeader h;
+	if (fh==NULL) return -1;
+	spi_flash_read((uint32)fh->header, (uint32*)&h, sizeof(EspFsHeader));
+	if (h.hdrLen>len) return -1;
+	readFlashUnaligned(buff, (char*)fh->header+sizeof(EspFsHeader)+h.nameLen, h.hdrLen);
+	*entity=h.hdrEntity;
+	return h.hdrLen;
+}
+
+#ifdef GZIP_COMPRESSION
+//Hands the gunzipper the next part of the stored file.
+static int ICACHE_FLASH_ATTR espFsGunzipFill(void *arg, uint8_t *buf, int len) {
+	EspFsFile *fh=(EspFsFile *)arg;
+	int flen;
+	readFlashUnaligned((char*)&flen, (char*)&fh->header->fileLenComp, 4);
+	if (len>flen-(fh->posComp-fh->posStart)) len=flen-(fh->posComp-fh->posStart);
+	readFlashUnaligned((char*)buf, fh->posComp, len);
+	fh->posComp+=len;
+	return len;
+}
+#endif
+
+//Makes espFsRead return a file that's stored gzipped (FLAG_GZIP) as it was before, for clients
+//that don't take gzip. Do this before reading anything. espFsSize then is about what's read, too;
+//espFsHash stays the hash of the gzipped file. Returns 0 if the file isn't gzipped or there's no
+//memory for the gunzipper.
+int ICACHE_FLASH_ATTR espFsGunzip(EspFsFile *fh) {
+#ifdef GZIP_COMPRESSION
+	Gunzip *g;
+	if (fh==NULL || fh->decompressor!=COMPRESS_NONE || !(espFsFlags(fh)&FLAG_GZIP)) return 0;
+	g=(Gunzip *)os_malloc(sizeof(Gunzip));
+	if (g==NULL) return 0;
+	gunzipInit(g, espFsGunzipFill, fh);
+	fh->decompressor=COMPRESS_GUNZIP;
+	fh->decompData=g;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+//Open a file and return a pointer to the file desc struct. For compressed files, the
+//decompressor is only set up when the file actually gets read.
 EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
 	if (espFsData == NULL) {
 		os_printf("Call espFsInit first!\n");
@@ -157,7 +232,7 @@ EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
 //				namebuf, (unsigned int)h.nameLen, (unsigned int)h.fileLenComp, h.compression, h.flags);
 		if (os_strcmp(namebuf, fileName)==0) {
 			//Yay, this is the file we need!
-			p+=h.nameLen; //Skip to content.
+			p+=h.nameLen+((h.hdrLen+3)&~3); //Skip to content.
 			r=(EspFsFile *)os_malloc(sizeof(EspFsFile)); //Alloc file desc mem
 //			os_printf("Alloc %p\n", r);
 			if (r==NULL) return NULL;
@@ -166,28 +241,22 @@ EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
 			r->posComp=p;
 			r->posStart=p;
 			r->posDecomp=0;
+			r->decompData=NULL;
 			if (h.compression==COMPRESS_NONE) {
-				r->decompData=NULL;
 #ifdef ESPFS_HEATSHRINK
 			} else if (h.compression==COMPRESS_HEATSHRINK) {
-				//File is compressed with Heatshrink.
-				char parm;
-				heatshrink_decoder *dec;
-				//Decoder params are stored in 1st byte.
-				readFlashUnaligned(&parm, r->posComp, 1);
+				//File is compressed with Heatshrink. Decoder params are stored in 1st byte.
 				r->posComp++;
-				os_printf("Heatshrink compressed file; decode parms = %x\n", parm);
-				dec=heatshrink_decoder_alloc(16, (parm>>4)&0xf, parm&0xf);
-				r->decompData=dec;
 #endif
 			} else {
 				os_printf("Invalid compression: %d\n", h.compression);
+				os_free(r);
 				return NULL;
 			}
 			return r;
 		}
-		//We don't need this file. Skip name and file
-		p+=h.nameLen+h.fileLenComp;
+		//We don't need this file. Skip name, response headers and file
+		p+=h.nameLen+((h.hdrLen+3)&~3)+h.fileLenComp;
 		if ((int)p&3) p+=4-((int)p&3); //align to next 32bit val
 	}
 }
@@ -217,10 +286,18 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 		size_t elen, rlen;
 		char ebuff[16];
 		heatshrink_decoder *dec=(heatshrink_decoder *)fh->decompData;
-//		os_printf("Alloc %p\n", dec);
 		if (fh->posDecomp == fdlen) {
 			return 0;
 		}
+		if (dec==NULL) {
+			//First read of the file. Set up the decoder.
+			char parm;
+			readFlashUnaligned(&parm, fh->posStart, 1);
+			os_printf("Heatshrink compressed file; decode parms = %x\n", parm);
+			dec=heatshrink_decoder_alloc(16, (parm>>4)&0xf, parm&0xf);
+			if (dec==NULL) return 0;
+			fh->decompData=dec;
+		}
 
 		// We must ensure that whole file is decompressed and written to output buffer.
 		// This means even when there is no input data (elen==0) try to poll decoder until
@@ -252,21 +329,68 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 			}
 		}
 		return len;
+#endif
+#ifdef GZIP_COMPRESSION
+	} else if (fh->decompressor==COMPRESS_GUNZIP) {
+		len=gunzipRead((Gunzip *)fh->decompData, buff, len);
+		fh->posDecomp+=len;
+		return len;
 #endif
 	}
 	return 0;
 }
 
+//Get at the rest of the file as it's stored in flash, to be read through the memory-mapped
+//flash without copying it to RAM first. Only uncompressed files can be mapped; that includes
+//files that are gzipped by mkespfsimage, those are stored as-is. Returns the address of the
+//part of the file that hasn't been read yet and puts its length in len, or returns NULL if
+//the file can't be mapped. The address is 32-bit aligned, but remember the mapped flash can
+//only be read using aligned 32-bit accesses.
+const char ICACHE_FLASH_ATTR *espFsMap(EspFsFile *fh, int *len) {
+	int flen;
+	if (fh==NULL || fh->decompressor!=COMPRESS_NONE) return NULL;
+	readFlashUnaligned((char*)&flen, (char*)&fh->header->fileLenComp, 4);
+	*len=flen-(fh->posComp-fh->posStart);
+#ifdef __ets__
+	return (const char*)(0x40200000+(uint32_t)fh->posComp);
+#else
+	return fh->posComp;
+#endif
+}
+
+//Skip len bytes of the file, e.g. after sending them straight from the mapping returned by
+//espFsMap. Returns the actual amount of bytes skipped.
+int ICACHE_FLASH_ATTR espFsSkip(EspFsFile *fh, int len) {
+	int flen, skipped=0;
+	char buff[64];
+	if (fh==NULL) return 0;
+	if (fh->decompressor==COMPRESS_NONE) {
+		readFlashUnaligned((char*)&flen, (char*)&fh->header->fileLenComp, 4);
+		if (len>flen-(fh->posComp-fh->posStart)) len=flen-(fh->posComp-fh->posStart);
+		fh->posComp+=len;
+		fh->posDecomp+=len;
+		return len;
+	}
+	//Compressed data needs to go through the decompressor anyway.
+	while (skipped<len) {
+		int r=espFsRead(fh, buff, (len-skipped>sizeof(buff))?sizeof(buff):len-skipped);
+		if (r<=0) break;
+		skipped+=r;
+	}
+	return skipped;
+}
+
 //Close the file.
 void ICACHE_FLASH_ATTR espFsClose(EspFsFile *fh) {
 	if (fh==NULL) return;
 #ifdef ESPFS_HEATSHRINK
 	if (fh->decompressor==COMPRESS_HEATSHRINK) {
 		heatshrink_decoder *dec=(heatshrink_decoder *)fh->decompData;
-		heatshrink_decoder_free(dec);
+		if (dec!=NULL) heatshrink_decoder_free(dec);
 //		os_printf("Freed %p\n", dec);
 	}
 #endif
+	if (fh->decompressor==COMPRESS_GUNZIP) os_free(fh->decompData);
 //	os_printf("Freed %p\n", fh);
 	os_free(fh);
 }
@@ -9,9 +9,15 @@ when trying to do a <4byte or unaligned read.
 */
 
 /*
-The idea 'borrows' from cpio: it's basically a concatenation of {header, filename, file} data.
-Header, filename and file data is 32-bit aligned. The last file is indicated by data-less header
-with the FLAG_LASTFILE flag set.
+The idea 'borrows' from cpio: it's basically a concatenation of {header, filename, response
+headers, file} data. Header, filename, response headers and file data is 32-bit aligned. The last
+file is indicated by data-less header with the FLAG_LASTFILE flag set.
+Every header has a hash of the file contents, so a webserver can tell if a client already has
+the file without looking at the file data itself.
+The response headers are the HTTP status line and headers a webserver sends with the whole file,
+made up front so it doesn't have to compose them for every request. The part from hdrEntity on
+has the headers about the file itself (type, encoding, ETag) and is also usable for other answers
+about it, like partial ones.
 */
 
 
@@ -19,7 +25,14 @@ with the FLAG_LASTFILE flag set.
 #define FLAG_GZIP (1<<1)
 #define COMPRESS_NONE 0
 #define COMPRESS_HEATSHRINK 1
-#define ESPFS_MAGIC 0x73665345
+//Every header starts with this. It's also the version of the format: it changes whenever the
+//headers do, so an image made for another version is turned down instead of misread. "ESfs" was
+//the format before the file hash and the response headers.
+#define ESPFS_MAGIC 0x32665345 //"ESf2"
+
+//Files are gzipped with a window of this many bits, so the ESP can gunzip them for clients that
+//don't take gzip with just that much RAM for the window.
+#define ESPFS_GZIP_WBITS 11
 
 typedef struct {
 	int32_t magic;
@@ -28,6 +41,9 @@ typedef struct {
 	int16_t nameLen;
 	int32_t fileLenComp;
 	int32_t fileLenDecomp;
+	uint32_t hash; //FNV-1a of the uncompressed file, and of the flags
+	int16_t hdrLen; //length of the response headers, without padding
+	int16_t hdrEntity; //where the headers about the file start in those
 } __attribute__((packed)) EspFsHeader;
 
 #endif
\ No newline at end of file
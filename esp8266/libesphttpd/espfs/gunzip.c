@@ -0,0 +1,275 @@
+/*
+Small streaming gunzip, so espfs can send files that are stored gzipped to clients that don't
+accept gzip. It decodes deflate data the way Mark Adler's puff.c does, but stops whenever the
+output buffer is full and carries on from there on the next call, so a file can be sent in
+pieces without ever having all of it in RAM. Back-references can only go as far back as the
+window is big; mkespfsimage compresses with a window of ESPFS_GZIP_WBITS bits to match.
+*/
+
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+
+#ifdef __ets__
+#include <esp8266.h>
+#else
+#include <stdint.h>
+#include <string.h>
+#define os_memset memset
+#define ICACHE_FLASH_ATTR
+#endif
+#include "gunzip.h"
+
+#ifdef GZIP_COMPRESSION
+
+enum {GZ_HEADER, GZ_BLOCK, GZ_STORED, GZ_CODES, GZ_COPY, GZ_DONE, GZ_ERROR};
+
+#define WINDOW_MASK ((1<<ESPFS_GZIP_WBITS)-1)
+
+static const uint16_t lenBase[29]={3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lenExtra[29]={0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distBase[30]={1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distExtra[30]={0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+//Order in which the lengths of the code length code are stored
+static const uint8_t clOrder[19]={16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+//Moves on to the next state, unless running out of data already made this an error.
+static void ICACHE_FLASH_ATTR gunzipNext(Gunzip *g, int state) {
+	if (g->state!=GZ_ERROR) g->state=state;
+}
+
+//Returns the next byte of gzip data. Running out of it is an error; that returns zeroes.
+static int ICACHE_FLASH_ATTR gunzipByte(Gunzip *g) {
+	if (g->inPos==g->inLen) {
+		g->inLen=g->fill(g->fillArg, g->in, sizeof(g->in));
+		g->inPos=0;
+		if (g->inLen==0) {
+			g->state=GZ_ERROR;
+			return 0;
+		}
+	}
+	return g->in[g->inPos++];
+}
+
+//Returns the next n bits, n<=16. Deflate packs them starting at the lowest bit of a byte.
+static int ICACHE_FLASH_ATTR gunzipBits(Gunzip *g, int n) {
+	int v;
+	while (g->bitCnt<n) {
+		g->bitBuf|=(uint32_t)gunzipByte(g)<<g->bitCnt;
+		g->bitCnt+=8;
+	}
+	v=g->bitBuf&((1<<n)-1);
+	g->bitBuf>>=n;
+	g->bitCnt-=n;
+	return v;
+}
+
+//Makes the canonical Huffman code for n symbols with the given code lengths. Returns 0 if
+//there are more codes than the lengths allow.
+static int ICACHE_FLASH_ATTR gunzipBuild(uint16_t *count, uint16_t *symbol, const uint8_t *length, int n) {
+	uint16_t offs[16];
+	int left=1, i;
+	for (i=0; i<16; i++) count[i]=0;
+	for (i=0; i<n; i++) count[length[i]]++;
+	for (i=1; i<16; i++) {
+		left<<=1;
+		left-=count[i];
+		if (left<0) return 0;
+	}
+	offs[1]=0;
+	for (i=1; i<15; i++) offs[i+1]=offs[i]+count[i];
+	for (i=0; i<n; i++) {
+		if (length[i]!=0) symbol[offs[length[i]]++]=i;
+	}
+	return 1;
+}
+
+//Decodes a symbol with the given Huffman code, a bit at a time. Returns -1 for a code that
+//isn't in there.
+static int ICACHE_FLASH_ATTR gunzipDecode(Gunzip *g, const uint16_t *count, const uint16_t *symbol) {
+	int code=0, first=0, index=0, len;
+	for (len=1; len<16; len++) {
+		code|=gunzipBits(g, 1);
+		if (code-count[len]<first) return symbol[index+(code-first)];
+		index+=count[len];
+		first+=count[len];
+		first<<=1;
+		code<<=1;
+	}
+	return -1;
+}
+
+//Sets up the codes for a block that uses the fixed Huffman codes.
+static void ICACHE_FLASH_ATTR gunzipFixed(Gunzip *g) {
+	uint8_t length[288];
+	int i;
+	for (i=0; i<288; i++) length[i]=(i<144)?8:(i<256)?9:(i<280)?7:8;
+	gunzipBuild(g->lenCount, g->lenSym, length, 288);
+	for (i=0; i<30; i++) length[i]=5;
+	gunzipBuild(g->distCount, g->distSym, length, 30);
+}
+
+//Reads the codes of a block that brings its own Huffman codes. Returns 0 if they're broken.
+static int ICACHE_FLASH_ATTR gunzipDynamic(Gunzip *g) {
+	uint8_t length[286+30];
+	int nlen, ndist, ncode, i, sym, len, rep;
+	nlen=gunzipBits(g, 5)+257;
+	ndist=gunzipBits(g, 5)+1;
+	ncode=gunzipBits(g, 4)+4;
+	if (nlen>286 || ndist>30) return 0;
+	for (i=0; i<19; i++) length[clOrder[i]]=(i<ncode)?gunzipBits(g, 3):0;
+	//The code lengths are Huffman coded themselves. The literal/length code isn't there yet,
+	//so that's where their code goes in the meantime.
+	if (!gunzipBuild(g->lenCount, g->lenSym, length, 19)) return 0;
+	i=0;
+	while (i<nlen+ndist) {
+		sym=gunzipDecode(g, g->lenCount, g->lenSym);
+		if (sym<0) return 0;
+		if (sym<16) {
+			length[i++]=sym;
+			continue;
+		}
+		//Repeat the previous length, or a zero length
+		len=0;
+		if (sym==16) {
+			if (i==0) return 0;
+			len=length[i-1];
+			rep=3+gunzipBits(g, 2);
+		} else if (sym==17) {
+			rep=3+gunzipBits(g, 3);
+		} else {
+			rep=11+gunzipBits(g, 7);
+		}
+		if (i+rep>nlen+ndist) return 0;
+		while (rep--) length[i++]=len;
+	}
+	//A block without an end-of-block code can't end.
+	if (length[256]==0) return 0;
+	if (!gunzipBuild(g->lenCount, g->lenSym, length, nlen)) return 0;
+	return gunzipBuild(g->distCount, g->distSym, length+nlen, ndist);
+}
+
+//Skips the gzip header. Returns 0 if this isn't gzipped deflate data.
+static int ICACHE_FLASH_ATTR gunzipHeader(Gunzip *g) {
+	int flags, i;
+	if (gunzipByte(g)!=0x1f || gunzipByte(g)!=0x8b || gunzipByte(g)!=8) return 0;
+	flags=gunzipByte(g);
+	for (i=0; i<6; i++) gunzipByte(g); //Time, extra flags, OS
+	if (flags&4) {
+		//Extra field
+		i=gunzipByte(g);
+		i|=gunzipByte(g)<<8;
+		while (i-- && g->state!=GZ_ERROR) gunzipByte(g);
+	}
+	if (flags&8) while (gunzipByte(g)!=0) ; //File name
+	if (flags&16) while (gunzipByte(g)!=0) ; //Comment
+	if (flags&2) {
+		//Header CRC
+		gunzipByte(g);
+		gunzipByte(g);
+	}
+	return 1;
+}
+
+//Sets up g to gunzip the data it gets from fill.
+void ICACHE_FLASH_ATTR gunzipInit(Gunzip *g, GunzipFill fill, void *fillArg) {
+	os_memset(g, 0, sizeof(Gunzip));
+	g->fill=fill;
+	g->fillArg=fillArg;
+	g->state=GZ_HEADER;
+}
+
+//Gunzips up to len bytes into buff. Returns the amount of bytes it put there; less than len
+//means the data has ended, or is broken.
+int ICACHE_FLASH_ATTR gunzipRead(Gunzip *g, char *buff, int len) {
+	int n=0, sym, type;
+	while (n<len) {
+		switch (g->state) {
+		case GZ_HEADER:
+			if (gunzipHeader(g)) gunzipNext(g, GZ_BLOCK); else g->state=GZ_ERROR;
+			break;
+		case GZ_BLOCK:
+			if (g->last) {
+				//The CRC and length after the data aren't checked: mkespfsimage made the
+				//data, and it's in flash.
+				g->state=GZ_DONE;
+				break;
+			}
+			g->last=gunzipBits(g, 1);
+			type=gunzipBits(g, 2);
+			if (type==0) {
+				//Stored block. It starts at a byte boundary, with its length and the
+				//complement of that.
+				gunzipBits(g, g->bitCnt&7);
+				g->copyLen=gunzipBits(g, 16);
+				if ((gunzipBits(g, 16)^0xffff)!=g->copyLen) g->state=GZ_ERROR; else gunzipNext(g, GZ_STORED);
+			} else if (type==1) {
+				gunzipFixed(g);
+				gunzipNext(g, GZ_CODES);
+			} else if (type==2 && gunzipDynamic(g)) {
+				gunzipNext(g, GZ_CODES);
+			} else {
+				g->state=GZ_ERROR;
+			}
+			break;
+		case GZ_STORED:
+			while (g->copyLen>0 && n<len && g->state==GZ_STORED) {
+				buff[n++]=g->window[g->total++&WINDOW_MASK]=gunzipBits(g, 8);
+				g->copyLen--;
+			}
+			if (g->copyLen==0) gunzipNext(g, GZ_BLOCK);
+			break;
+		case GZ_CODES:
+			while (n<len && g->state==GZ_CODES) {
+				sym=gunzipDecode(g, g->lenCount, g->lenSym);
+				if (sym<0 || sym>=286) {
+					g->state=GZ_ERROR;
+				} else if (sym<256) {
+					buff[n++]=g->window[g->total++&WINDOW_MASK]=sym;
+				} else if (sym==256) {
+					gunzipNext(g, GZ_BLOCK);
+				} else {
+					//Copy of earlier data: its length, then how far back it is
+					sym-=257;
+					g->copyLen=lenBase[sym]+gunzipBits(g, lenExtra[sym]);
+					sym=gunzipDecode(g, g->distCount, g->distSym);
+					if (sym<0 || sym>=30) {
+						g->state=GZ_ERROR;
+						break;
+					}
+					g->copyDist=distBase[sym]+gunzipBits(g, distExtra[sym]);
+					if (g->copyDist>(1<<ESPFS_GZIP_WBITS) || g->copyDist>g->total) {
+						//Not made with our window size, or broken
+						g->state=GZ_ERROR;
+						break;
+					}
+					gunzipNext(g, GZ_COPY);
+				}
+			}
+			break;
+		case GZ_COPY:
+			while (g->copyLen>0 && n<len) {
+				buff[n]=g->window[(g->total-g->copyDist)&WINDOW_MASK];
+				g->window[g->total++&WINDOW_MASK]=buff[n++];
+				g->copyLen--;
+			}
+			if (g->copyLen==0) g->state=GZ_CODES;
+			break;
+		default:
+			//Done, or broken
+			return n;
+		}
+	}
+	return n;
+}
+
+#endif
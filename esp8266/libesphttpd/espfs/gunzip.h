@@ -0,0 +1,30 @@
+#ifndef GUNZIP_H
+#define GUNZIP_H
+
+#include "espfsformat.h"
+
+//Gets up to len bytes of gzip data; returns the amount of bytes it put in buf, 0 at the end.
+typedef int (*GunzipFill)(void *arg, uint8_t *buf, int len);
+
+typedef struct {
+	GunzipFill fill;
+	void *fillArg;
+	uint8_t in[16];
+	uint8_t inPos, inLen;
+	uint32_t bitBuf;
+	int8_t bitCnt;
+	int8_t state;
+	int8_t last;
+	int copyLen, copyDist;
+	uint32_t total;
+	//Huffman codes of the current block, as the amount of codes of each bit length and the
+	//symbols in code order
+	uint16_t lenCount[16], lenSym[288];
+	uint16_t distCount[16], distSym[30];
+	uint8_t window[1<<ESPFS_GZIP_WBITS];
+} Gunzip;
+
+void gunzipInit(Gunzip *g, GunzipFill fill, void *fillArg);
+int gunzipRead(Gunzip *g, char *buff, int len);
+
+#endif
@@ -1,3 +1,8 @@
+#ifdef __ets__
+#include <esp8266.h>
+#else
+#include <stdint.h>
+#endif
 #include "espfs.h"
 #ifdef ESPFS_HEATSHRINK
 //Stupid wrapper so we don't have to move c-files around
@@ -6,8 +11,6 @@
 #ifdef __ets__
 //esp build
 
-#include <esp8266.h>
-
 #define memset(x,y,z) os_memset(x,y,z)
 #define memcpy(x,y,z) os_memcpy(x,y,z)
 #endif
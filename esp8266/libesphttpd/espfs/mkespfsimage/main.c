@@ -10,6 +10,7 @@
 #include <string.h>
 #include "espfs.h"
 #include "espfsformat.h"
+#include "mimetypes.h"
 
 //Heatshrink
 #ifdef ESPFS_HEATSHRINK
@@ -102,8 +103,8 @@ size_t compressGzip(char *in, int insize, char *out, int outsize, int level) {
 	stream.avail_in = insize;
 	stream.next_out = out;
 	stream.avail_out = outsize;
-	// 31 -> 15 window bits + 16 for gzip
-	zresult = deflateInit2 (&stream, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+	// 16 for gzip, plus the window bits the ESP can afford when it has to gunzip the file itself
+	zresult = deflateInit2 (&stream, level, Z_DEFLATED, 16+ESPFS_GZIP_WBITS, 8, Z_DEFAULT_STRATEGY);
 	if (zresult != Z_OK) {
 		fprintf(stderr, "DeflateInit2 failed with code %d\n", zresult);
 		exit(1);
@@ -175,11 +176,48 @@ int parseGzipExtensions(char *input) {
 }
 #endif
 
+//FNV-1a hash, used to tell versions of a file apart
+uint32_t hashData(uint32_t h, const char *data, off_t len) {
+	while (len--) {
+		h^=(uint8_t)*data++;
+		h*=16777619u;
+	}
+	return h;
+}
+
+//The mime type of a file goes into its response headers, so the webserver doesn't have to look
+//it up.
+const char *getMimetype(char *name) {
+	int i=0;
+	char *ext=name+(strlen(name)-1);
+	while (ext!=name && *ext!='.') ext--;
+	if (*ext=='.') ext++;
+	while (mimeTypes[i].ext!=NULL && strcmp(ext, mimeTypes[i].ext)!=0) i++;
+	return mimeTypes[i].mimetype;
+}
+
+//Compose the headers the webserver sends with the whole file: everything but Connection and the
+//empty line that ends them. Returns their length; *entity is set to where the headers about the
+//file itself start.
+int makeHeaders(char *buff, char *name, off_t len, int8_t flags, uint32_t hash, int *entity) {
+	int l;
+	l=sprintf(buff, "HTTP/1.1 200 OK\r\nServer: esp8266-httpd/"HTTPDVER"\r\n"
+			"Accept-Ranges: bytes\r\nContent-Length: %d\r\n", (int)len);
+	*entity=l;
+	l+=sprintf(buff+l, "Content-Type: %s\r\n", getMimetype(name));
+	if (flags&FLAG_GZIP) l+=sprintf(buff+l, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+	l+=sprintf(buff+l, "ETag: \"%08x\"\r\nCache-Control: max-age=3600, must-revalidate\r\n", hash);
+	return l;
+}
+
 int handleFile(int f, char *name, int compression, int level, char **compName) {
 	char *fdat, *cdat;
 	off_t size, csize;
 	EspFsHeader h;
 	int nameLen;
+	char hdrs[512];
+	int hdrLen, hdrEntity;
+	uint32_t hash;
 	int8_t flags = 0;
 	size=lseek(f, 0, SEEK_END);
 	fdat=mmap(NULL, size, PROT_READ, MAP_SHARED, f, 0);
@@ -221,7 +259,7 @@ int handleFile(int f, char *name, int compression, int level, char **compName) {
 	}
 
 	//Fill header data
-	h.magic=('E'<<0)+('S'<<8)+('f'<<16)+('s'<<24);
+	h.magic=htoxl(ESPFS_MAGIC);
 	h.flags=flags;
 	h.compression=compression;
 	h.nameLen=nameLen=strlen(name)+1;
@@ -229,6 +267,13 @@ int handleFile(int f, char *name, int compression, int level, char **compName) {
 	h.nameLen=htoxs(h.nameLen);
 	h.fileLenComp=htoxl(csize);
 	h.fileLenDecomp=htoxl(size);
+	//A gzipped file is sent differently than the same file stored as-is, so it gets another hash.
+	hash=hashData(hashData(2166136261u, fdat, size), (char*)&flags, 1);
+	h.hash=htoxl(hash);
+	//Gzipped files are sent as they are stored, the others as they were before compression.
+	hdrLen=makeHeaders(hdrs, name, (flags&FLAG_GZIP)?csize:size, flags, hash, &hdrEntity);
+	h.hdrLen=htoxs(hdrLen);
+	h.hdrEntity=htoxs(hdrEntity);
 	
 	write(1, &h, sizeof(EspFsHeader));
 	write(1, name, nameLen);
@@ -236,6 +281,11 @@ int handleFile(int f, char *name, int compression, int level, char **compName) {
 		write(1, "\000", 1);
 		nameLen++;
 	}
+	write(1, hdrs, hdrLen);
+	while (hdrLen&3) {
+		write(1, "\000", 1);
+		hdrLen++;
+	}
 	write(1, cdat, csize);
 	//Pad out to 32bit boundary
 	while (csize&3) {
@@ -263,12 +313,15 @@ int handleFile(int f, char *name, int compression, int level, char **compName) {
 //Write final dummy header with FLAG_LASTFILE set.
 void finishArchive() {
 	EspFsHeader h;
-	h.magic=('E'<<0)+('S'<<8)+('f'<<16)+('s'<<24);
+	h.magic=htoxl(ESPFS_MAGIC);
 	h.flags=FLAG_LASTFILE;
 	h.compression=COMPRESS_NONE;
 	h.nameLen=htoxs(0);
 	h.fileLenComp=htoxl(0);
 	h.fileLenDecomp=htoxl(0);
+	h.hash=htoxl(0);
+	h.hdrLen=htoxs(0);
+	h.hdrEntity=htoxs(0);
 	write(1, &h, sizeof(EspFsHeader));
 }
 
@@ -0,0 +1,91 @@
+#ifndef HOSTTEST_H
+#define HOSTTEST_H
+
+#include <esp8266.h>
+
+//Kinds of callbacks the simulated SDK makes into the code under test. Stats are kept per kind.
+#define SIM_CB_CONNECT 0
+#define SIM_CB_RECV 1
+#define SIM_CB_SENT 2
+#define SIM_CB_DISCON 3
+#define SIM_CB_RECON 4
+#define SIM_CB_TIMER 5
+#define SIM_CB_COUNT 6
+
+//Size of the stack the callbacks run on. Way more than the ESP has, so we can see how much
+//is actually used.
+#define SIM_STACK_SIZE (64*1024)
+
+//Address the flash is mapped at on the ESP. The espfs image gets mapped into the host
+//address space at the same place, so pointers espfs hands out are valid as-is.
+#define SIM_FLASH_BASE 0x40200000
+//Offset in 'flash' the espfs image is put at
+#define SIM_ESPFS_OFFSET 0x40000
+
+typedef struct SimConn SimConn;
+
+//A connection from a simulated client.
+struct SimConn {
+	struct espconn conn; //needs to be first: callbacks get a pointer to this
+	esp_tcp tcp;
+	espconn_recv_callback recvCb;
+	espconn_sent_callback sentCb;
+	espconn_connect_callback disconCb;
+	espconn_reconnect_callback reconCb;
+	int sendPending; //espconn_sent was called and the sent callback hasn't been delivered yet
+	uint32 sentAt; //simulated time the pending data is through the radio, if it has a speed
+	int closing; //the server called espconn_disconnect
+	int closed;
+	int idleTimeout; //seconds, as set by espconn_regist_time; 0 is forever
+	uint32 lastActive; //simulated time of the last traffic, in us
+	char *out; //everything the server sent
+	int outLen;
+	int outSize;
+	SimConn *next;
+};
+
+typedef struct {
+	long calls;
+	long long totalNs;
+	long long maxNs;
+} SimCbStats;
+
+typedef struct {
+	SimCbStats cb[SIM_CB_COUNT];
+	long conns; //connections the stack accepted
+	long connRefused; //connections the stack refused because it had too many already
+	long bytesIn;
+	long bytesOut;
+	long sends;
+	long sendBusy; //espconn_sent calls while the previous send still was in flight
+	long sendClosed; //espconn_sent calls on a connection that was already closed
+	long recvDropped; //bytes the client sent after the server closed the connection
+	long heapCur;
+	long heapPeak;
+	long heapAllocs;
+	long heapFails;
+	long heapLimit; //make pvPortMalloc fail above this amount of bytes in use; 0 is no limit
+	long flashWrites;
+	long flashWritten; //bytes
+	long flashErases;
+} SimStats;
+
+extern SimStats simStats;
+extern const char *simCbNames[SIM_CB_COUNT];
+
+void simInit(void);
+int simMapImage(const char *file);
+int simCorruptFile(const char *name);
+void simRepairImage(void);
+SimConn *simConnect(void);
+void simRecv(SimConn *c, const char *data, int len);
+void simClose(SimConn *c);
+void simAbort(SimConn *c);
+int simPump(void);
+void simSleep(int ms);
+void simSetLinkRate(int bytesPerMs);
+void simDrain(void);
+void simFree(SimConn *c);
+int simStackPeak(void);
+
+#endif
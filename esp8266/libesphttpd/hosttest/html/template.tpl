@@ -0,0 +1,17 @@
+Template test, with 100%% of its text sent: %fill%
+Line 01 of the text after the fill token; it no longer fits in the send buffer.
+Line 02 of the text after the fill token; it no longer fits in the send buffer.
+Line 03 of the text after the fill token; it no longer fits in the send buffer.
+Line 04 of the text after the fill token; it no longer fits in the send buffer.
+Line 05 of the text after the fill token; it no longer fits in the send buffer.
+Line 06 of the text after the fill token; it no longer fits in the send buffer.
+Line 07 of the text after the fill token; it no longer fits in the send buffer.
+Line 08 of the text after the fill token; it no longer fits in the send buffer.
+Line 09 of the text after the fill token; it no longer fits in the send buffer.
+Line 10 of the text after the fill token; it no longer fits in the send buffer.
+Line 11 of the text after the fill token; it no longer fits in the send buffer.
+Line 12 of the text after the fill token; it no longer fits in the send buffer.
+Line 13 of the text after the fill token; it no longer fits in the send buffer.
+Line 14 of the text after the fill token; it no longer fits in the send buffer.
+Line 15 of the text after the fill token; it no longer fits in the send buffer.
+And a token at the end: %name%.
@@ -0,0 +1,1044 @@
+/*
+Host test harness for libesphttpd. Runs the webserver against the simulated SDK in mock.c,
+replays request traces at it and tells how it did: requests per second, how much stack and
+heap it needed and how much CPU time each kind of callback took.
+
+A trace is a text file with one item per line:
+  # comment          ignored, as are empty lines
+  conn [name]        open a new connection; the data after this goes over it
+  use <name>         send the data after this over an earlier opened connection
+  close              the client closes the current connection
+  abort              the current connection breaks without being closed
+  sleep <ms>         let ms of simulated time pass; timers and idle timeouts fire
+  rate <bytes/ms>    give the radio a speed, shared by all connections; 0 (the default) is
+                     infinitely fast. Time only passes in sleep; at the end of the trace, it
+                     passes until everything is sent.
+  corrupt <file>     damage a compressed file in the image so it can't be unpacked all the way;
+                     it's repaired at the end of the trace
+  expect <what>      what the response to a request on the current connection looks like,
+                     as items separated by ' | '. The first is the status code, 'raw' for
+                     data without a status line, like what comes after a 101, or 'closed' if
+                     the server hangs up without sending anything more. After that, any of:
+                       Name: value     the response has this header; a value of * is any
+                       !Name           the response doesn't have this header
+                       length <n>      the body is n bytes, without the chunked framing
+                       body <text>     the body is this; escapes as in data lines
+                       contains <text> the body has this in it somewhere
+                       close           the server closes the connection after it
+                       keep-alive      the server keeps the connection open after it
+                       cut             the server closes the connection before the body is as
+                                       long as its Content-Length; that has to be expected
+                     Expect lines are matched to the responses on their connection in order,
+                     so a connection that has them needs one for every response.
+  anything else      data the client sends over the current connection, usually a request.
+                     C-style escapes (\r \n \t \\ \xHH) can be used for the bytes that can't
+                     be in a text line.
+If there's data without a connection open, or the server closed the connection, a new one
+gets opened. Connections stay open until they're closed by either side; everything still open
+is closed at the end of the trace.
+
+Every data line counts as a request. Normally the response to a request is pumped out before
+the next one is sent; with -p all data for a connection is sent in one go, pipelining it.
+A response that doesn't match its expect line is reported, and makes hosttest exit with 1.
+Expect lines are skipped with -p and -m: httpd may close a connection whose pipelined data
+doesn't fit, and answers differently when it runs out of memory.
+*/
+
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <unistd.h>
+#include "hosttest.h"
+#include "httpd.h"
+#include "httpdespfs.h"
+#include "httpdpost.h"
+#include "espfs.h"
+#include "cgieventstream.h"
+#include "cgicache.h"
+#include "cgiflash.h"
+#ifdef HTTPD_WEBSOCKETS
+#include "cgiwebsocket.h"
+#endif
+
+static int segSize=1460;
+static int pipelined=0;
+static int verbose=0;
+
+//*** Cgis to test with ***
+
+//Echoes back the url and some args and headers.
+static int cgiEcho(HttpdConnData *connData) {
+	char buff[512], arg[64], hdr[64];
+	int len;
+	if (connData->conn==NULL) return HTTPD_CGI_DONE;
+	if (httpdGetArg(connData, "text", arg, sizeof(arg))<0) os_strcpy(arg, "-");
+	if (!httpdGetHeader(connData, "User-Agent", hdr, sizeof(hdr))) os_strcpy(hdr, "-");
+	len=os_sprintf(buff, "url=%s text=%s n=%d ua=%s\n", connData->url, arg, httpdGetArgInt(connData, "n", 0), hdr);
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "text/plain");
+	httpdSendLength(connData, len);
+	httpdEndHeaders(connData);
+	httpdSend(connData, buff, len);
+	return HTTPD_CGI_DONE;
+}
+
+//Streams n kilobytes of generated data, a bit at a time.
+static int cgiStream(HttpdConnData *connData) {
+	char buff[256];
+	int pos=(int)(intptr_t)connData->cgiData;
+	int n;
+	if (connData->conn==NULL) return HTTPD_CGI_DONE;
+	if (pos==0) {
+		httpdStartResponse(connData, 200);
+		httpdHeader(connData, "Content-Type", "text/plain");
+		httpdEndHeaders(connData);
+	}
+	n=httpdGetArgInt(connData, "kb", 4)*4;
+	while (pos<n && httpdSendSpace(connData)>=sizeof(buff)) {
+		os_memset(buff, 'a'+(pos%26), sizeof(buff));
+		httpdSend(connData, buff, sizeof(buff));
+		pos++;
+	}
+	connData->cgiData=(void*)(intptr_t)pos;
+	return (pos<n)?HTTPD_CGI_MORE:HTTPD_CGI_DONE;
+}
+
+//Takes a POST body apart and tells what was in it.
+typedef struct {
+	HttpdPostParser *parser;
+	int fields;
+	int files;
+	int bytes;
+} PostInfo;
+
+static void postField(HttpdConnData *connData, void *arg, char *name, char *val) {
+	((PostInfo*)arg)->fields++;
+}
+
+static void postFileStart(HttpdConnData *connData, void *arg, char *name, char *filename) {
+	((PostInfo*)arg)->files++;
+}
+
+static void postData(HttpdConnData *connData, void *arg, char *data, int len) {
+	((PostInfo*)arg)->bytes+=len;
+}
+
+static const HttpdPostCallbacks postCallbacks={postField, postFileStart, postData};
+
+static int cgiPost(HttpdConnData *connData) {
+	PostInfo *pi=(PostInfo*)connData->cgiPrivData;
+	char buff[128];
+	int len;
+	if (connData->conn==NULL) {
+		if (pi!=NULL) {
+			httpdPostParserFree(pi->parser);
+			os_free(pi);
+		}
+		return HTTPD_CGI_DONE;
+	}
+	if (pi==NULL) {
+		pi=(PostInfo*)os_malloc(sizeof(PostInfo));
+		os_memset(pi, 0, sizeof(PostInfo));
+		pi->parser=httpdPostParserNew(connData, &postCallbacks, pi);
+		connData->cgiPrivData=pi;
+	}
+	if (!httpdPostParse(pi->parser, connData->post->buff, connData->post->buffLen)) return HTTPD_CGI_MORE;
+	len=os_sprintf(buff, "fields=%d files=%d bytes=%d\n", pi->fields, pi->files, pi->bytes);
+	httpdPostParserFree(pi->parser);
+	os_free(pi);
+	connData->cgiPrivData=NULL;
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "text/plain");
+	httpdEndHeaders(connData);
+	httpdSend(connData, buff, len);
+	return HTTPD_CGI_DONE;
+}
+
+//Asks for POST chunks of size bytes, counted from body offset start, and tells how the body
+//came in: the amount of chunks, and how many of the ones after the first didn't end on a
+//chunk boundary, or were bigger than a chunk.
+typedef struct {
+	int chunks;
+	int misaligned;
+	int largest;
+} ChunkInfo;
+
+static int cgiPostChunks(HttpdConnData *connData) {
+	ChunkInfo *ci=(ChunkInfo*)connData->cgiPrivData;
+	HttpdPostData *post=connData->post;
+	int size=httpdGetArgInt(connData, "size", 1024);
+	int start=httpdGetArgInt(connData, "start", 0);
+	char buff[128];
+	int len;
+	if (connData->conn==NULL) {
+		os_free(ci);
+		return HTTPD_CGI_DONE;
+	}
+	if (ci==NULL) {
+		ci=(ChunkInfo*)os_malloc(sizeof(ChunkInfo));
+		os_memset(ci, 0, sizeof(ChunkInfo));
+		connData->cgiPrivData=ci;
+		httpdSetPostChunk(connData, size, start);
+	} else if (post->received!=post->len && ((post->received-start)%size!=0 || post->buffLen>size)) {
+		ci->misaligned++;
+	}
+	ci->chunks++;
+	if (post->buffLen>ci->largest) ci->largest=post->buffLen;
+	if (post->received<post->len) return HTTPD_CGI_MORE;
+	len=os_sprintf(buff, "chunks=%d misaligned=%d largest=%d\n", ci->chunks, ci->misaligned, ci->largest);
+	os_free(ci);
+	connData->cgiPrivData=NULL;
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "text/plain");
+	httpdEndHeaders(connData);
+	httpdSend(connData, buff, len);
+	return HTTPD_CGI_DONE;
+}
+
+#ifdef HTTPD_WEBSOCKETS
+static void wsEchoRecv(Websock *ws, char *data, int len, int flags) {
+	cgiWebsocketSend(ws, data, len, flags);
+}
+
+static void wsEchoConnect(Websock *ws) {
+	ws->recvCb=wsEchoRecv;
+}
+#endif
+
+static void esConnect(EventStream *es) {
+	cgiEventStreamSend(es, "hello", "first line\nsecond line");
+}
+
+//Sends the msg arg as an event to everyone listening at /events.
+static int cgiNotify(HttpdConnData *connData) {
+	char msg[64], buff[32];
+	int len;
+	if (connData->conn==NULL) return HTTPD_CGI_DONE;
+	if (httpdGetArg(connData, "msg", msg, sizeof(msg))<0) os_strcpy(msg, "ping");
+	len=os_sprintf(buff, "%d\n", cgiEventStreamBroadcast("/events", "notify", msg));
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "text/plain");
+	httpdEndHeaders(connData);
+	httpdSend(connData, buff, len);
+	return HTTPD_CGI_DONE;
+}
+
+//Tells how often it got called, like a cgi that asks slow hardware would tell something new
+//every time. With the fail arg it answers with an error that shouldn't be cached. The count
+//and the cache start over for every replay of a trace, so each replay gets the same answers.
+static int counterCalls;
+
+static int cgiCounter(HttpdConnData *connData) {
+	char buff[32];
+	int len;
+	if (connData->conn==NULL) return HTTPD_CGI_DONE;
+	if (httpdGetArgInt(connData, "fail", 0)) {
+		cgiCacheNoStore(connData);
+		httpdSend(connData, "no answer", -1);
+		return HTTPD_CGI_DONE;
+	}
+	len=os_sprintf(buff, "call %d\n", ++counterCalls);
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "text/plain");
+	httpdEndHeaders(connData);
+	httpdSend(connData, buff, len);
+	return HTTPD_CGI_DONE;
+}
+
+static const CgiCacheRoute counterCache={cgiCounter, NULL, 1000, "text/plain"};
+
+//Answers after the ms arg of simulated time, like a cgi that waits for slow hardware to answer
+//would. It doesn't hold up the server meanwhile.
+typedef struct {
+	ETSTimer timer;
+	int done;
+	int part;
+} SlowState;
+
+static void slowTimerCb(void *arg) {
+	HttpdConnData *connData=(HttpdConnData*)arg;
+	((SlowState*)connData->cgiData)->done=1;
+	httpdResume(connData);
+}
+
+static int cgiSlow(HttpdConnData *connData) {
+	SlowState *st=(SlowState*)connData->cgiData;
+	char buff[32];
+	int len;
+	if (connData->conn==NULL) {
+		//Connection gone while waiting: the timer mustn't resume it anymore.
+		if (st!=NULL) os_timer_disarm(&st->timer);
+		free(st);
+		return HTTPD_CGI_DONE;
+	}
+	if (st==NULL) {
+		st=calloc(1, sizeof(SlowState));
+		connData->cgiData=st;
+		os_timer_setfn(&st->timer, slowTimerCb, connData);
+		os_timer_arm(&st->timer, httpdGetArgInt(connData, "ms", 100), 0);
+		return HTTPD_CGI_PENDING;
+	}
+	len=os_sprintf(buff, "slept %d ms\n", httpdGetArgInt(connData, "ms", 100));
+	free(st);
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "text/plain");
+	httpdEndHeaders(connData);
+	httpdSend(connData, buff, len);
+	return HTTPD_CGI_DONE;
+}
+
+static const CgiCacheRoute slowCache={cgiSlow, NULL, 1000, "text/plain"};
+
+//Like cgiSlow, but it starts answering right away: it sends a part of 1500 bytes of its answer
+//and waits ms before the next one, parts times. The headers don't say how long the answer is.
+static int cgiSlowParts(HttpdConnData *connData) {
+	SlowState *st=(SlowState*)connData->cgiData;
+	char buff[1500];
+	if (connData->conn==NULL) {
+		if (st!=NULL) os_timer_disarm(&st->timer);
+		free(st);
+		return HTTPD_CGI_DONE;
+	}
+	if (st==NULL) {
+		st=calloc(1, sizeof(SlowState));
+		connData->cgiData=st;
+		os_timer_setfn(&st->timer, slowTimerCb, connData);
+		httpdStartResponse(connData, 200);
+		httpdHeader(connData, "Content-Type", "text/plain");
+		httpdEndHeaders(connData);
+	}
+	memset(buff, 'a'+st->part, sizeof(buff));
+	if (!httpdSend(connData, buff, sizeof(buff))) {
+		printf("cgiSlowParts: no room for part %d\n", st->part);
+		exit(1);
+	}
+	if (++st->part<httpdGetArgInt(connData, "parts", 2)) {
+		os_timer_arm(&st->timer, httpdGetArgInt(connData, "ms", 100), 0);
+		return HTTPD_CGI_PENDING;
+	}
+	free(st);
+	return HTTPD_CGI_DONE;
+}
+
+static int cgiInvalidate(HttpdConnData *connData) {
+	if (connData->conn==NULL) return HTTPD_CGI_DONE;
+	cgiCacheInvalidate("/cached.cgi");
+	httpdSend(connData, "ok", -1);
+	return HTTPD_CGI_DONE;
+}
+
+//Uploads of an espfs image go to the second MB of the flash
+static const CgiUploadFlashDef uploadDef={CGIFLASH_TYPE_ESPFS, 0x100000, 0x100000, 0x100000};
+
+//Tells how many flash writes of how many bytes were done since the last time it was asked, or
+//since the start of the replay, so a trace can see how an upload went to flash.
+static long flashWritesSeen, flashWrittenSeen;
+
+static int cgiFlashWrites(HttpdConnData *connData) {
+	char buff[64];
+	int len;
+	if (connData->conn==NULL) return HTTPD_CGI_DONE;
+	len=os_sprintf(buff, "writes=%ld bytes=%ld\n", simStats.flashWrites-flashWritesSeen,
+			simStats.flashWritten-flashWrittenSeen);
+	flashWritesSeen=simStats.flashWrites;
+	flashWrittenSeen=simStats.flashWritten;
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "text/plain");
+	httpdEndHeaders(connData);
+	httpdSend(connData, buff, len);
+	return HTTPD_CGI_DONE;
+}
+
+//Token callback for html/template.tpl. The fill token sends more than half a send buffer, so
+//the text after it doesn't fit anymore and has to wait for the next call.
+static void tplTest(HttpdConnData *connData, char *token, void **arg) {
+	char buff[1500];
+	if (token==NULL) return;
+	if (os_strcmp(token, "fill")==0) {
+		memset(buff, '-', sizeof(buff));
+		httpdSend(connData, buff, sizeof(buff));
+	} else {
+		httpdSend(connData, token, -1);
+	}
+}
+
+static HttpdBuiltInUrl builtInUrls[]={
+	{"/", cgiRewrite, "/index.html"},
+	{"/redirect", cgiRedirect, "/index.html"},
+	{"/echo.cgi", cgiEcho, NULL},
+	{"/stream.cgi", cgiStream, NULL},
+	{"/post.cgi", cgiPost, NULL, HTTPD_METHOD_POST},
+	{"/chunks.cgi", cgiPostChunks, NULL, HTTPD_METHOD_POST},
+	{"/events", cgiEventStream, esConnect, HTTPD_METHOD_GET},
+	{"/notify.cgi", cgiNotify, NULL},
+	{"/cached.cgi", cgiCache, &counterCache},
+	{"/invalidate.cgi", cgiInvalidate, NULL},
+	{"/slow.cgi", cgiSlow, NULL},
+	{"/slowcached.cgi", cgiCache, &slowCache},
+	{"/slowparts.cgi", cgiSlowParts, NULL},
+	{"/template.tpl", cgiEspFsTemplate, tplTest},
+	{"/stats", cgiHttpdStats, NULL},
+	{"/upload.cgi", cgiUploadFirmware, &uploadDef, HTTPD_METHOD_POST},
+	{"/flashwrites.cgi", cgiFlashWrites, NULL},
+#ifdef HTTPD_WEBSOCKETS
+	{"/websocket/echo.cgi", cgiWebsocket, wsEchoConnect},
+#endif
+	{"*", cgiEspFsHook, NULL},
+	{NULL, NULL, NULL}
+};
+
+//*** Trace replay ***
+
+//Decode the C-style escapes in line. Returns the length of the result.
+static int unescape(char *line) {
+	char *in=line, *out=line;
+	char hex[3]={0, 0, 0};
+	while (*in!=0) {
+		if (*in!='\\' || in[1]==0) {
+			*out++=*in++;
+			continue;
+		}
+		in++;
+		switch (*in) {
+		case 'r': *out++='\r'; break;
+		case 'n': *out++='\n'; break;
+		case 't': *out++='\t'; break;
+		case '0': *out++=0; break;
+		case 'x':
+			if (in[1]!=0 && in[2]!=0) {
+				hex[0]=in[1];
+				hex[1]=in[2];
+				*out++=(char)strtol(hex, NULL, 16);
+				in+=2;
+			}
+			break;
+		default: *out++=*in; break;
+		}
+		in++;
+	}
+	return out-line;
+}
+
+//Show what the server sent on a connection, in a readable way, if asked to. Forget about it
+//in any case, so long runs don't eat all memory.
+static void dumpOutput(SimConn *c) {
+	int i;
+	if (!verbose || c->outLen==0) {
+		c->outLen=0;
+		return;
+	}
+	printf("--- conn %d: %d bytes\n", c->tcp.remote_port, c->outLen);
+	for (i=0; i<c->outLen; i++) {
+		unsigned char ch=c->out[i];
+		if (ch=='\n' || ch=='\t' || (ch>=32 && ch!=127)) {
+			putchar(ch);
+		} else if (ch!='\r') {
+			printf("\\x%02x", ch);
+		}
+	}
+	if (c->out[c->outLen-1]!='\n') putchar('\n');
+	c->outLen=0;
+}
+
+//Send data from the client in segments of at most segSize bytes.
+static void sendSegmented(SimConn *c, const char *data, int len) {
+	int pos, l;
+	for (pos=0; pos<len; pos+=l) {
+		l=len-pos;
+		if (l>segSize) l=segSize;
+		simRecv(c, data+pos, l);
+	}
+}
+
+//*** Checking responses ***
+
+//A response of the server, taken apart
+typedef struct Response Response;
+struct Response {
+	int status; //status code, or -1 if it isn't HTTP at all
+	char *head; //status line and headers
+	char *body; //body, with the chunked framing taken off
+	int bodyLen;
+	int closed; //the server closed the connection right after it
+	int cut; //the server closed the connection before the body was as long as it said
+	Response *next;
+};
+
+//An expect line of a trace, waiting for its response
+typedef struct Expect Expect;
+struct Expect {
+	char *text;
+	const char *file;
+	int line;
+	int failed;
+	Expect *next;
+};
+
+//Connections the trace has open, and the one data goes to
+#define MAX_TRACE_CONNS 16
+typedef struct {
+	char name[16];
+	SimConn *c;
+	char *in; //what the server sent that isn't taken apart into responses yet
+	int inLen, inSize;
+	char heads[32]; //for the requests that have no response yet: 1 if it's a HEAD
+	int headCnt;
+	int upgraded; //the connection switched protocols; what comes now is raw data
+	int clientClosed;
+	Response *resp, *respLast; //responses no expect line has been matched to yet
+	Expect *exp, *expLast;
+} TraceConn;
+static TraceConn conns[MAX_TRACE_CONNS];
+static int connCnt;
+static SimConn *cur;
+
+//Expectations are skipped when allocations are made to fail, as that changes the responses.
+static int checking=1;
+static long expChecked, expFailed;
+
+static TraceConn *traceConn(SimConn *c) {
+	int i;
+	for (i=0; i<connCnt; i++) {
+		if (conns[i].c==c) return &conns[i];
+	}
+	return NULL;
+}
+
+//Remember if a data line is the start of a HEAD request: its response has no body.
+static void noteRequest(TraceConn *t, const char *line) {
+	int i=0;
+	while (line[i]>='A' && line[i]<='Z') i++;
+	if (i==0 || line[i]!=' ' || (line[i+1]!='/' && line[i+1]!='*')) return;
+	if (t->headCnt<sizeof(t->heads)) t->heads[t->headCnt++]=(strncmp(line, "HEAD ", 5)==0);
+}
+
+//Find a header in the head of a response. Returns its value, or NULL; *len is its length.
+static const char *respHeader(Response *r, const char *name, int *len) {
+	const char *p=strstr(r->head, "\r\n");
+	int n=strlen(name);
+	while (p!=NULL && p[2]!='\r' && p[2]!=0) {
+		p+=2;
+		if (strncasecmp(p, name, n)==0 && p[n]==':') {
+			const char *v=p+n+1, *e;
+			while (*v==' ') v++;
+			e=strstr(v, "\r\n");
+			*len=(e!=NULL)?e-v:(int)strlen(v);
+			return v;
+		}
+		p=strstr(p, "\r\n");
+	}
+	return NULL;
+}
+
+//Take the chunked framing off a body. Returns the amount of bytes the framed body takes, or
+//-1 if it isn't all there yet. If partial is set, a body that isn't all there is taken as far
+//as it goes, e.g. for an event stream that's cut off.
+static int dechunk(const char *p, int len, char **body, int *bodyLen, int partial) {
+	int pos=0, n, blen=0, done=0;
+	char *b=malloc(1);
+	const char *eol;
+	while (pos<len) {
+		for (eol=p+pos; eol<p+len-1 && (eol[0]!='\r' || eol[1]!='\n'); eol++) ;
+		if (eol>=p+len-1) break;
+		n=strtol(p+pos, NULL, 16);
+		if (n==0) {
+			//Last chunk, and the empty line after it
+			if (len-(eol-p+2)>=2) {
+				pos=eol-p+4;
+				done=1;
+			}
+			break;
+		}
+		if (len-(eol-p+2)<n+2 && !partial) break;
+		pos=eol-p+2;
+		if (n>len-pos) n=len-pos;
+		b=realloc(b, blen+n+1);
+		memcpy(b+blen, p+pos, n);
+		blen+=n;
+		pos+=n+2;
+	}
+	if (!done && !partial) {
+		free(b);
+		return -1;
+	}
+	b[blen]=0;
+	*body=b;
+	*bodyLen=blen;
+	return done?pos:len;
+}
+
+//Take what the server sent on a connection apart into responses. A response counts once it's
+//complete and the server is done with the sends, so it's known whether the server closed the
+//connection after it. When final is set, the client is about to close the connection, so
+//whatever there is counts.
+static void parseResponses(TraceConn *t, int final) {
+	Response *r;
+	const char *v;
+	char *end;
+	int hdrLen, len, isHead, noBody, total, srvClosed=t->c->closed && !t->clientClosed;
+	while (t->inLen>0) {
+		r=calloc(1, sizeof(Response));
+		end=memmem(t->in, t->inLen, "\r\n\r\n", 4);
+		if (t->upgraded || strncmp(t->in, "HTTP/", (t->inLen<5)?t->inLen:5)!=0) {
+			//Not HTTP, or not anymore. Take it all as the body of one raw response.
+			r->status=-1;
+			r->head=strdup("");
+			total=t->inLen;
+			r->bodyLen=total;
+			r->body=malloc(total+1);
+			memcpy(r->body, t->in, total);
+			r->body[total]=0;
+		} else {
+			if (end==NULL) {
+				free(r);
+				break;
+			}
+			hdrLen=end-t->in+4;
+			r->head=malloc(hdrLen+1);
+			memcpy(r->head, t->in, hdrLen);
+			r->head[hdrLen]=0;
+			r->status=atoi(r->head+8);
+			isHead=(t->headCnt>0 && t->heads[0]);
+			noBody=isHead || r->status<200 || r->status==204 || r->status==304;
+			v=respHeader(r, "Transfer-Encoding", &len);
+			if (noBody) {
+				r->body=strdup("");
+				total=hdrLen;
+			} else if (v!=NULL && strncasecmp(v, "chunked", 7)==0) {
+				total=dechunk(t->in+hdrLen, t->inLen-hdrLen, &r->body, &r->bodyLen, final);
+				if (total>=0) total+=hdrLen;
+			} else if ((v=respHeader(r, "Content-Length", &len))!=NULL) {
+				r->bodyLen=atoi(v);
+				total=(t->inLen>=hdrLen+r->bodyLen)?hdrLen+r->bodyLen:-1;
+				if (total<0 && srvClosed) {
+					//The rest isn't coming anymore.
+					r->bodyLen=t->inLen-hdrLen;
+					r->cut=1;
+					total=t->inLen;
+				}
+			} else {
+				//Body ends where the connection does.
+				r->bodyLen=t->inLen-hdrLen;
+				total=(srvClosed || final)?t->inLen:-1;
+			}
+			if (total>=0 && r->body==NULL) {
+				r->body=malloc(r->bodyLen+1);
+				memcpy(r->body, t->in+hdrLen, r->bodyLen);
+				r->body[r->bodyLen]=0;
+			}
+			if (total<0 || (total==t->inLen && t->c->sendPending && !final)) {
+				free(r->head);
+				free(r->body);
+				free(r);
+				break;
+			}
+		}
+		r->closed=(total==t->inLen && srvClosed);
+		if (t->headCnt>0) memmove(t->heads, t->heads+1, --t->headCnt);
+		if (r->status==101) t->upgraded=1;
+		memmove(t->in, t->in+total, t->inLen-total);
+		t->inLen-=total;
+		if (t->resp==NULL) t->resp=r; else t->respLast->next=r;
+		t->respLast=r;
+	}
+}
+
+//Report a mismatch. An expect line with more than one counts as one failure.
+static void expectFailed(Expect *e, const char *what, const char *got) {
+	static int shown;
+	if (!e->failed) expFailed++;
+	e->failed=1;
+	if (shown++<20) printf("%s:%d: expected %s, got %s\n", e->file, e->line, what, got);
+	if (shown==20) printf("(not showing more mismatches)\n");
+}
+
+//Check a response against an expect line.
+static void checkResponse(Expect *e, Response *r) {
+	char text[4096], got[256], *item, *next, *hv;
+	const char *v;
+	int len, cut=0;
+	expChecked++;
+	snprintf(text, sizeof(text), "%s", e->text);
+	for (item=text; item!=NULL; item=next) {
+		next=strstr(item, " | ");
+		if (next!=NULL) {
+			*next=0;
+			next+=3;
+		}
+		if (item==text) {
+			snprintf(got, sizeof(got), (r->status<0)?"something that isn't HTTP":"status %d", r->status);
+			if (strcmp(item, "closed")==0) expectFailed(e, "the connection closed", got);
+			else if (strcmp(item, "raw")==0) {
+				if (r->status>=0) expectFailed(e, "something that isn't HTTP", got);
+			} else if (atoi(item)!=r->status) expectFailed(e, item, got);
+		} else if (strcmp(item, "close")==0) {
+			if (!r->closed) expectFailed(e, "the connection closed after it", "the connection kept open");
+		} else if (strcmp(item, "cut")==0) {
+			cut=1;
+			if (!r->cut) expectFailed(e, "a body that's cut off", "a complete body");
+		} else if (strcmp(item, "keep-alive")==0) {
+			if (r->closed) expectFailed(e, "the connection kept open", "the connection closed after it");
+		} else if (strncmp(item, "length ", 7)==0) {
+			snprintf(got, sizeof(got), "a body of %d bytes", r->bodyLen);
+			if (atoi(item+7)!=r->bodyLen) expectFailed(e, item, got);
+		} else if (strncmp(item, "body ", 5)==0 || strncmp(item, "contains ", 9)==0) {
+			int contains=(item[0]=='c');
+			char want[4096];
+			snprintf(want, sizeof(want), "%s", item+(contains?9:5));
+			len=unescape(want);
+			snprintf(got, sizeof(got), "a body of %d bytes: %.60s", r->bodyLen, r->body);
+			if (contains?(memmem(r->body, r->bodyLen, want, len)==NULL):(len!=r->bodyLen || memcmp(want, r->body, len)!=0)) {
+				expectFailed(e, item, got);
+			}
+		} else if (item[0]=='!') {
+			v=respHeader(r, item+1, &len);
+			if (v!=NULL) {
+				snprintf(got, sizeof(got), "%.64s: %.*s", item+1, (len<160)?len:160, v);
+				expectFailed(e, item, got);
+			}
+		} else if ((hv=strstr(item, ": "))!=NULL) {
+			*hv=0;
+			v=respHeader(r, item, &len);
+			if (v==NULL) snprintf(got, sizeof(got), "no %.64s header", item);
+			else snprintf(got, sizeof(got), "%.64s: %.*s", item, (len<160)?len:160, v);
+			*hv=':';
+			if (v==NULL || (strcmp(hv+2, "*")!=0 && (len!=strlen(hv+2) || strncmp(v, hv+2, len)!=0))) {
+				expectFailed(e, item, got);
+			}
+		} else {
+			expectFailed(e, item, "an expect item that doesn't exist");
+		}
+	}
+	if (r->cut && !cut) {
+		snprintf(got, sizeof(got), "a body cut off after %d bytes", r->bodyLen);
+		expectFailed(e, "a complete body", got);
+	}
+}
+
+//Match the expect lines of a connection to its responses, in order. When final is set the
+//client is about to close the connection: expectations without a response fail.
+static void matchExpect(TraceConn *t, int final) {
+	Expect *e;
+	Response *r;
+	while ((e=t->exp)!=NULL) {
+		if ((r=t->resp)!=NULL) {
+			checkResponse(e, r);
+			t->resp=r->next;
+			free(r->head);
+			free(r->body);
+			free(r);
+		} else if (strcmp(e->text, "closed")==0 && t->c->closed && !t->clientClosed && t->inLen==0) {
+			//The server hung up without answering, like it was expected to.
+			expChecked++;
+		} else if (final) {
+			expChecked++;
+			if (strcmp(e->text, "closed")==0) expectFailed(e, "the connection closed", "the connection kept open");
+			else expectFailed(e, e->text, (t->inLen>0)?"an incomplete response":"no response");
+		} else {
+			break;
+		}
+		t->exp=e->next;
+		free(e->text);
+		free(e);
+	}
+}
+
+//Take in what the server sent on a connection.
+static void collectOutput(TraceConn *t) {
+	SimConn *c=t->c;
+	if (checking && c->outLen>0) {
+		if (t->inLen+c->outLen>t->inSize) {
+			t->inSize=(t->inLen+c->outLen)*2;
+			t->in=realloc(t->in, t->inSize);
+		}
+		memcpy(t->in+t->inLen, c->out, c->outLen);
+		t->inLen+=c->outLen;
+	}
+	dumpOutput(c);
+	if (checking) {
+		parseResponses(t, 0);
+		matchExpect(t, 0);
+	}
+}
+
+static void freeTraceConn(TraceConn *t) {
+	Response *r;
+	Expect *e;
+	while ((r=t->resp)!=NULL) {
+		t->resp=r->next;
+		free(r->head);
+		free(r->body);
+		free(r);
+	}
+	while ((e=t->exp)!=NULL) {
+		t->exp=e->next;
+		free(e->text);
+		free(e);
+	}
+	free(t->in);
+}
+
+//Data for a pipelined batch of requests on cur
+static char *batch;
+static int batchLen, batchSize;
+
+//Show what the server sent on all connections since the last time.
+static void dumpAll(void) {
+	int i;
+	for (i=0; i<connCnt; i++) collectOutput(&conns[i]);
+}
+
+static void flushBatch(void) {
+	if (cur==NULL || batchLen==0) return;
+	sendSegmented(cur, batch, batchLen);
+	batchLen=0;
+	simPump();
+	dumpAll();
+}
+
+static void closeConn(SimConn *c);
+
+static void openConn(const char *name) {
+	int i;
+	flushBatch();
+	//Forget about connections the server closed.
+	for (i=connCnt-1; i>=0; i--) {
+		if (conns[i].c->closed) closeConn(conns[i].c);
+	}
+	if (connCnt==MAX_TRACE_CONNS) {
+		printf("Too many connections open in trace\n");
+		exit(1);
+	}
+	cur=simConnect();
+	memset(&conns[connCnt], 0, sizeof(TraceConn));
+	snprintf(conns[connCnt].name, sizeof(conns[connCnt].name), "%s", name);
+	conns[connCnt++].c=cur;
+	simPump();
+	dumpAll();
+}
+
+static void closeConn(SimConn *c) {
+	TraceConn *t;
+	int i;
+	if (c==cur) flushBatch();
+	t=traceConn(c);
+	//Everything the expect lines are about is in by now.
+	if (checking) {
+		collectOutput(t);
+		parseResponses(t, 1);
+		matchExpect(t, 1);
+	}
+	t->clientClosed=1;
+	simClose(c);
+	simPump();
+	dumpAll();
+	for (i=0; i<connCnt && conns[i].c!=c; i++) ;
+	freeTraceConn(&conns[i]);
+	conns[i]=conns[--connCnt];
+	if (c==cur) cur=NULL;
+	simFree(c);
+}
+
+//Make the connection with the name the current one.
+static int useConn(const char *name) {
+	int i;
+	for (i=0; i<connCnt; i++) {
+		if (strcmp(conns[i].name, name)==0) {
+			flushBatch();
+			cur=conns[i].c;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//Queue an expect line for the current connection. It's checked against the first response
+//on it no expect line has been matched to yet, as soon as that's there.
+static void addExpect(const char *text, const char *file, int line) {
+	TraceConn *t=traceConn(cur);
+	Expect *e;
+	if (!checking) return;
+	e=calloc(1, sizeof(Expect));
+	e->text=strdup(text);
+	e->file=file;
+	e->line=line;
+	if (t->exp==NULL) t->exp=e; else t->expLast->next=e;
+	t->expLast=e;
+	matchExpect(t, 0);
+}
+
+//Replay a trace file once. Returns the amount of requests in it, or -1 on error.
+static int replay(const char *file) {
+	FILE *f=fopen(file, "r");
+	char line[4096];
+	int len, reqs=0, lineNo=0;
+	if (f==NULL) {
+		perror(file);
+		return -1;
+	}
+	counterCalls=0;
+	cgiCacheInvalidate(NULL);
+	flashWritesSeen=simStats.flashWrites;
+	flashWrittenSeen=simStats.flashWritten;
+	while (fgets(line, sizeof(line), f)!=NULL) {
+		lineNo++;
+		len=strlen(line);
+		while (len>0 && (line[len-1]=='\n' || line[len-1]=='\r')) line[--len]=0;
+		if (len==0 || line[0]=='#') continue;
+		if (strcmp(line, "conn")==0 || strncmp(line, "conn ", 5)==0) {
+			openConn(line[4]?line+5:"");
+		} else if (strncmp(line, "use ", 4)==0) {
+			if (!useConn(line+4)) {
+				printf("%s:%d: no connection named %s\n", file, lineNo, line+4);
+				return -1;
+			}
+		} else if (strcmp(line, "close")==0) {
+			if (cur!=NULL) closeConn(cur);
+		} else if (strcmp(line, "abort")==0) {
+			if (cur!=NULL) {
+				flushBatch();
+				simAbort(cur);
+				closeConn(cur);
+			}
+		} else if (strncmp(line, "expect ", 7)==0) {
+			if (cur==NULL) {
+				printf("%s:%d: expect without a connection\n", file, lineNo);
+				return -1;
+			}
+			addExpect(line+7, file, lineNo);
+		} else if (strncmp(line, "corrupt ", 8)==0) {
+			flushBatch();
+			if (!simCorruptFile(line+8)) {
+				printf("%s:%d: no compressed file %s in the image\n", file, lineNo, line+8);
+				return -1;
+			}
+		} else if (strncmp(line, "rate ", 5)==0) {
+			flushBatch();
+			simSetLinkRate(atoi(line+5));
+		} else if (strncmp(line, "sleep ", 6)==0) {
+			flushBatch();
+			simSleep(atoi(line+6));
+			dumpAll();
+		} else {
+			len=unescape(line);
+			//Data after the server closed the connection goes over a new one, like a browser would.
+			if (cur!=NULL && cur->closed) closeConn(cur);
+			if (cur==NULL) openConn("");
+			noteRequest(traceConn(cur), line);
+			reqs++;
+			if (pipelined) {
+				if (batchLen+len>batchSize) {
+					batchSize=(batchLen+len)*2;
+					batch=realloc(batch, batchSize);
+				}
+				memcpy(batch+batchLen, line, len);
+				batchLen+=len;
+			} else {
+				sendSegmented(cur, line, len);
+				simPump();
+				dumpAll();
+			}
+		}
+	}
+	flushBatch();
+	simDrain();
+	simSetLinkRate(0);
+	while (connCnt>0) closeConn(conns[connCnt-1].c);
+	simRepairImage();
+	fclose(f);
+	return reqs;
+}
+
+static double wallTime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [options] trace...\n", name);
+	printf("Replays request traces against libesphttpd on a simulated ESP8266 network stack.\n");
+	printf("  -i image   espfs image to serve files from\n");
+	printf("  -s bytes   max size of a TCP segment from the client (default %d)\n", segSize);
+	printf("  -p         pipeline all requests on a connection; expect lines aren't checked\n");
+	printf("             then\n");
+	printf("  -n count   replay the traces this many times (default 1)\n");
+	printf("  -m bytes   make allocations fail above this amount of heap in use; expect lines\n");
+	printf("             aren't checked then\n");
+	printf("  -v         show everything the server sends\n");
+	printf("Set HOSTTEST_DEBUG in the environment to see the debug output of the webserver.\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int opt, i, n, iterations=1;
+	long reqs=0;
+	double t;
+	char *image=NULL;
+	SimCbStats *s;
+
+	simInit();
+	while ((opt=getopt(argc, argv, "i:s:pn:m:v"))!=-1) {
+		switch (opt) {
+		case 'i': image=optarg; break;
+		case 's': segSize=atoi(optarg); break;
+		case 'p': pipelined=1; break;
+		case 'n': iterations=atoi(optarg); break;
+		case 'm': simStats.heapLimit=atol(optarg); break;
+		case 'v': verbose=1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind>=argc || segSize<1 || iterations<1) usage(argv[0]);
+	checking=(simStats.heapLimit==0 && !pipelined);
+
+	if (image!=NULL) {
+		if (!simMapImage(image)) {
+			perror(image);
+			exit(1);
+		}
+		if (espFsInit((void*)(SIM_FLASH_BASE+SIM_ESPFS_OFFSET))!=ESPFS_INIT_RESULT_OK) {
+			printf("%s: not a valid espfs image\n", image);
+			exit(1);
+		}
+	}
+	httpdInit(builtInUrls, 80);
+
+	t=wallTime();
+	for (n=0; n<iterations; n++) {
+		for (i=optind; i<argc; i++) {
+			int r=replay(argv[i]);
+			if (r<0) exit(1);
+			reqs+=r;
+		}
+	}
+	t=wallTime()-t;
+
+	printf("Requests:     %ld in %.3f s, %.0f req/s (segment size %d%s)\n", reqs, t, reqs/t, segSize, pipelined?", pipelined":"");
+	printf("Traffic:      %ld bytes in, %ld bytes out in %ld sends\n", simStats.bytesIn, simStats.bytesOut, simStats.sends);
+	printf("Connections:  %ld accepted, %ld refused by the stack\n", simStats.conns, simStats.connRefused);
+	printf("Peak stack:   %d bytes\n", simStackPeak());
+	printf("Peak heap:    %ld bytes, %ld allocations, %ld failed; %ld bytes still in use\n",
+			simStats.heapPeak, simStats.heapAllocs, simStats.heapFails, simStats.heapCur);
+	if (simStats.sendBusy || simStats.sendClosed || simStats.recvDropped) {
+		printf("Problems:     %ld sends while busy, %ld sends after close, %ld bytes received after close\n",
+				simStats.sendBusy, simStats.sendClosed, simStats.recvDropped);
+	}
+	if (expChecked>0) printf("Expectations: %ld checked, %ld failed\n", expChecked, expFailed);
+	printf("\n%-10s %10s %12s %10s %10s\n", "callback", "calls", "total ms", "avg us", "max us");
+	for (i=0; i<SIM_CB_COUNT; i++) {
+		s=&simStats.cb[i];
+		if (s->calls==0) continue;
+		printf("%-10s %10ld %12.3f %10.2f %10.2f\n", simCbNames[i], s->calls, s->totalNs/1e6,
+				s->totalNs/1e3/s->calls, s->maxNs/1e3);
+	}
+	return (expFailed>0)?1:0;
+}
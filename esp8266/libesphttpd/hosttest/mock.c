@@ -0,0 +1,673 @@
+/*
+Simulated ESP8266 SDK for running libesphttpd on a Linux host. Implements the bits of the SDK
+the webserver uses: the libc-ish ets_ functions, a heap that keeps track of how much is used,
+timers running on a simulated clock, flash access and the espconn TCP layer. Connections are
+driven by the test code: it connects, pushes data in and the simulated stack delivers the
+sent/disconnect callbacks when pumped, with the same one-send-in-flight rule the real stack has.
+
+All callbacks into the code under test run on a separate, painted stack so we can tell how
+deep the webserver goes, and are timed using the thread CPU clock.
+*/
+
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <time.h>
+#include <ucontext.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hosttest.h"
+#include "espfsformat.h"
+
+SimStats simStats;
+
+const char *simCbNames[SIM_CB_COUNT]={"connect", "recv", "sent", "discon", "recon", "timer"};
+
+//Byte the callback stack is filled with before use
+#define STACK_PAINT 0xa5
+
+static SimConn *simConns;
+static espconn_connect_callback listenConnectCb;
+static int simNextPort=1024;
+static int simMaxConn; //as set by espconn_tcp_set_max_con_allow; 0 is no limit
+static uint32 simTimeUs;
+static ETSTimer *timerList;
+//Speed of the radio in bytes per ms; 0 sends everything right away. The radio is shared by all
+//connections, and data goes out in the order it's handed to espconn.
+static int simLinkRate;
+static uint32 radioFree; //simulated time the radio is done with everything it has been given
+
+static char cbStack[SIM_STACK_SIZE] __attribute__((aligned(16)));
+static ucontext_t mainCtx, cbCtx;
+
+//Callback that's about to be ran on the callback stack, and its args
+static struct {
+	int type;
+	void *fn;
+	void *arg;
+	char *data;
+	int len;
+} cbCall;
+
+static void cbTrampoline(void) {
+	switch (cbCall.type) {
+	case SIM_CB_RECV:
+		((espconn_recv_callback)cbCall.fn)(cbCall.arg, cbCall.data, cbCall.len);
+		break;
+	case SIM_CB_RECON:
+		((espconn_reconnect_callback)cbCall.fn)(cbCall.arg, (sint8)cbCall.len);
+		break;
+	case SIM_CB_TIMER:
+		((ETSTimerFunc*)cbCall.fn)(cbCall.arg);
+		break;
+	default:
+		((espconn_connect_callback)cbCall.fn)(cbCall.arg);
+		break;
+	}
+}
+
+static long long nowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+//Run a callback like the SDK would, on its own stack, and keep the stats for it.
+static void simCall(int type, void *fn, void *arg, char *data, int len) {
+	long long t;
+	if (fn==NULL) return;
+	cbCall.type=type;
+	cbCall.fn=fn;
+	cbCall.arg=arg;
+	cbCall.data=data;
+	cbCall.len=len;
+	getcontext(&cbCtx);
+	cbCtx.uc_stack.ss_sp=cbStack;
+	cbCtx.uc_stack.ss_size=sizeof(cbStack);
+	cbCtx.uc_link=&mainCtx;
+	makecontext(&cbCtx, cbTrampoline, 0);
+	t=nowNs();
+	swapcontext(&mainCtx, &cbCtx);
+	t=nowNs()-t;
+	simStats.cb[type].calls++;
+	simStats.cb[type].totalNs+=t;
+	if (t>simStats.cb[type].maxNs) simStats.cb[type].maxNs=t;
+}
+
+//Returns the max amount of callback stack that has been used so far. The stack grows down,
+//so look for the first byte from the bottom that isn't paint anymore.
+int simStackPeak(void) {
+	int i;
+	for (i=0; i<SIM_STACK_SIZE && (unsigned char)cbStack[i]==STACK_PAINT; i++) ;
+	return SIM_STACK_SIZE-i;
+}
+
+void simInit(void) {
+	memset(cbStack, STACK_PAINT, sizeof(cbStack));
+	memset(&simStats, 0, sizeof(simStats));
+}
+
+//The espfs image as it was mapped, so simRepairImage can undo simCorruptFile
+static char *imageCopy;
+static int imageLen, imageDamaged;
+
+//Map an espfs image so it looks like it's in the memory-mapped flash.
+int simMapImage(const char *file) {
+	struct stat st;
+	void *p;
+	int f=open(file, O_RDONLY);
+	if (f<0) return 0;
+	fstat(f, &st);
+	p=mmap((void*)(SIM_FLASH_BASE+SIM_ESPFS_OFFSET), st.st_size+4, PROT_READ, MAP_PRIVATE|MAP_FIXED_NOREPLACE, f, 0);
+	close(f);
+	if (p!=(void*)(SIM_FLASH_BASE+SIM_ESPFS_OFFSET)) return 0;
+	imageLen=st.st_size+4;
+	imageCopy=malloc(imageLen);
+	memcpy(imageCopy, p, imageLen);
+	return 1;
+}
+
+//Damage a compressed file in the image, so unpacking it goes wrong partway like it would with
+//a broken flash: the first deflate block of a gzipped file gets a type that doesn't exist, and
+//the second half of a heatshrink one is wiped, which unpacks to less than it should. Returns 0
+//if there's no such file.
+int simCorruptFile(const char *name) {
+	char *image=(char*)(SIM_FLASH_BASE+SIM_ESPFS_OFFSET), *p=image, *data;
+	EspFsHeader *h;
+	int r=1;
+	if (imageCopy==NULL) return 0;
+	while (name[0]=='/') name++;
+	while (1) {
+		h=(EspFsHeader*)p;
+		if (p+sizeof(EspFsHeader)>image+imageLen || h->magic!=ESPFS_MAGIC || (h->flags&FLAG_LASTFILE)) return 0;
+		if (strcmp(p+sizeof(EspFsHeader), name)==0) break;
+		p+=sizeof(EspFsHeader)+h->nameLen+((h->hdrLen+3)&~3)+h->fileLenComp;
+		p+=(-(uintptr_t)p)&3;
+	}
+	data=p+sizeof(EspFsHeader)+h->nameLen+((h->hdrLen+3)&~3);
+	mprotect(image, imageLen, PROT_READ|PROT_WRITE);
+	if (h->flags&FLAG_GZIP) {
+		//After the 10 bytes of gzip header: not the last block, type 3
+		data[10]=0x06;
+	} else if (h->compression==COMPRESS_HEATSHRINK) {
+		memset(data+h->fileLenComp/2, 0, h->fileLenComp-h->fileLenComp/2);
+	} else {
+		r=0;
+	}
+	mprotect(image, imageLen, PROT_READ);
+	imageDamaged|=r;
+	return r;
+}
+
+//Undo what simCorruptFile did to the image.
+void simRepairImage(void) {
+	char *image=(char*)(SIM_FLASH_BASE+SIM_ESPFS_OFFSET);
+	if (!imageDamaged) return;
+	mprotect(image, imageLen, PROT_READ|PROT_WRITE);
+	memcpy(image, imageCopy, imageLen);
+	mprotect(image, imageLen, PROT_READ);
+	imageDamaged=0;
+}
+
+//*** libc and ROM functions ***
+
+int ets_memcmp(const void *s1, const void *s2, size_t n) {
+	return memcmp(s1, s2, n);
+}
+
+void *ets_memcpy(void *dest, const void *src, size_t n) {
+	return memcpy(dest, src, n);
+}
+
+void *ets_memmove(void *dest, const void *src, size_t n) {
+	return memmove(dest, src, n);
+}
+
+void *ets_memset(void *s, int c, size_t n) {
+	return memset(s, c, n);
+}
+
+void ets_bzero(void *s, size_t n) {
+	memset(s, 0, n);
+}
+
+int ets_strcmp(const char *s1, const char *s2) {
+	return strcmp(s1, s2);
+}
+
+char *ets_strcpy(char *dest, const char *src) {
+	return strcpy(dest, src);
+}
+
+size_t ets_strlen(const char *s) {
+	return strlen(s);
+}
+
+int ets_strncmp(const char *s1, const char *s2, int len) {
+	return strncmp(s1, s2, len);
+}
+
+char *ets_strncpy(char *dest, const char *src, size_t n) {
+	return strncpy(dest, src, n);
+}
+
+char *ets_strstr(const char *haystack, const char *needle) {
+	return strstr(haystack, needle);
+}
+
+int ets_sprintf(char *str, const char *format, ...) {
+	va_list ap;
+	int r;
+	va_start(ap, format);
+	r=vsprintf(str, format, ap);
+	va_end(ap);
+	return r;
+}
+
+int os_snprintf(char *str, size_t size, const char *format, ...) {
+	va_list ap;
+	int r;
+	va_start(ap, format);
+	r=vsnprintf(str, size, format, ap);
+	va_end(ap);
+	return r;
+}
+
+//Debug output of the code under test. Goes nowhere unless HOSTTEST_DEBUG is set: printing
+//it would make the timings meaningless.
+int os_printf(const char *format, ...) {
+	va_list ap;
+	int r;
+	if (getenv("HOSTTEST_DEBUG")==NULL) return 0;
+	va_start(ap, format);
+	r=vfprintf(stderr, format, ap);
+	va_end(ap);
+	return r;
+}
+
+int os_printf_plus(const char *format, ...) {
+	return 0;
+}
+
+void ets_delay_us(int us) {
+	simTimeUs+=us;
+}
+
+//*** Heap ***
+
+//Every block gets a header with its size in front of it, so we know how much is freed.
+typedef struct {
+	size_t size;
+	size_t pad;
+} HeapHdr;
+
+void *pvPortMalloc(size_t size) {
+	HeapHdr *h;
+	if (simStats.heapLimit!=0 && simStats.heapCur+size>simStats.heapLimit) {
+		simStats.heapFails++;
+		return NULL;
+	}
+	h=malloc(sizeof(HeapHdr)+size);
+	if (h==NULL) return NULL;
+	h->size=size;
+	simStats.heapCur+=size;
+	simStats.heapAllocs++;
+	if (simStats.heapCur>simStats.heapPeak) simStats.heapPeak=simStats.heapCur;
+	//Don't let code get away with assuming memory is zeroed.
+	memset(h+1, 0xcd, size);
+	return h+1;
+}
+
+void *pvPortZalloc(size_t size) {
+	void *p=pvPortMalloc(size);
+	if (p!=NULL) memset(p, 0, size);
+	return p;
+}
+
+void vPortFree(void *ptr) {
+	HeapHdr *h;
+	if (ptr==NULL) return;
+	h=((HeapHdr*)ptr)-1;
+	simStats.heapCur-=h->size;
+	memset(ptr, 0xdd, h->size);
+	free(h);
+}
+
+uint32 system_get_free_heap_size(void) {
+	return (simStats.heapLimit?simStats.heapLimit:80*1024)-simStats.heapCur;
+}
+
+//*** System, wifi and flash ***
+
+uint32 system_get_time(void) {
+	return simTimeUs;
+}
+
+void system_restart(void) {
+	fprintf(stderr, "Code under test called system_restart()\n");
+	exit(1);
+}
+
+uint8 wifi_get_opmode(void) {
+	return SOFTAP_MODE;
+}
+
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info) {
+	info->ip.addr=0x0104a8c0; //192.168.4.1
+	info->netmask.addr=0x00ffffff;
+	info->gw.addr=info->ip.addr;
+	return true;
+}
+
+//Flash reads on the ESP need to start at a word boundary. Complain about code that gets that wrong.
+int spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size) {
+	if (src_addr&3) {
+		fprintf(stderr, "spi_flash_read: unaligned read of %d bytes from 0x%x to %p\n", size, src_addr, des_addr);
+		return 1;
+	}
+	memcpy(des_addr, (char*)(uintptr_t)(SIM_FLASH_BASE+src_addr), size);
+	return 0;
+}
+
+//Writes only get counted; what's written isn't kept. Like reads, they have to be word-aligned.
+int spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size) {
+	if ((des_addr&3) || ((uintptr_t)src_addr&3) || (size&3)) {
+		fprintf(stderr, "spi_flash_write: unaligned write of %d bytes from %p to 0x%x\n", size, src_addr, des_addr);
+		return 1;
+	}
+	simStats.flashWrites++;
+	simStats.flashWritten+=size;
+	return 0;
+}
+
+int spi_flash_erase_sector(uint16 sec) {
+	simStats.flashErases++;
+	return 0;
+}
+
+//A 4MB chip
+uint32 spi_flash_get_id(void) {
+	return 0x1640e0;
+}
+
+uint8 system_upgrade_userbin_check(void) {
+	return 0;
+}
+
+void system_upgrade_flag_set(uint8 flag) {
+}
+
+void system_upgrade_reboot(void) {
+	fprintf(stderr, "Code under test called system_upgrade_reboot()\n");
+	exit(1);
+}
+
+//*** Timers ***
+
+static void timerUnlink(ETSTimer *t) {
+	ETSTimer **p;
+	for (p=&timerList; *p!=NULL; p=&(*p)->timer_next) {
+		if (*p==t) {
+			*p=t->timer_next;
+			return;
+		}
+	}
+}
+
+void ets_timer_setfn(ETSTimer *t, ETSTimerFunc *fn, void *parg) {
+	t->timer_func=fn;
+	t->timer_arg=parg;
+}
+
+void ets_timer_arm_new(ETSTimer *t, int time, int repeat, int isMsTimer) {
+	uint32 us=isMsTimer?time*1000:time;
+	timerUnlink(t);
+	t->timer_expire=simTimeUs+us;
+	t->timer_period=repeat?us:0;
+	t->timer_next=timerList;
+	timerList=t;
+}
+
+void ets_timer_disarm(ETSTimer *t) {
+	timerUnlink(t);
+}
+
+//*** Espconn ***
+
+static SimConn *simFind(struct espconn *espconn) {
+	SimConn *c;
+	for (c=simConns; c!=NULL; c=c->next) {
+		if (&c->conn==espconn) return c;
+	}
+	return NULL;
+}
+
+sint8 espconn_regist_connectcb(struct espconn *espconn, espconn_connect_callback connect_cb) {
+	listenConnectCb=connect_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_accept(struct espconn *espconn) {
+	espconn->state=ESPCONN_LISTEN;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_tcp_set_max_con_allow(struct espconn *espconn, uint8 num) {
+	simMaxConn=num;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_set_opt(struct espconn *espconn, uint8 opt) {
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback recv_cb) {
+	SimConn *c=simFind(espconn);
+	if (c==NULL) return ESPCONN_ARG;
+	c->recvCb=recv_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback sent_cb) {
+	SimConn *c=simFind(espconn);
+	if (c==NULL) return ESPCONN_ARG;
+	c->sentCb=sent_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback discon_cb) {
+	SimConn *c=simFind(espconn);
+	if (c==NULL) return ESPCONN_ARG;
+	c->disconCb=discon_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback recon_cb) {
+	SimConn *c=simFind(espconn);
+	if (c==NULL) return ESPCONN_ARG;
+	c->reconCb=recon_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_time(struct espconn *espconn, uint32 interval, uint8 type_flag) {
+	SimConn *c=simFind(espconn);
+	if (c==NULL) return ESPCONN_ARG;
+	c->idleTimeout=interval;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_sent(struct espconn *espconn, uint8 *psent, uint16 length) {
+	SimConn *c=simFind(espconn);
+	if (c==NULL || c->closed || c->closing) {
+		simStats.sendClosed++;
+		return ESPCONN_ARG;
+	}
+	if (c->sendPending) {
+		simStats.sendBusy++;
+		return ESPCONN_MAXNUM;
+	}
+	if (c->outLen+length>c->outSize) {
+		c->outSize=(c->outLen+length)*2;
+		c->out=realloc(c->out, c->outSize);
+	}
+	memcpy(c->out+c->outLen, psent, length);
+	c->outLen+=length;
+	c->sendPending=1;
+	if (simLinkRate!=0) {
+		if ((int32)(radioFree-simTimeUs)<0) radioFree=simTimeUs;
+		radioFree+=length*1000/simLinkRate;
+		c->sentAt=radioFree;
+	}
+	c->lastActive=simTimeUs;
+	simStats.sends++;
+	simStats.bytesOut+=length;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_disconnect(struct espconn *espconn) {
+	SimConn *c=simFind(espconn);
+	if (c==NULL || c->closed) return ESPCONN_ARG;
+	//The stack calls the disconnect callback later, not from in here.
+	c->closing=1;
+	return ESPCONN_OK;
+}
+
+//A client connects. If the stack already has as many connections as it's allowed to, it
+//refuses the new one; the connection is returned closed.
+SimConn *simConnect(void) {
+	SimConn *c=calloc(1, sizeof(SimConn));
+	SimConn *o;
+	int open=0;
+	c->conn.type=ESPCONN_TCP;
+	c->conn.state=ESPCONN_CONNECT;
+	c->conn.proto.tcp=&c->tcp;
+	c->tcp.local_port=80;
+	c->tcp.remote_port=simNextPort++;
+	if (simNextPort>65535) simNextPort=1024;
+	c->tcp.remote_ip[0]=192;
+	c->tcp.remote_ip[1]=168;
+	c->tcp.remote_ip[2]=4;
+	c->tcp.remote_ip[3]=2;
+	c->lastActive=simTimeUs;
+	c->next=simConns;
+	simConns=c;
+	for (o=simConns; o!=NULL; o=o->next) {
+		if (!o->closed) open++;
+	}
+	if (simMaxConn && open>simMaxConn) {
+		c->closed=1;
+		c->conn.state=ESPCONN_CLOSE;
+		simStats.connRefused++;
+		return c;
+	}
+	simStats.conns++;
+	simCall(SIM_CB_CONNECT, listenConnectCb, &c->conn, NULL, 0);
+	return c;
+}
+
+//The client sends a segment of data.
+void simRecv(SimConn *c, const char *data, int len) {
+	char *buf;
+	if (c->closed || c->closing) {
+		simStats.recvDropped+=len;
+		return;
+	}
+	//The stack hands out its own buffer, which is gone after the callback. Make a copy so
+	//code that holds on to it gets caught by the sanitizers.
+	buf=malloc(len);
+	memcpy(buf, data, len);
+	c->lastActive=simTimeUs;
+	simStats.bytesIn+=len;
+	simCall(SIM_CB_RECV, c->recvCb, &c->conn, buf, len);
+	free(buf);
+}
+
+static void simDisconnected(SimConn *c) {
+	c->closed=1;
+	c->conn.state=ESPCONN_CLOSE;
+	simCall(SIM_CB_DISCON, c->disconCb, &c->conn, NULL, 0);
+}
+
+//The client closes the connection.
+void simClose(SimConn *c) {
+	if (c->closed) return;
+	simDisconnected(c);
+}
+
+//The connection breaks, e.g. because the client went away without closing it. The stack tells
+//about that through the reconnect callback instead of the disconnect one.
+void simAbort(SimConn *c) {
+	if (c->closed) return;
+	c->closed=1;
+	c->conn.state=ESPCONN_CLOSE;
+	simCall(SIM_CB_RECON, c->reconCb, &c->conn, NULL, ESPCONN_RST);
+}
+
+//Deliver everything the stack has pending: sent callbacks for data that went out and
+//disconnect callbacks for connections the server closed. Returns when nothing is left.
+int simPump(void) {
+	SimConn *c;
+	int n=0, busy=1;
+	while (busy) {
+		busy=0;
+		for (c=simConns; c!=NULL; c=c->next) {
+			if (c->closed) continue;
+			if (c->closing) {
+				simDisconnected(c);
+				busy=1;
+				n++;
+			} else if (c->sendPending && (simLinkRate==0 || (int32)(c->sentAt-simTimeUs)<=0)) {
+				c->sendPending=0;
+				simCall(SIM_CB_SENT, c->sentCb, &c->conn, NULL, 0);
+				busy=1;
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+//Returns the connection of which the data in flight is through the radio first, or NULL if
+//nothing is in flight.
+static SimConn *simNextSent(void) {
+	SimConn *c, *first=NULL;
+	if (simLinkRate==0) return NULL;
+	for (c=simConns; c!=NULL; c=c->next) {
+		if (c->closed || c->closing || !c->sendPending) continue;
+		if (first==NULL || (int32)(c->sentAt-first->sentAt)<0) first=c;
+	}
+	return first;
+}
+
+//Sets the speed of the radio, in bytes per ms. 0 makes it infinitely fast.
+void simSetLinkRate(int bytesPerMs) {
+	simLinkRate=bytesPerMs;
+	radioFree=simTimeUs;
+}
+
+//Let ms of simulated time pass. Fires timers that expire in that time and closes connections
+//that have been idle for longer than their timeout, like the stack would.
+void simSleep(int ms) {
+	uint32 end=simTimeUs+ms*1000;
+	ETSTimer *t, *first;
+	SimConn *c;
+	while (1) {
+		first=NULL;
+		for (t=timerList; t!=NULL; t=t->timer_next) {
+			if ((int32)(t->timer_expire-end)<=0 && (first==NULL || (int32)(t->timer_expire-first->timer_expire)<0)) first=t;
+		}
+		c=simNextSent();
+		if (c!=NULL && (int32)(c->sentAt-end)<=0 && (first==NULL || (int32)(c->sentAt-first->timer_expire)<0)) {
+			//Data made it through the radio before the next timer fires.
+			simTimeUs=c->sentAt;
+			simPump();
+			continue;
+		}
+		if (first==NULL) break;
+		simTimeUs=first->timer_expire;
+		timerUnlink(first);
+		if (first->timer_period) {
+			first->timer_expire+=first->timer_period;
+			first->timer_next=timerList;
+			timerList=first;
+		}
+		simCall(SIM_CB_TIMER, first->timer_func, first->timer_arg, NULL, 0);
+		simPump();
+	}
+	simTimeUs=end;
+	for (c=simConns; c!=NULL; c=c->next) {
+		if (!c->closed && c->idleTimeout && simTimeUs-c->lastActive>=c->idleTimeout*1000000) {
+			simDisconnected(c);
+		}
+	}
+	simPump();
+}
+
+//Let time pass until the radio has sent everything, so the clients have all the data.
+void simDrain(void) {
+	SimConn *c;
+	while ((c=simNextSent())!=NULL) simSleep((c->sentAt-simTimeUs+999)/1000);
+}
+
+//Forget about a connection that's closed.
+void simFree(SimConn *c) {
+	SimConn **p;
+	for (p=&simConns; *p!=NULL; p=&(*p)->next) {
+		if (*p==c) {
+			*p=c->next;
+			break;
+		}
+	}
+	free(c->out);
+	free(c);
+}
@@ -0,0 +1,37 @@
+//Host stand-ins for the headers of the ESP8266 NonOS SDK. These only declare what libesphttpd
+//uses, with the same names and semantics; the implementations live in ../mock.c.
+#ifndef C_TYPES_H
+#define C_TYPES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint8_t uint8;
+typedef int8_t sint8;
+typedef int8_t int8;
+typedef uint16_t uint16;
+typedef int16_t sint16;
+typedef int16_t int16;
+typedef uint32_t uint32;
+typedef int32_t sint32;
+typedef int32_t int32;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+
+typedef enum {
+	OK=0,
+	FAIL,
+	PENDING,
+	BUSY,
+	CANCEL,
+} STATUS;
+
+#define BIT2 0x00000004
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define LOCAL static
+
+#endif
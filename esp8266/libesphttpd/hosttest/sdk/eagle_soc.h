@@ -0,0 +1 @@
+//Nothing libesphttpd needs in here on the host.
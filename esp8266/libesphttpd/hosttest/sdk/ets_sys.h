@@ -0,0 +1,26 @@
+#ifndef ETS_SYS_H
+#define ETS_SYS_H
+
+#include "c_types.h"
+
+typedef void ETSTimerFunc(void *timer_arg);
+
+typedef struct _ETSTIMER_ {
+	struct _ETSTIMER_ *timer_next;
+	uint32 timer_expire;
+	uint32 timer_period;
+	ETSTimerFunc *timer_func;
+	void *timer_arg;
+} ETSTimer;
+
+typedef uint32 ETSSignal;
+typedef uint32 ETSParam;
+
+typedef struct ETSEventTag {
+	ETSSignal sig;
+	ETSParam par;
+} ETSEvent;
+
+typedef ETSEvent os_event_t;
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef IP_ADDR_H
+#define IP_ADDR_H
+
+#include "c_types.h"
+
+struct ip_addr {
+	uint32 addr;
+};
+
+struct ip_info {
+	struct ip_addr ip;
+	struct ip_addr netmask;
+	struct ip_addr gw;
+};
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef MEM_H
+#define MEM_H
+
+#define os_malloc(s) pvPortMalloc(s)
+#define os_zalloc(s) pvPortZalloc(s)
+#define os_free(s) vPortFree(s)
+
+#endif
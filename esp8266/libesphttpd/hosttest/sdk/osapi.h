@@ -0,0 +1,30 @@
+#ifndef OSAPI_H
+#define OSAPI_H
+
+#include <string.h>
+#include "ets_sys.h"
+
+#define os_bzero ets_bzero
+#define os_delay_us ets_delay_us
+#define os_memcmp ets_memcmp
+#define os_memcpy ets_memcpy
+#define os_memmove ets_memmove
+#define os_memset ets_memset
+#define os_strcat strcat
+#define os_strchr strchr
+#define os_strcmp ets_strcmp
+#define os_strcpy ets_strcpy
+#define os_strlen ets_strlen
+#define os_strncmp ets_strncmp
+#define os_strncpy ets_strncpy
+#define os_strstr ets_strstr
+#define os_sprintf ets_sprintf
+
+#define os_timer_arm(a, b, c) ets_timer_arm_new(a, b, c, 1)
+#define os_timer_disarm ets_timer_disarm
+#define os_timer_setfn ets_timer_setfn
+
+typedef ETSTimer os_timer_t;
+typedef ETSTimerFunc os_timer_func_t;
+
+#endif
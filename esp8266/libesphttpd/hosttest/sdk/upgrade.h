@@ -0,0 +1,10 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#define UPGRADE_FLAG_FINISH 0x02
+
+uint8 system_upgrade_userbin_check(void);
+void system_upgrade_flag_set(uint8 flag);
+void system_upgrade_reboot(void);
+
+#endif
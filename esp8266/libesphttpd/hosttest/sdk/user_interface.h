@@ -0,0 +1,27 @@
+#ifndef USER_INTERFACE_H
+#define USER_INTERFACE_H
+
+#include "c_types.h"
+#include "ip_addr.h"
+
+#define NULL_MODE 0x00
+#define STATION_MODE 0x01
+#define SOFTAP_MODE 0x02
+#define STATIONAP_MODE 0x03
+
+#define STATION_IF 0x00
+#define SOFTAP_IF 0x01
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+uint32 system_get_time(void);
+uint32 system_get_free_heap_size(void);
+void system_restart(void);
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info);
+
+int spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size);
+int spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size);
+int spi_flash_erase_sector(uint16 sec);
+uint32 spi_flash_get_id(void);
+
+#endif
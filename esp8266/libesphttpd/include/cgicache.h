@@ -0,0 +1,35 @@
+#ifndef CGICACHE_H
+#define CGICACHE_H
+
+#include "httpd.h"
+
+//Max amount of responses kept in the cache
+#ifndef CGICACHE_ENTRIES
+#define CGICACHE_ENTRIES 4
+#endif
+
+//Responses with a body larger than this, in bytes, aren't cached
+#ifndef CGICACHE_MAX_BODY
+#define CGICACHE_MAX_BODY 256
+#endif
+
+//Max amount of requests of which the cgi is waiting with HTTPD_CGI_PENDING for something to
+//answer with, that can have their answer cached
+#ifndef CGICACHE_PENDING
+#define CGICACHE_PENDING 4
+#endif
+
+//What to cache for an entry in the url table. Use cgiCache as the cgi of the entry and a
+//pointer to one of these as its cgiArg.
+typedef struct {
+	cgiSendCallback cgi; //the cgi that makes the response
+	const void *cgiArg; //cgiArg for that cgi
+	int ttl; //time an answer stays good, in ms
+	const char *contentType; //sent with cached answers that had headers; NULL is text/plain
+} CgiCacheRoute;
+
+int ICACHE_FLASH_ATTR cgiCache(HttpdConnData *connData);
+void ICACHE_FLASH_ATTR cgiCacheNoStore(HttpdConnData *connData);
+void ICACHE_FLASH_ATTR cgiCacheInvalidate(const char *url);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef CGIEVENTSTREAM_H
+#define CGIEVENTSTREAM_H
+
+#include "httpd.h"
+
+//Max amount of clients on all event streams together. A client holds on to its connection
+//for as long as it has the page open, so keep this well below HTTPD_MAX_CONNECTIONS.
+#ifndef EVENTSTREAM_MAX_CLIENTS
+#define EVENTSTREAM_MAX_CLIENTS 3
+#endif
+
+//Interval of the keep-alive comments sent to idle streams, in ms. Needs to be shorter than
+//the time the stack keeps a connection without traffic open, which is HTTPD_STALL_TIMEOUT
+//(60s by default).
+#ifndef EVENTSTREAM_PING_INTERVAL
+#define EVENTSTREAM_PING_INTERVAL 5000
+#endif
+
+typedef struct EventStream EventStream;
+
+typedef void(*EsConnectedCb)(EventStream *es);
+typedef void(*EsCloseCb)(EventStream *es);
+
+struct EventStream {
+	void *userData;
+	HttpdConnData *conn;
+	EsCloseCb closeCb;
+	char active; //sent something since the last ping
+	EventStream *next; //in linked list
+};
+
+int ICACHE_FLASH_ATTR cgiEventStream(HttpdConnData *connData);
+int ICACHE_FLASH_ATTR cgiEventStreamSend(EventStream *es, const char *event, const char *data);
+int ICACHE_FLASH_ATTR cgiEventStreamBroadcast(const char *resource, const char *event, const char *data);
+int ICACHE_FLASH_ATTR cgiEventStreamClients(const char *resource);
+
+#endif
@@ -16,7 +16,13 @@ typedef struct EspFsFile EspFsFile;
 EspFsInitResult espFsInit(void *flashAddress);
 EspFsFile *espFsOpen(char *fileName);
 int espFsFlags(EspFsFile *fh);
+int espFsSize(EspFsFile *fh);
+uint32_t espFsHash(EspFsFile *fh);
+int espFsHeaders(EspFsFile *fh, char *buff, int len, int *entity);
+int espFsGunzip(EspFsFile *fh);
 int espFsRead(EspFsFile *fh, char *buff, int len);
+const char *espFsMap(EspFsFile *fh, int *len);
+int espFsSkip(EspFsFile *fh, int len);
 void espFsClose(EspFsFile *fh);
 
 
@@ -7,9 +7,13 @@
 #define HTTPD_CGI_DONE 1
 #define HTTPD_CGI_NOTFOUND 2
 #define HTTPD_CGI_AUTHENTICATED 3
+#define HTTPD_CGI_REWRITE 4 //cgi has changed connData->url; route the request again
+#define HTTPD_CGI_PENDING 5 //cgi waits for something; it gets called again after httpdResume
 
-#define HTTPD_METHOD_GET 1
-#define HTTPD_METHOD_POST 2
+//Request methods. These are bits, so they can be or'ed together in HttpdBuiltInUrl.methods.
+#define HTTPD_METHOD_GET (1<<0)
+#define HTTPD_METHOD_POST (1<<1)
+#define HTTPD_METHOD_HEAD (1<<2) //Entries that do GET get these too; the body of the answer is dropped
 
 typedef struct HttpdPriv HttpdPriv;
 typedef struct HttpdConnData HttpdConnData;
@@ -52,21 +56,43 @@ typedef struct {
 	const char *url;
 	cgiSendCallback cgiCb;
 	const void *cgiArg;
+	int methods; //Or'ed HTTPD_METHOD_* this entry handles. Leave 0 to handle all methods.
 } HttpdBuiltInUrl;
 
+//A piece of data for httpdSendv
+typedef struct {
+	const char *data;
+	int len;
+} HttpdSendVec;
+
+int ICACHE_FLASH_ATTR cgiRewrite(HttpdConnData *connData);
 int ICACHE_FLASH_ATTR cgiRedirect(HttpdConnData *connData);
 int ICACHE_FLASH_ATTR cgiRedirectToHostname(HttpdConnData *connData);
 int ICACHE_FLASH_ATTR cgiRedirectApClientToHostname(HttpdConnData *connData);
+int ICACHE_FLASH_ATTR cgiHttpdStats(HttpdConnData *connData);
 void ICACHE_FLASH_ATTR httpdRedirect(HttpdConnData *conn, char *newUrl);
 int httpdUrlDecode(char *val, int valLen, char *ret, int retLen);
 int ICACHE_FLASH_ATTR httpdFindArg(char *line, char *arg, char *buff, int buffLen);
+int ICACHE_FLASH_ATTR httpdGetArg(HttpdConnData *conn, const char *name, char *buff, int buffLen);
+int ICACHE_FLASH_ATTR httpdGetArgInt(HttpdConnData *conn, const char *name, int def);
 void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port);
 const char *httpdGetMimetype(char *url);
+void ICACHE_FLASH_ATTR httpdSetPostChunk(HttpdConnData *conn, int size, int start);
 void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code);
+void ICACHE_FLASH_ATTR httpdStartResponseHeaders(HttpdConnData *conn, int code, const char *hdrs, int len, int hasLen);
 void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const char *val);
+void ICACHE_FLASH_ATTR httpdSendLength(HttpdConnData *conn, int len);
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn);
+int ICACHE_FLASH_ATTR httpdStartRangeResponse(HttpdConnData *conn, int size, const char *etag, int *start, int *len);
 int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen);
 int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len);
+int ICACHE_FLASH_ATTR httpdSendv(HttpdConnData *conn, const HttpdSendVec *vec, int cnt);
+int ICACHE_FLASH_ATTR httpdSendSpace(HttpdConnData *conn);
+void ICACHE_FLASH_ATTR httpdFlush(HttpdConnData *conn);
+void ICACHE_FLASH_ATTR httpdAbortResponse(HttpdConnData *conn);
 void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdConnData *conn);
+int ICACHE_FLASH_ATTR httpdSendDirect(HttpdConnData *conn, const char *data, int len);
+void ICACHE_FLASH_ATTR httpdResume(HttpdConnData *conn);
+int ICACHE_FLASH_ATTR httpdGetResponse(HttpdConnData *conn, const char **body, int *bodyLen);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef HTTPDPOST_H
+#define HTTPDPOST_H
+
+#include "httpd.h"
+
+//Max length of a form field value handed to the field callback. Longer values are cut off.
+#ifndef HTTPD_POST_MAX_VAL
+#define HTTPD_POST_MAX_VAL 128
+#endif
+
+//Callbacks for the POST body parser. Any of these can be NULL. Arg is the arg given to
+//httpdPostParserNew.
+typedef struct {
+	//A form field came in. Val is url-decoded and zero-terminated.
+	void (*field)(HttpdConnData *connData, void *arg, char *name, char *val);
+	//A file part of a multipart form starts. Also called, with name and filename NULL, for a
+	//body that isn't a form at all: the whole body is seen as one file then.
+	void (*fileStart)(HttpdConnData *connData, void *arg, char *name, char *filename);
+	//Data of the current file. Called with len 0 at the end of the file.
+	void (*data)(HttpdConnData *connData, void *arg, char *data, int len);
+} HttpdPostCallbacks;
+
+typedef struct HttpdPostParser HttpdPostParser;
+
+HttpdPostParser ICACHE_FLASH_ATTR *httpdPostParserNew(HttpdConnData *connData, const HttpdPostCallbacks *cb, void *arg);
+int ICACHE_FLASH_ATTR httpdPostParse(HttpdPostParser *p, char *data, int len);
+void ICACHE_FLASH_ATTR httpdPostParserFree(HttpdPostParser *p);
+
+#endif
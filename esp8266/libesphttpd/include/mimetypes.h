@@ -0,0 +1,27 @@
+#ifndef MIMETYPES_H
+#define MIMETYPES_H
+
+//The mappings from file extensions to mime types. httpdGetMimetype looks things up in this,
+//and mkespfsimage uses it to put the Content-Type in the headers it composes for every file,
+//so both always agree. If you need an extra mime type, add it here.
+
+//Struct to keep extension->mime data in
+typedef struct {
+	const char *ext;
+	const char *mimetype;
+} MimeMap;
+
+static const MimeMap mimeTypes[]={
+	{"htm", "text/htm"},
+	{"html", "text/html"},
+	{"css", "text/css"},
+	{"js", "text/javascript"},
+	{"txt", "text/plain"},
+	{"jpg", "image/jpeg"},
+	{"jpeg", "image/jpeg"},
+	{"png", "image/png"},
+	{"svg", "image/svg+xml"},
+	{NULL, "text/html"}, //default value
+};
+
+#endif
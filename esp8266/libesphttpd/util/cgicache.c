@@ -0,0 +1,198 @@
+/*
+A cache for the answers of cgis that are expensive to make, e.g. because they need to ask
+some other piece of hardware. Put cgiCache in the url table instead of the cgi itself, with
+a CgiCacheRoute telling what cgi to call and how long its answer stays good. Answers are kept
+by url and GET args. A cgi that changes what another cgi answers can throw the old answer out
+with cgiCacheInvalidate.
+
+Only answers of GET requests that the cgi makes in one go are cached: it returns HTTPD_CGI_DONE
+the first time it's called, or the first time after it's done waiting with HTTPD_CGI_PENDING.
+Only the body is kept: a cached answer gets a 200 with the
+Content-Type of the CgiCacheRoute, or no headers at all if the cgi didn't send any either.
+*/
+
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+
+
+#include <esp8266.h>
+#include "httpd.h"
+#include "cgicache.h"
+
+typedef struct {
+	const CgiCacheRoute *route;
+	uint32_t expires; //system_get_time() at which the answer is too old
+	char head; //1 if the cgi answered with a status line and headers
+	int bodyLen;
+	char *body;
+	char key[]; //url and GET args, separated by a '?' if there are args
+} CacheEntry;
+
+static CacheEntry *cache[CGICACHE_ENTRIES];
+
+//Connection of which the cgi is being called to fill the cache, and if it said not to
+static HttpdConnData *storeConn;
+static char storeSkip;
+
+//Requests of which the cgi is waiting to make its answer. These still come through cgiCache,
+//so the answer can be kept when it's there.
+typedef struct {
+	HttpdConnData *conn;
+	const CgiCacheRoute *route;
+} PendingReq;
+
+static PendingReq pending[CGICACHE_PENDING];
+
+//Returns 1 if the key of the entry is the url with the args.
+static int ICACHE_FLASH_ATTR keyMatch(CacheEntry *e, const char *url, const char *args) {
+	int l=os_strlen(url);
+	if (os_strncmp(e->key, url, l)!=0) return 0;
+	if (args==NULL) return e->key[l]==0;
+	return e->key[l]=='?' && os_strcmp(&e->key[l+1], args)==0;
+}
+
+static void ICACHE_FLASH_ATTR cacheDrop(int i) {
+	os_free(cache[i]);
+	cache[i]=NULL;
+}
+
+//Find the answer for a request. Answers that are too old are dropped on the way.
+static CacheEntry ICACHE_FLASH_ATTR *cacheFind(const CgiCacheRoute *route, const char *url, const char *args) {
+	uint32_t now=system_get_time();
+	int i;
+	for (i=0; i<CGICACHE_ENTRIES; i++) {
+		if (cache[i]==NULL) continue;
+		if ((int32_t)(now-cache[i]->expires)>=0) {
+			cacheDrop(i);
+		} else if (cache[i]->route==route && keyMatch(cache[i], url, args)) {
+			return cache[i];
+		}
+	}
+	return NULL;
+}
+
+//Keep an answer. Takes the place of a free or outdated entry, or else of the one that would
+//be outdated first.
+static void ICACHE_FLASH_ATTR cacheStore(const CgiCacheRoute *route, const char *url, const char *args,
+			int head, const char *body, int bodyLen) {
+	uint32_t now=system_get_time();
+	int urlLen=os_strlen(url);
+	int argsLen=(args!=NULL)?os_strlen(args)+1:0;
+	CacheEntry *e;
+	int i, slot=0;
+	for (i=0; i<CGICACHE_ENTRIES; i++) {
+		if (cache[i]==NULL || (int32_t)(now-cache[i]->expires)>=0) {
+			slot=i;
+			break;
+		}
+		if ((int32_t)(cache[i]->expires-cache[slot]->expires)<0) slot=i;
+	}
+	if (cache[slot]!=NULL) cacheDrop(slot);
+	e=(CacheEntry*)os_malloc(sizeof(CacheEntry)+urlLen+argsLen+1+bodyLen);
+	if (e==NULL) return;
+	e->route=route;
+	e->expires=now+route->ttl*1000;
+	e->head=head;
+	os_memcpy(e->key, url, urlLen);
+	if (args!=NULL) {
+		e->key[urlLen]='?';
+		os_memcpy(&e->key[urlLen+1], args, argsLen-1);
+	}
+	e->key[urlLen+argsLen]=0;
+	e->body=&e->key[urlLen+argsLen+1];
+	e->bodyLen=bodyLen;
+	os_memcpy(e->body, body, bodyLen);
+	cache[slot]=e;
+}
+
+//Throw away the cached answers for an url, whatever its args. NULL throws away everything.
+void ICACHE_FLASH_ATTR cgiCacheInvalidate(const char *url) {
+	int i, l;
+	for (i=0; i<CGICACHE_ENTRIES; i++) {
+		if (cache[i]==NULL) continue;
+		if (url==NULL) {
+			cacheDrop(i);
+			continue;
+		}
+		l=os_strlen(url);
+		if (os_strncmp(cache[i]->key, url, l)==0 && (cache[i]->key[l]==0 || cache[i]->key[l]=='?')) cacheDrop(i);
+	}
+}
+
+//A cgi behind cgiCache can call this while it's making an answer that shouldn't be kept,
+//e.g. an error message.
+void ICACHE_FLASH_ATTR cgiCacheNoStore(HttpdConnData *connData) {
+	if (connData==storeConn) storeSkip=1;
+}
+
+//Calls the real cgi for a request that isn't answered from the cache, and keeps the answer if
+//it's made in one go.
+static int ICACHE_FLASH_ATTR cacheCall(HttpdConnData *connData, const CgiCacheRoute *route) {
+	const char *body;
+	int r, status, bodyLen, i;
+	connData->cgi=route->cgi;
+	connData->cgiArg=route->cgiArg;
+	storeConn=connData;
+	storeSkip=0;
+	r=route->cgi(connData);
+	storeConn=NULL;
+	if (r==HTTPD_CGI_PENDING && !storeSkip) {
+		//Come back here when it's done waiting. If there's no room to remember that, the answer
+		//just isn't kept.
+		for (i=0; i<CGICACHE_PENDING && pending[i].conn!=NULL; i++) ;
+		if (i<CGICACHE_PENDING) {
+			pending[i].conn=connData;
+			pending[i].route=route;
+			connData->cgi=cgiCache;
+		}
+		return r;
+	}
+	if (r!=HTTPD_CGI_DONE || storeSkip || connData->requestType!=HTTPD_METHOD_GET || connData->post->len>0) return r;
+	status=httpdGetResponse(connData, &body, &bodyLen);
+	if ((status==0 || status==200) && bodyLen<=CGICACHE_MAX_BODY) {
+		cacheStore(route, connData->url, connData->getArgs, status!=0, body, bodyLen);
+	}
+	return r;
+}
+
+//Caching 'cgi'. The cgiArg is the CgiCacheRoute for the url.
+int ICACHE_FLASH_ATTR cgiCache(HttpdConnData *connData) {
+	const CgiCacheRoute *route=(const CgiCacheRoute*)connData->cgiArg;
+	CacheEntry *e;
+	int i;
+
+	for (i=0; i<CGICACHE_PENDING; i++) {
+		if (pending[i].conn==connData) {
+			//The real cgi is done waiting, or the connection is gone.
+			pending[i].conn=NULL;
+			if (connData->conn==NULL) return pending[i].route->cgi(connData);
+			return cacheCall(connData, pending[i].route);
+		}
+	}
+	if (connData->conn==NULL) return HTTPD_CGI_DONE;
+
+	//A HEAD can be answered from the cache too; the core drops the body.
+	if ((connData->requestType==HTTPD_METHOD_GET || connData->requestType==HTTPD_METHOD_HEAD) && connData->post->len<=0) {
+		e=cacheFind(route, connData->url, connData->getArgs);
+		if (e!=NULL) {
+			if (e->head) {
+				httpdStartResponse(connData, 200);
+				httpdHeader(connData, "Content-Type", (route->contentType!=NULL)?route->contentType:"text/plain");
+				httpdSendLength(connData, e->bodyLen);
+				httpdEndHeaders(connData);
+			}
+			httpdSend(connData, e->body, e->bodyLen);
+			return HTTPD_CGI_DONE;
+		}
+	}
+
+	//Not cached. Hand the request to the real cgi; if it needs more calls to send its answer,
+	//those go to it directly.
+	return cacheCall(connData, route);
+}
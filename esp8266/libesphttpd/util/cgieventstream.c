@@ -0,0 +1,164 @@
+/*
+Server-sent events (the text/event-stream the browser's EventSource talks to) for esphttpd. A
+client opens the stream once and the server pushes events over it whenever something changes,
+so the page doesn't need to poll.
+*/
+
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+
+
+#include <esp8266.h>
+#include "httpd.h"
+#include "cgieventstream.h"
+
+static EventStream *llStart=NULL;
+static int esCount=0;
+static ETSTimer pingTimer;
+
+//Length of a line of the data of an event: up to the next newline or the end of the data.
+static int ICACHE_FLASH_ATTR lineLen(const char *p) {
+	int i=0;
+	while (p[i]!=0 && p[i]!='\n') i++;
+	return i;
+}
+
+//Send an event to one client. Event is the name of the event, or NULL for a nameless one
+//(a 'message' event for the browser). Data can consist of multiple lines. The event is queued
+//whole or not at all; returns 0 if there's no room for it at the moment.
+int ICACHE_FLASH_ATTR cgiEventStreamSend(EventStream *es, const char *event, const char *data) {
+	const char *p;
+	int len=1, l;
+	//Figure out the size first: "event: name\n", "data: line\n" for every line and "\n".
+	if (event!=NULL) len+=8+os_strlen(event);
+	p=data;
+	while (1) {
+		l=lineLen(p);
+		len+=7+l;
+		if (p[l]==0) break;
+		p+=l+1;
+	}
+	if (httpdSendSpace(es->conn)<len) return 0;
+	if (event!=NULL) {
+		//The first send can still fail if there's no memory for a send buffer.
+		if (!httpdSend(es->conn, "event: ", 7)) return 0;
+		httpdSend(es->conn, event, -1);
+		httpdSend(es->conn, "\n", 1);
+	}
+	p=data;
+	while (1) {
+		l=lineLen(p);
+		if (!httpdSend(es->conn, "data: ", 6)) return 0;
+		httpdSend(es->conn, p, l);
+		httpdSend(es->conn, "\n", 1);
+		if (p[l]==0) break;
+		p+=l+1;
+	}
+	httpdSend(es->conn, "\n", 1);
+	httpdFlushSendBuffer(es->conn);
+	es->active=1;
+	return 1;
+}
+
+//Send an event to all clients of the event stream at a specific url. Returns the amount of
+//clients it was sent to.
+int ICACHE_FLASH_ATTR cgiEventStreamBroadcast(const char *resource, const char *event, const char *data) {
+	EventStream *es=llStart;
+	int ret=0;
+	while (es!=NULL) {
+		if (os_strcmp(es->conn->url, resource)==0 && cgiEventStreamSend(es, event, data)) ret++;
+		es=es->next;
+	}
+	return ret;
+}
+
+//Returns the amount of clients listening to the event stream at the url. Useful to only go
+//find out what changed if there's someone to tell it to.
+int ICACHE_FLASH_ATTR cgiEventStreamClients(const char *resource) {
+	EventStream *es=llStart;
+	int ret=0;
+	while (es!=NULL) {
+		if (os_strcmp(es->conn->url, resource)==0) ret++;
+		es=es->next;
+	}
+	return ret;
+}
+
+//Send a comment to the streams that have been quiet since the last time. That keeps the
+//connection from being closed for being idle, and finds out about clients that went away.
+static void ICACHE_FLASH_ATTR pingTimerCb(void *arg) {
+	EventStream *es=llStart;
+	while (es!=NULL) {
+		if (!es->active && httpdSend(es->conn, ":\n\n", 3)) httpdFlushSendBuffer(es->conn);
+		es->active=0;
+		es=es->next;
+	}
+}
+
+//Event stream 'cgi' implementation. The cgiArg can be an EsConnectedCb, which gets called
+//for every new client, e.g. to tell it the current state of things.
+int ICACHE_FLASH_ATTR cgiEventStream(HttpdConnData *connData) {
+	EventStream *es=(EventStream*)connData->cgiPrivData;
+	if (connData->conn==NULL) {
+		//Connection aborted. Clean up.
+		if (es!=NULL) {
+			if (es->closeCb) es->closeCb(es);
+			//Take it out of the linked list
+			if (llStart==es) {
+				llStart=es->next;
+			} else {
+				EventStream *les=llStart;
+				while (les!=NULL && les->next!=es) les=les->next;
+				if (les!=NULL) les->next=es->next;
+			}
+			esCount--;
+			if (esCount==0) os_timer_disarm(&pingTimer);
+			os_free(es);
+			connData->cgiPrivData=NULL;
+		}
+		return HTTPD_CGI_DONE;
+	}
+
+	if (es!=NULL) {
+		//Sending is done. Nothing to do until the next event.
+		return HTTPD_CGI_MORE;
+	}
+
+	//First call here.
+	if (esCount<EVENTSTREAM_MAX_CLIENTS) es=(EventStream*)os_malloc(sizeof(EventStream));
+	if (es==NULL) {
+		//Too many clients. Browsers retry an event stream by themselves, so this is no big deal.
+		httpdStartResponse(connData, 503);
+		httpdHeader(connData, "Retry-After", "10");
+		httpdSendLength(connData, 0);
+		httpdEndHeaders(connData);
+		return HTTPD_CGI_DONE;
+	}
+	os_memset(es, 0, sizeof(EventStream));
+	es->conn=connData;
+	connData->cgiPrivData=es;
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "text/event-stream");
+	httpdHeader(connData, "Cache-Control", "no-cache");
+	httpdEndHeaders(connData);
+	//Tell the browser how soon to reconnect when the connection drops, in ms.
+	httpdSend(connData, "retry: 3000\n\n", -1);
+	//Insert es into linked list
+	es->next=llStart;
+	llStart=es;
+	if (esCount++==0) {
+		os_timer_disarm(&pingTimer);
+		os_timer_setfn(&pingTimer, pingTimerCb, NULL);
+		os_timer_arm(&pingTimer, EVENTSTREAM_PING_INTERVAL, 1);
+	}
+	if (connData->cgiArg!=NULL) ((EsConnectedCb)connData->cgiArg)(es);
+	//The rest comes as events happen; send what's there now.
+	httpdFlush(connData);
+	return HTTPD_CGI_MORE;
+}
@@ -15,6 +15,8 @@ Some flash handling cgi routines. Used for reading the existing flash and updati
 #include <esp8266.h>
 #include "cgiflash.h"
 #include "espfs.h"
+#include "httpdpost.h"
+#include "espfsformat.h"
 #include <osapi.h>
 #include "cgiflash.h"
 #include "espfs.h"
@@ -38,7 +40,10 @@ static char* ICACHE_FLASH_ATTR checkBinHeader(void *buf) {
 }
 
 static char* ICACHE_FLASH_ATTR checkEspfsHeader(void *buf) {
-	if (os_memcmp(buf, "ESfs", 4)!=0) return "Bad ESPfs header";
+	int32_t magic;
+	os_memcpy(&magic, buf, sizeof(magic));
+	if (os_memcmp(buf, "ESfs", 4)==0) return "ESPfs image of an older format; make it again";
+	if (magic!=ESPFS_MAGIC) return "Bad ESPfs header";
 	return NULL;
 }
 
@@ -61,67 +66,216 @@ int ICACHE_FLASH_ATTR cgiGetFirmwareNext(HttpdConnData *connData) {
 }
 
 
-//Cgi that reads the SPI flash. Assumes 512KByte flash.
-//ToDo: Figure out real flash size somehow?
+//State of a flash download
+typedef struct {
+	uint32_t pos; //flash address of the next byte to send
+	int left; //amount of bytes still to send
+} ReadFlashState;
+
+//Size of the SPI flash in bytes. The third byte of the JEDEC id is the log2 of the capacity;
+//anything outside 512KB-16MB isn't a chip an ESP8266 is used with (or the id couldn't be read,
+//which gives 0xff), so then only the first 512KB, which every module has, is assumed.
+static int ICACHE_FLASH_ATTR flashSize(void) {
+	int cap=(spi_flash_get_id()>>16)&0xff;
+	if (cap<0x13 || cap>0x18) return 512*1024;
+	return 1<<cap;
+}
+
+//Cgi that reads the SPI flash, all of it. The size of the flash comes from the JEDEC id of the
+//chip. A single byte range of it can be asked for with a Range header, e.g. to resume an
+//interrupted download.
 int ICACHE_FLASH_ATTR cgiReadFlash(HttpdConnData *connData) {
-	int *pos=(int *)&connData->cgiData;
+	ReadFlashState *st=(ReadFlashState*)connData->cgiData;
+	uint32_t buff[1024/4+1];
+	int start, len, off;
 	if (connData->conn==NULL) {
 		//Connection aborted. Clean up.
+		os_free(st);
 		return HTTPD_CGI_DONE;
 	}
 
-	if (*pos==0) {
+	if (st==NULL) {
 		os_printf("Start flash download.\n");
-		httpdStartResponse(connData, 200);
+		st=(ReadFlashState*)os_malloc(sizeof(ReadFlashState));
+		if (st==NULL) return HTTPD_CGI_NOTFOUND;
+		connData->cgiData=st;
+		httpdStartRangeResponse(connData, flashSize(), NULL, &start, &st->left);
 		httpdHeader(connData, "Content-Type", "application/bin");
 		httpdEndHeaders(connData);
-		*pos=0x40200000;
+		st->pos=start;
+		if (st->left==0) {
+			os_free(st);
+			return HTTPD_CGI_DONE;
+		}
 		return HTTPD_CGI_MORE;
 	}
-	//Send 1K of flash per call. We will get called again if we haven't sent 512K yet.
-	espconn_sent(connData->conn, (uint8 *)(*pos), 1024);
-	*pos+=1024;
-	if (*pos>=0x40200000+(512*1024)) return HTTPD_CGI_DONE; else return HTTPD_CGI_MORE;
+	//Send 1K of flash per call. The flash can only be read from word boundaries, so a range that
+	//starts in the middle of a word is read from the start of that word.
+	off=st->pos&3;
+	len=(st->left>1024-off)?1024-off:st->left;
+	spi_flash_read(st->pos-off, buff, (off+len+3)&~3);
+	//If it doesn't fit in the send buffer, the same part is read again on the next call.
+	if (!httpdSendDirect(connData, (char*)buff+off, len)) return HTTPD_CGI_MORE;
+	st->pos+=len;
+	st->left-=len;
+	if (st->left>0) return HTTPD_CGI_MORE;
+	os_free(st);
+	return HTTPD_CGI_DONE;
+}
+
+
+//State of a firmware upload
+typedef struct {
+	HttpdPostParser *parser;
+	char *err;
+	int inFile; //1 while receiving the image, 2 when it's all in
+	uint32_t address; //flash address the next data of the image goes to
+	int size; //amount of bytes of the image received so far
+	int written; //amount of bytes of the image written to flash so far
+	int bufLen;
+	uint32_t *buf; //data for the flash sector at address, as far as it's in; allocated when needed
+} UploadState;
+
+//Write len bytes of the image to flash. Data has to be word-aligned and len a whole amount
+//of words.
+static void ICACHE_FLASH_ATTR uploadWrite(UploadState *st, CgiUploadFlashDef *def, uint32_t *data, int len) {
+	uint32_t a;
+	if (st->err!=NULL || len==0) return;
+	//The first bit of the image needs to look like the real thing.
+	if (st->written==0) {
+		if (def->type==CGIFLASH_TYPE_FW) st->err=checkBinHeader(data);
+		if (def->type==CGIFLASH_TYPE_ESPFS) st->err=checkEspfsHeader(data);
+		if (st->err!=NULL) return;
+	}
+	// erase the flash blocks this goes into, as we get to them
+	for (a=(st->address+SPI_FLASH_SEC_SIZE-1)&~(SPI_FLASH_SEC_SIZE-1); a<st->address+len; a+=SPI_FLASH_SEC_SIZE) {
+		os_printf("Erasing flash at 0x%05x\n", (unsigned int)a);
+		spi_flash_erase_sector(a/SPI_FLASH_SEC_SIZE);
+	}
+	spi_flash_write(st->address, data, len);
+	st->address+=len;
+	st->written+=len;
 }
 
+//Write the data gathered in the upload buffer to flash.
+static void ICACHE_FLASH_ATTR uploadFlush(UploadState *st, CgiUploadFlashDef *def) {
+	if (st->bufLen==0) return;
+	//Pad a partial word at the end of the image.
+	while (st->bufLen&3) ((char*)st->buf)[st->bufLen++]=0xff;
+	uploadWrite(st, def, st->buf, st->bufLen);
+	st->bufLen=0;
+}
 
-//Cgi that allows the firmware to be replaced via http POST
+static void ICACHE_FLASH_ATTR uploadFileStart(HttpdConnData *connData, void *arg, char *name, char *filename) {
+	UploadState *st=(UploadState*)arg;
+	//Only the first file of a form is used.
+	if (st->inFile==0) st->inFile=1;
+}
+
+static void ICACHE_FLASH_ATTR uploadData(HttpdConnData *connData, void *arg, char *data, int len) {
+	UploadState *st=(UploadState*)arg;
+	CgiUploadFlashDef *def=(CgiUploadFlashDef*)connData->cgiArg;
+	HttpdPostData *post=connData->post;
+	int n, room;
+	if (st->inFile!=1 || st->err!=NULL) return;
+	if (len==0) {
+		//End of the image.
+		uploadFlush(st, def);
+		st->inFile=2;
+		return;
+	}
+	if (st->size+len > def->fwSize) {
+		st->err="Firmware image too large";
+		return;
+	}
+	if (st->size==0 && data>=post->buff && data<post->buff+post->buffLen) {
+		//The image starts here. Have the rest of the body come in chunks that end where a
+		//flash sector of it does, so those go to flash in one write.
+		httpdSetPostChunk(connData, SPI_FLASH_SEC_SIZE, post->received-post->buffLen+(data-post->buff));
+	}
+	while (len>0) {
+		//Flash is written a sector at a time. Whole sectors that are aligned in the POST buffer,
+		//like those of a raw upload, go straight from there. The multipart parser hands out a
+		//file in pieces that end at every CR, as that could start a boundary; those are gathered
+		//until their sector is complete, whether or not they're aligned.
+		room=SPI_FLASH_SEC_SIZE-(st->address&(SPI_FLASH_SEC_SIZE-1));
+		if (st->bufLen==0 && ((uint32_t)data&3)==0 && len>=room) {
+			n=(room==SPI_FLASH_SEC_SIZE)?(len&~(SPI_FLASH_SEC_SIZE-1)):room;
+			uploadWrite(st, def, (uint32_t*)data, n);
+		} else {
+			if (st->buf==NULL) st->buf=(uint32_t*)os_malloc(SPI_FLASH_SEC_SIZE);
+			if (st->buf==NULL) {
+				st->err="Out of memory";
+				return;
+			}
+			n=room-st->bufLen;
+			if (n>len) n=len;
+			os_memcpy(((char*)st->buf)+st->bufLen, data, n);
+			st->bufLen+=n;
+			if (st->bufLen==room) uploadFlush(st, def);
+		}
+		st->size+=n;
+		data+=n;
+		len-=n;
+	}
+}
+
+static const HttpdPostCallbacks uploadCallbacks={
+	.fileStart=uploadFileStart,
+	.data=uploadData,
+};
+
+static void ICACHE_FLASH_ATTR uploadFree(UploadState *st) {
+	httpdPostParserFree(st->parser);
+	if (st->buf!=NULL) os_free(st->buf);
+	os_free(st);
+}
+
+//Cgi that allows the firmware to be replaced via http POST. Takes the image either as the raw
+//request body or as the first file of a multipart form, so it can be uploaded from a browser.
+//The image is written to flash while it comes in.
 int ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
 	CgiUploadFlashDef *def=(CgiUploadFlashDef*)connData->cgiArg;
-	uint32_t address;
+	UploadState *st=(UploadState*)connData->cgiPrivData;
+	char *err=NULL;
+	int code=400;
 	if (connData->conn==NULL) {
 		//Connection aborted. Clean up.
+		if (st!=NULL) {
+			uploadFree(st);
+			connData->cgiPrivData=NULL;
+		}
 		return HTTPD_CGI_DONE;
 	}
 
-	int offset = connData->post->received - connData->post->buffLen;
-	if (offset == 0) {
-		connData->cgiPrivData = NULL;
-	} else if (connData->cgiPrivData != NULL) {
-		// we have an error condition, do nothing
-		return HTTPD_CGI_DONE;
-	}
-
-	// assume no error yet...
-	char *err = NULL;
-	int code = 400;
-
-	if (connData->post==NULL) err="No POST request.";
+	if (connData->post==NULL || connData->post->buff==NULL) err="No POST request.";
 	if (def==NULL) err="Flash def = NULL ?";
 
-	// check overall size
-	os_printf("Max img sz 0x%X, post len 0x%X\n", def->fwSize, connData->post->len);
-	if (err==NULL && connData->post->len > def->fwSize) err = "Firmware image too large";
-
-	// check that data starts with an appropriate header
-	if (err == NULL && offset == 0 && def->type==CGIFLASH_TYPE_FW) err = checkBinHeader(connData->post->buff);
-	if (err == NULL && offset == 0 && def->type==CGIFLASH_TYPE_ESPFS) err = checkEspfsHeader(connData->post->buff);
+	if (err==NULL && st==NULL) {
+		//First chunk of the upload.
+		st=(UploadState*)os_malloc(sizeof(UploadState));
+		if (st!=NULL) {
+			os_memset(st, 0, sizeof(UploadState));
+			st->parser=httpdPostParserNew(connData, &uploadCallbacks, st);
+		}
+		if (st==NULL || st->parser==NULL) {
+			err="Out of memory";
+			code=500;
+		} else {
+			// let's see which partition we need to flash and what flash address that puts us at
+			int id=system_upgrade_userbin_check();
+			st->address=(id==1)?def->fw1Pos:def->fw2Pos;
+			connData->cgiPrivData=st;
+			os_printf("Max img sz 0x%X, post len 0x%X, writing to 0x%05x\n", def->fwSize,
+					connData->post->len, (unsigned int)st->address);
+		}
+	}
 
-	// make sure we're buffering in 1024 byte chunks
-	if (err == NULL && offset % 1024 != 0) {
-		err = "Buffering problem";
-		code = 500;
+	if (err==NULL) {
+		httpdPostParse(st->parser, connData->post->buff, connData->post->buffLen);
+		if (st->err!=NULL) err=st->err;
 	}
+	if (err==NULL && connData->post->received==connData->post->len && st->inFile!=2) err="No image in upload";
 
 	// return an error if there is one
 	if (err != NULL) {
@@ -132,33 +286,18 @@ int ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
 		httpdSend(connData, "Firmware image error:\r\n", -1);
 		httpdSend(connData, err, -1);
 		httpdSend(connData, "\r\n", -1);
-		connData->cgiPrivData = (void *)1;
-		return HTTPD_CGI_DONE;
-	}
-
-	// let's see which partition we need to flash and what flash address that puts us at
-	int id=system_upgrade_userbin_check();
-	if (id==1) address=def->fw1Pos; else address=def->fw2Pos;
-	address += offset;
-	// erase next flash block if necessary
-	if (address % SPI_FLASH_SEC_SIZE == 0){
-		// We need to erase this block
-		os_printf("Erasing flash at 0x%05x (id=%d)\n", (unsigned int)address, 2-id);
-		spi_flash_erase_sector(address/SPI_FLASH_SEC_SIZE);
-	}
-
-	// Write the data
-	os_printf("Writing %d bytes at 0x%05x (%d of %d)\n", connData->post->buffSize, (unsigned int)address,
-			connData->post->received, connData->post->len);
-	spi_flash_write(address, (uint32 *)connData->post->buff, connData->post->buffLen);
-
-	if (connData->post->received == connData->post->len){
+	} else if (connData->post->received == connData->post->len) {
+		os_printf("Upload done, %d bytes written\n", st->size);
 		httpdStartResponse(connData, 200);
 		httpdEndHeaders(connData);
-		return HTTPD_CGI_DONE;
 	} else {
 		return HTTPD_CGI_MORE;
 	}
+	if (st!=NULL) {
+		uploadFree(st);
+		connData->cgiPrivData=NULL;
+	}
+	return HTTPD_CGI_DONE;
 }
 
 //static ETSTimer flash_reboot_timer;
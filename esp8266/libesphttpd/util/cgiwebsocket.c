@@ -86,8 +86,8 @@ struct WebsockPriv {
 
 static Websock *llStart=NULL;
 
-static int ICACHE_FLASH_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
-	char buf[14];
+//Build the head of a frame in buf, which needs room for 10 bytes. Returns its length.
+static int ICACHE_FLASH_ATTR makeFrameHead(char *buf, int opcode, int len) {
 	int i=0;
 	buf[i++]=opcode;
 	if (len>65535) {
@@ -104,16 +104,28 @@ static int ICACHE_FLASH_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
 	} else {
 		buf[i++]=len;
 	}
-	return httpdSend(ws->conn, buf, i);
+	return i;
 }
 
+static int ICACHE_FLASH_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
+	char buf[14];
+	return httpdSend(ws->conn, buf, makeFrameHead(buf, opcode, len));
+}
+
+//Send a frame. The frame head and the data are queued together, so a frame is never sent
+//halfway. Returns 0 if there's no room for it at the moment; try again from the sentCb.
 int ICACHE_FLASH_ATTR cgiWebsocketSend(Websock *ws, char *data, int len, int flags) {
 	int r;
 	int fl=0;
+	char buf[14];
+	HttpdSendVec v[2];
 	if (flags&WEBSOCK_FLAG_BIN) fl=OPCODE_BINARY; else fl=OPCODE_TEXT;
 	if (!(flags&WEBSOCK_FLAG_CONT)) fl|=FLAG_FIN;
-	sendFrameHead(ws, fl, len);
-	r=httpdSend(ws->conn, data, len);
+	v[0].data=buf;
+	v[0].len=makeFrameHead(buf, fl, len);
+	v[1].data=data;
+	v[1].len=len;
+	r=httpdSendv(ws->conn, v, 2);
 	httpdFlushSendBuffer(ws->conn);
 	return r;
 }
@@ -259,6 +271,8 @@ int ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData) {
 				base64_encode(20, sha1_result(&s), sizeof(buff), buff);
 				httpdHeader(connData, "Sec-WebSocket-Accept", buff);
 				httpdEndHeaders(connData);
+				//The client waits for these before it says anything; don't hold them back.
+				httpdFlush(connData);
 				//Set data receive handler
 				connData->recvHdl=cgiWebSocketRecv;
 				//Inform CGI function we have a connection
@@ -204,8 +204,8 @@ int ICACHE_FLASH_ATTR cgiWiFiConnect(HttpdConnData *connData) {
 		return HTTPD_CGI_DONE;
 	}
 	
-	httpdFindArg(connData->post->buff, "essid", essid, sizeof(essid));
-	httpdFindArg(connData->post->buff, "passwd", passwd, sizeof(passwd));
+	httpdGetArg(connData, "essid", essid, sizeof(essid));
+	httpdGetArg(connData, "passwd", passwd, sizeof(passwd));
 
 	os_strncpy((char*)stconf.ssid, essid, 32);
 	os_strncpy((char*)stconf.password, passwd, 64);
@@ -235,8 +235,8 @@ int ICACHE_FLASH_ATTR cgiWiFiSetMode(HttpdConnData *connData) {
 		return HTTPD_CGI_DONE;
 	}
 
-	len=httpdFindArg(connData->getArgs, "mode", buff, sizeof(buff));
-	if (len!=0) {
+	len=httpdGetArg(connData, "mode", buff, sizeof(buff));
+	if (len>0) {
 		os_printf("cgiWifiSetMode: %s\n", buff);
 #ifndef DEMO_MODE
 		wifi_set_opmode(atoi(buff));
@@ -3,12 +3,15 @@
 #include "osapi.h"
 #include "gpio.h"
 #include "os_type.h"
+#include "mem.h"
 #include "user_interface.h"
 
 // HTTPD
 #include "webpages-espfs.h"
 #include "httpdespfs.h"
 #include "httpd.h"
+#include "cgieventstream.h"
+#include "cgicache.h"
 
 // Configuration
 #include "user_config.h"
@@ -26,17 +29,15 @@ struct TimeSpec {
 
 bool dcf_decoder_readjust = false;
 
+void telemetry_time(void);
+
 os_timer_t dcf_read_timer;
 os_timer_t dcf_decode_timer;
 os_timer_t time_inc_timer;
 
-#define ANS_BUF_SIZE 30
-uint8_t ans_buf_iter = 0;
-char ans_buf[ANS_BUF_SIZE];
-
-#define CMD_BUF_SIZE 16
-uint8_t cmd_buf_iter = 0;
-char cmd_buf[CMD_BUF_SIZE];
+#define LINE_BUF_SIZE 30
+uint8_t line_buf_iter = 0;
+char line_buf[LINE_BUF_SIZE];
 
 uint8_t dcf_hc = 0;
 uint8_t dcf_lc = 0;
@@ -146,6 +147,7 @@ void time_inc_timer_cb(void) {
 				// Ignore the rest, receive that from DCF77
 			}
 		}
+		telemetry_time();
 	}
 }
 
@@ -170,6 +172,112 @@ void ap_init(void) {
 	system_restart();
 }
 
+/**
+ * AVR communication
+ * Commands are sent to the AVR controller one at a time, it answers each of them with
+ * a line. Nothing waits for that answer: the loop picks it up and hands it to the
+ * request that was sent. If there is no answer within AVR_TIMEOUT ms, or not the
+ * expected one, the command is sent again, up to tries times.
+ */
+#define AVR_TIMEOUT 200
+#define AVR_TRIES 4
+#define AVR_CMD_LEN 32
+#define ANS_BUF_SIZE 30
+
+struct AvrRequest;
+typedef bool (*avr_check_t)(char *answer);
+typedef void (*avr_done_t)(struct AvrRequest *req);
+
+struct AvrRequest {
+	char command[AVR_CMD_LEN];
+	uint8_t tries;
+	avr_check_t check; // Tells if an answer is good, NULL accepts any answer
+	avr_done_t done; // Called when there is a good answer or no tries are left
+	void *arg;
+	bool answered;
+	char answer[ANS_BUF_SIZE];
+	struct AvrRequest *next;
+};
+
+// The first request is the one that was sent, the others wait for their turn
+struct AvrRequest *avr_queue = NULL;
+os_timer_t avr_timer;
+
+void avr_send(void) {
+	os_printf("\r\n%s\r\n", avr_queue->command);
+	os_timer_disarm(&avr_timer);
+	os_timer_arm(&avr_timer, AVR_TIMEOUT, 0);
+}
+
+// Queues a request, returns false if it is queued already
+bool avr_submit(struct AvrRequest *req) {
+	struct AvrRequest **p;
+	for (p = &avr_queue; *p != NULL; p = &(*p)->next)
+		if (*p == req) return false;
+
+	req->answered = false;
+	req->answer[0] = 0x00;
+	req->next = NULL;
+	*p = req;
+	if (avr_queue == req) avr_send();
+	return true;
+}
+
+// The request that was sent is done, go on with the next one before telling
+void avr_finish(bool answered) {
+	struct AvrRequest *req = avr_queue;
+	os_timer_disarm(&avr_timer);
+	avr_queue = req->next;
+	if (avr_queue != NULL) avr_send();
+
+	req->answered = answered;
+	req->done(req);
+}
+
+void avr_retry(void) {
+	if (--avr_queue->tries > 0) avr_send();
+	else avr_finish(false);
+}
+
+void avr_timer_cb(void) {
+	if (avr_queue != NULL) avr_retry();
+}
+
+// Takes a line from the UART, returns false if no request waits for one
+bool avr_answer(char *line) {
+	struct AvrRequest *req = avr_queue;
+	if (req == NULL) return false;
+	if (line[0] == 0x00) return true;
+
+	os_strncpy(req->answer, line, ANS_BUF_SIZE - 1);
+	req->answer[ANS_BUF_SIZE - 1] = 0x00;
+	if (req->check == NULL || req->check(req->answer)) avr_finish(true);
+	else avr_retry();
+	return true;
+}
+
+void avr_free_done(struct AvrRequest *req) {
+	os_free(req);
+}
+
+// Frees a request that was allocated. If it was sent already, that happens when it is done.
+void avr_release(struct AvrRequest *req) {
+	struct AvrRequest **p;
+	if (req == NULL) return;
+	if (req == avr_queue) {
+		req->done = avr_free_done;
+		return;
+	}
+
+	for (p = &avr_queue; *p != NULL; p = &(*p)->next) {
+		if (*p == req) {
+			*p = req->next;
+			break;
+		}
+	}
+	os_free(req);
+}
+
 /*** Loop ***/
 static void ICACHE_FLASH_ATTR loop(os_event_t *events) {
 	char c;
@@ -177,18 +285,20 @@ static void ICACHE_FLASH_ATTR loop(os_event_t *events) {
 
 	if(res != 1) {
 		if (c != '\r' && c != '\n') {
-			if (cmd_buf_iter + 1 < CMD_BUF_SIZE)
-				cmd_buf[cmd_buf_iter++] = c;
+			if (line_buf_iter + 1 < LINE_BUF_SIZE)
+				line_buf[line_buf_iter++] = c;
 		} else {
-			cmd_buf[cmd_buf_iter] = 0x00;
-			cmd_buf_iter = 0;
-			if (os_strcmp(cmd_buf, "time") == 0) {
+			line_buf[line_buf_iter] = 0x00;
+			line_buf_iter = 0;
+			if (avr_answer(line_buf)) {
+				// Answer to a command we sent
+			} else if (os_strcmp(line_buf, "time") == 0) {
 				if (time_valid) {
 					os_printf("Zeit: %d.%d.%d, %d:%d:%d, DOW %d\r\n", time.date, time.month, time.year, time.hours, time.minutes, time.seconds, time.dow);
 				} else {
 					os_printf("No valid time information yet!\r\n");
 				}
-			} else if (os_strcmp(cmd_buf, "dcf") == 0) {
+			} else if (os_strcmp(line_buf, "dcf") == 0) {
 				os_printf("DCF77 status information:\r\n");
 				os_printf("Received bits this minute: %d\r\n", signal_iter);
 				os_printf("High count %d, Low count %d, Total %d\r\n", dcf_hc, dcf_lc, dcf_hc + dcf_lc);
@@ -196,13 +306,13 @@ static void ICACHE_FLASH_ATTR loop(os_event_t *events) {
 				uint8_t i;
 				for (i = 0; i < 60; i++) os_printf("%d", signal[i]);
 				os_printf("\r\n");
-			} else if (os_strcmp(cmd_buf, "time_get") == 0) {
+			} else if (os_strcmp(line_buf, "time_get") == 0) {
 				if (time_valid) {
 					os_printf("%d %d %d %d %d %d %d\r\n", time.seconds, time.minutes, time.hours, time.date, time.month, time.year, time.dow);
 				} else {
 					os_printf("x\r\n");
 				}
-			} else if (os_strcmp(cmd_buf, "hello") == 0) {
+			} else if (os_strcmp(line_buf, "hello") == 0) {
 				os_printf("hel_ok\r\n");
 			}
 		}
@@ -210,39 +320,6 @@ static void ICACHE_FLASH_ATTR loop(os_event_t *events) {
 	system_os_post(user_procTaskPrio, 0, 0);
 }
 
-/**
- * get_answer
- * Writes answer in global ans_buf variable
- * Ignores answers that are longer than ANS_BUF_SIZE
- * Returns false if no answer was received, otherwise true
- *
- * ms_to_answer maximum 1000ms due to watchdog!
- */
-bool get_answer(uint16_t ms_to_answer) {
-	ans_buf_iter = 0;
-	uint16_t time_ms = 0;
-
-	while (time_ms <= ms_to_answer) {
-		char c;
-		int res = uart_rx_one_char(&c);
-
-		if (res == 1) {
-			os_delay_us(1000);
-			time_ms++;
-		} else {
-			if (c != '\r' && c != '\n') {
-				if (ans_buf_iter + 1 < ANS_BUF_SIZE)
-					ans_buf[ans_buf_iter++] = c;
-			} else {
-				ans_buf[ans_buf_iter] = 0x00;
-				return true;
-			}
-		}
-	}
-
-	return false;
-}
-
 /**
  * Returns the nth integer from a string in which integers are separated by spaces
  * The integer must be an unsigned 8-bit integer, the string must be null-terminated
@@ -270,178 +347,296 @@ uint8_t integer_from_string(char *buf, uint8_t nth) {
 	return (uint8_t) atoi(numberbuf);
 }
 
+/**
+ * Formatting of the answers of the AVR controller
+ */
+void format_systime(char *buf, uint8_t dow, uint8_t date, uint8_t month, uint8_t year, uint8_t hours, uint8_t minutes, uint8_t seconds) {
+	char dow_readable[30];
+	if (dow == 1) os_strcpy(dow_readable, "Montag");
+	else if (dow == 2) os_strcpy(dow_readable, "Dienstag");
+	else if (dow == 3) os_strcpy(dow_readable, "Mittwoch");
+	else if (dow == 4) os_strcpy(dow_readable, "Donnerstag");
+	else if (dow == 5) os_strcpy(dow_readable, "Freitag");
+	else if (dow == 6) os_strcpy(dow_readable, "Samstag");
+	else if (dow == 7) os_strcpy(dow_readable, "Sonntag");
+	else os_strcpy(dow_readable, "Ungültige Systemzeit");
+
+	os_sprintf(buf, "%s, %d.%d.%d %d:%d:%d Uhr", dow_readable, date, month, year, hours, minutes, seconds);
+}
+
+void format_opentime(char *buf, uint8_t hours, uint8_t minutes) {
+	if (hours == 25)
+		os_sprintf(buf, "Klappe wird nicht automatisch geöffnet");
+	else
+		os_sprintf(buf, "Aufmachzeit ist %d:%d Uhr", hours, minutes);
+}
+
+void format_battery(char *buf, char *answer) {
+	uint8_t voltage = integer_from_string(answer, 0);
+	uint8_t percent = integer_from_string(answer, 1);
+
+	os_sprintf(buf, "Batteriespannung ist %u.%uV, geschätzt %u%%", (voltage - voltage % 10) / 10, voltage % 10, percent);
+}
+
+/**
+ * Live telemetry
+ * The last known state of battery, time, opentime and slider is kept here and pushed
+ * to all browsers that have the /events stream open as soon as it changes.
+ * Battery and opentime can only change on the AVR, so they are polled while someone
+ * is listening.
+ */
+#define TELEMETRY_POLL_INTERVAL 60000
+#define TELEMETRY_LEN 80
+
+char telemetry_battery[TELEMETRY_LEN] = "";
+char telemetry_systime[TELEMETRY_LEN] = "";
+char telemetry_opentime[TELEMETRY_LEN] = "";
+char telemetry_slider[TELEMETRY_LEN] = "";
+
+os_timer_t telemetry_timer;
+// The poll timer stops when nobody is listening anymore, and starts again with the next client
+bool telemetry_polling = false;
+
+// Updates the known state, tells everyone listening if it changed
+void telemetry_update(char *known, const char *event, const char *value) {
+	if (os_strcmp(known, value) == 0) return;
+	os_strncpy(known, value, TELEMETRY_LEN - 1);
+	known[TELEMETRY_LEN - 1] = 0x00;
+	cgiEventStreamBroadcast("/events", event, known);
+}
+
+// Called every minute with the local clock, which the AVR takes its time from
+void telemetry_time(void) {
+	char buf[TELEMETRY_LEN];
+	if (!time_valid) return;
+	format_systime(buf, time.dow, time.date, time.month, time.year, time.hours, time.minutes, time.seconds);
+	telemetry_update(telemetry_systime, "time", buf);
+}
+
+struct AvrRequest telemetry_battery_req;
+struct AvrRequest telemetry_opentime_req;
+
+void telemetry_battery_done(struct AvrRequest *req) {
+	char buf[TELEMETRY_LEN];
+	if (!req->answered) return;
+	format_battery(buf, req->answer);
+	telemetry_update(telemetry_battery, "battery", buf);
+}
+
+void telemetry_opentime_done(struct AvrRequest *req) {
+	char buf[TELEMETRY_LEN];
+	if (!req->answered) return;
+	format_opentime(buf, integer_from_string(req->answer, 0), integer_from_string(req->answer, 1));
+	telemetry_update(telemetry_opentime, "opentime", buf);
+}
+
+// Only try once, the next poll comes soon enough
+void telemetry_query(struct AvrRequest *req, const char *command, avr_done_t done) {
+	os_strcpy(req->command, command);
+	req->tries = 1;
+	req->check = NULL;
+	req->done = done;
+	avr_submit(req);
+}
+
+void telemetry_timer_cb(void) {
+	if (cgiEventStreamClients("/events") == 0) {
+		telemetry_polling = false;
+		return;
+	}
+
+	telemetry_query(&telemetry_battery_req, "battery_get", telemetry_battery_done);
+	telemetry_query(&telemetry_opentime_req, "opentime_get", telemetry_opentime_done);
+
+	os_timer_arm(&telemetry_timer, TELEMETRY_POLL_INTERVAL, 0);
+}
+
+// A new client opened the event stream: tell it everything that is known already
+void telemetry_connected(EventStream *es) {
+	if (telemetry_battery[0]) cgiEventStreamSend(es, "battery", telemetry_battery);
+	if (telemetry_systime[0]) cgiEventStreamSend(es, "time", telemetry_systime);
+	if (telemetry_opentime[0]) cgiEventStreamSend(es, "opentime", telemetry_opentime);
+	if (telemetry_slider[0]) cgiEventStreamSend(es, "slider", telemetry_slider);
+
+	// Start polling if nobody was listening so far; poll soon anyway if there is something
+	// we don't know yet
+	if (!telemetry_polling || telemetry_battery[0] == 0x00 || telemetry_opentime[0] == 0x00) {
+		telemetry_polling = true;
+		os_timer_disarm(&telemetry_timer);
+		os_timer_arm(&telemetry_timer, 100, 0);
+	}
+}
+
 /**
  * HTTP commands
  * They forward the corresponding command to the AVR controller and decode the
  * answer. The may then forward that answer to the HTTP client in a human-readable
  * format.
+ * The server goes on with other things while the AVR is busy: the command returns
+ * HTTPD_CGI_PENDING and is called again with the request in conn->cgiData when
+ * the answer is there.
  */
-int cmd_slider_up(HttpdConnData *conn) {
-	uint8_t i;
-	for (i = 0; i < 4; i++) {
-		os_printf("\r\nslider_up\r\n");
-		bool res = get_answer(200);
-		if (res == true && os_strcmp("slu_ok", ans_buf) == 0) {
-			os_printf("Leaving with success state\r\n");
-			httpdSend(conn, "ok", -1);
-			return HTTPD_CGI_DONE;
-		}
+void cmd_avr_done(struct AvrRequest *req) {
+	httpdResume((HttpdConnData *) req->arg);
+}
+
+int cmd_avr_request(HttpdConnData *conn, const char *command, avr_check_t check) {
+	struct AvrRequest *req = (struct AvrRequest *) os_zalloc(sizeof(struct AvrRequest));
+	if (req == NULL) {
+		cgiCacheNoStore(conn);
+		httpdSend(conn, "Kein Speicher frei", -1);
+		return HTTPD_CGI_DONE;
 	}
 
-	os_printf("Leaving with error state, buffer is %s\r\n", ans_buf);
-	httpdSend(conn, "Keine Antwort vom AVR-Controller", -1);
-	return HTTPD_CGI_DONE;
+	os_strncpy(req->command, command, AVR_CMD_LEN - 1);
+	req->tries = AVR_TRIES;
+	req->check = check;
+	req->done = cmd_avr_done;
+	req->arg = conn;
+	conn->cgiData = req;
+	avr_submit(req);
+	return HTTPD_CGI_PENDING;
 }
 
-int cmd_slider_down(HttpdConnData *conn) {
-	uint8_t i;
-	for (i = 0; i < 4; i++) {
-		os_printf("\r\nslider_down\r\n");
-		bool res = get_answer(200);
-		if (res == true && os_strcmp("sld_ok", ans_buf) == 0) {
-			httpdSend(conn, "ok", -1);
-			return HTTPD_CGI_DONE;
-		}
-	}
+// The request is done, or the connection is gone
+int cmd_avr_release(HttpdConnData *conn) {
+	avr_release((struct AvrRequest *) conn->cgiData);
+	conn->cgiData = NULL;
+	return HTTPD_CGI_DONE;
+}
 
+int cmd_avr_error(HttpdConnData *conn) {
+	cgiCacheNoStore(conn);
 	httpdSend(conn, "Keine Antwort vom AVR-Controller", -1);
-	return HTTPD_CGI_DONE;
+	return cmd_avr_release(conn);
 }
 
-int cmd_opentime_get(HttpdConnData *conn) {
-	uint8_t i;
-	for (i = 0; i < 4; i++) {
-		os_printf("\r\nopentime_get\r\n");
-		bool res = get_answer(200);
-		if (res == true) {
-			uint8_t hours = integer_from_string(ans_buf, 0);
-			uint8_t minutes = integer_from_string(ans_buf, 1);
-
-			char resbuf[50];
-			if (hours == 25)
-				os_sprintf(resbuf, "Klappe wird nicht automatisch geöffnet");
-			else
-				os_sprintf(resbuf, "Aufmachzeit ist %d:%d Uhr", hours, minutes);
-			httpdSend(conn, resbuf, -1);
-			return HTTPD_CGI_DONE;
-		}
-	}
+bool check_slider_up(char *answer) {
+	return os_strcmp("slu_ok", answer) == 0;
+}
 
-	httpdSend(conn, "Keine Antwort vom AVR-Controller", -1);
-	return HTTPD_CGI_DONE;
+bool check_slider_down(char *answer) {
+	return os_strcmp("sld_ok", answer) == 0;
 }
 
-int cmd_systime_get(HttpdConnData *conn) {
-	uint8_t i;
-	for (i = 0; i < 4; i++) {
-		os_printf("\r\nsystime_get\r\n");
-		bool res = get_answer(200);
-		if (res == true) {
-			uint8_t seconds = integer_from_string(ans_buf, 0);
-			uint8_t minutes = integer_from_string(ans_buf, 1);
-			uint8_t hours = integer_from_string(ans_buf, 2);
-			uint8_t date = integer_from_string(ans_buf, 3);
-			uint8_t month = integer_from_string(ans_buf, 4);
-			uint8_t year = integer_from_string(ans_buf, 5);
-			uint8_t dow = integer_from_string(ans_buf, 6);
-
-			char dow_readable[30];
-			if (dow == 255) continue;
-			else if (dow == 1) os_strcpy(dow_readable, "Montag");
-			else if (dow == 2) os_strcpy(dow_readable, "Dienstag");
-			else if (dow == 3) os_strcpy(dow_readable, "Mittwoch");
-			else if (dow == 4) os_strcpy(dow_readable, "Donnerstag");
-			else if (dow == 5) os_strcpy(dow_readable, "Freitag");
-			else if (dow == 6) os_strcpy(dow_readable, "Samstag");
-			else if (dow == 7) os_strcpy(dow_readable, "Sonntag");
-			else if (dow == 0) os_strcpy(dow_readable, "Ungültige Systemzeit");
-
-			char resbuf[80];
-			os_sprintf(resbuf, "%s, %d.%d.%d %d:%d:%d Uhr", dow_readable, date, month, year, hours, minutes, seconds);
-			httpdSend(conn, resbuf, -1);
-			return HTTPD_CGI_DONE;
-		}
+bool check_systime(char *answer) {
+	return integer_from_string(answer, 6) != 255;
+}
+
+bool check_opentime_set(char *answer) {
+	return os_strcmp("ots_ok", answer) == 0;
+}
+
+int cmd_slider_up(HttpdConnData *conn) {
+	struct AvrRequest *req = conn->cgiData;
+	if (conn->conn == NULL) return cmd_avr_release(conn);
+	if (req == NULL) return cmd_avr_request(conn, "slider_up", check_slider_up);
+
+	if (!req->answered) {
+		os_printf("Leaving with error state, buffer is %s\r\n", req->answer);
+		return cmd_avr_error(conn);
 	}
 
-	httpdSend(conn, "Keine Antwort vom AVR-Controller", -1);
-	return HTTPD_CGI_DONE;
+	os_printf("Leaving with success state\r\n");
+	telemetry_update(telemetry_slider, "slider", "Klappe ist oben");
+	httpdSend(conn, "ok", -1);
+	return cmd_avr_release(conn);
+}
+
+int cmd_slider_down(HttpdConnData *conn) {
+	struct AvrRequest *req = conn->cgiData;
+	if (conn->conn == NULL) return cmd_avr_release(conn);
+	if (req == NULL) return cmd_avr_request(conn, "slider_down", check_slider_down);
+	if (!req->answered) return cmd_avr_error(conn);
+
+	telemetry_update(telemetry_slider, "slider", "Klappe ist unten");
+	httpdSend(conn, "ok", -1);
+	return cmd_avr_release(conn);
+}
+
+int cmd_opentime_get(HttpdConnData *conn) {
+	struct AvrRequest *req = conn->cgiData;
+	if (conn->conn == NULL) return cmd_avr_release(conn);
+	if (req == NULL) return cmd_avr_request(conn, "opentime_get", NULL);
+	if (!req->answered) return cmd_avr_error(conn);
+
+	char resbuf[TELEMETRY_LEN];
+	format_opentime(resbuf, integer_from_string(req->answer, 0), integer_from_string(req->answer, 1));
+	telemetry_update(telemetry_opentime, "opentime", resbuf);
+	httpdSend(conn, resbuf, -1);
+	return cmd_avr_release(conn);
+}
+
+int cmd_systime_get(HttpdConnData *conn) {
+	struct AvrRequest *req = conn->cgiData;
+	if (conn->conn == NULL) return cmd_avr_release(conn);
+	if (req == NULL) return cmd_avr_request(conn, "systime_get", check_systime);
+	if (!req->answered) return cmd_avr_error(conn);
+
+	uint8_t seconds = integer_from_string(req->answer, 0);
+	uint8_t minutes = integer_from_string(req->answer, 1);
+	uint8_t hours = integer_from_string(req->answer, 2);
+	uint8_t date = integer_from_string(req->answer, 3);
+	uint8_t month = integer_from_string(req->answer, 4);
+	uint8_t year = integer_from_string(req->answer, 5);
+	uint8_t dow = integer_from_string(req->answer, 6);
+
+	char resbuf[TELEMETRY_LEN];
+	format_systime(resbuf, dow, date, month, year, hours, minutes, seconds);
+	telemetry_update(telemetry_systime, "time", resbuf);
+	httpdSend(conn, resbuf, -1);
+	return cmd_avr_release(conn);
 }
 
 int cmd_systime_set(HttpdConnData *conn) {
 	// Parse command from GET parameters
-	char seconds_str[3];
-	char minutes_str[3];
-	char hours_str[3];
-	char date_str[3];
-	char month_str[3];
-	char year_str[3];
-	char dow_str[2];
-
-	httpdFindArg(conn->getArgs, "seconds", seconds_str, sizeof(seconds_str));
-	httpdFindArg(conn->getArgs, "minutes", minutes_str, sizeof(minutes_str));
-	httpdFindArg(conn->getArgs, "hours", hours_str, sizeof(hours_str));
-	httpdFindArg(conn->getArgs, "date", date_str, sizeof(date_str));
-	httpdFindArg(conn->getArgs, "month", month_str, sizeof(month_str));
-	httpdFindArg(conn->getArgs, "year", year_str, sizeof(year_str));
-	httpdFindArg(conn->getArgs, "dow", dow_str, sizeof(dow_str));
-
-	time.seconds = atoi(seconds_str);
-	time.minutes = atoi(minutes_str);
-	time.hours = atoi(hours_str);
-	time.date = atoi(date_str);
-	time.month = atoi(month_str);
-	time.year = atoi(year_str);
-	time.dow = atoi(dow_str);
+	time.seconds = httpdGetArgInt(conn, "seconds", 0);
+	time.minutes = httpdGetArgInt(conn, "minutes", 0);
+	time.hours = httpdGetArgInt(conn, "hours", 0);
+	time.date = httpdGetArgInt(conn, "date", 0);
+	time.month = httpdGetArgInt(conn, "month", 0);
+	time.year = httpdGetArgInt(conn, "year", 0);
+	time.dow = httpdGetArgInt(conn, "dow", 0);
 	time_valid = true;
+	telemetry_time();
+	cgiCacheInvalidate("/systime_get");
 
 	httpdSend(conn, "ok", -1);
 	return HTTPD_CGI_DONE;
 }
 
 int cmd_battery_get(HttpdConnData *conn) {
-	uint8_t i;
-	for (i = 0; i < 4; i++) {
-		os_printf("\r\nbattery_get\r\n");
-		bool res = get_answer(200);
-		if (res == true) {
-			uint8_t voltage = integer_from_string(ans_buf, 0);
-			uint8_t percent = integer_from_string(ans_buf, 1);
-
-			char resbuf[50];
-			os_sprintf(resbuf, "Batteriespannung ist %u.%uV, geschätzt %u%", (voltage - voltage % 10) / 10, voltage % 10, percent);
-			httpdSend(conn, resbuf, -1);
-			return HTTPD_CGI_DONE;
-		}
-	}
-
-	httpdSend(conn, "Keine Antwort vom AVR-Controller", -1);
-	return HTTPD_CGI_DONE;
+	struct AvrRequest *req = conn->cgiData;
+	if (conn->conn == NULL) return cmd_avr_release(conn);
+	if (req == NULL) return cmd_avr_request(conn, "battery_get", NULL);
+	if (!req->answered) return cmd_avr_error(conn);
+
+	char resbuf[TELEMETRY_LEN];
+	format_battery(resbuf, req->answer);
+	telemetry_update(telemetry_battery, "battery", resbuf);
+	httpdSend(conn, resbuf, -1);
+	return cmd_avr_release(conn);
 }
 
 int cmd_opentime_set(HttpdConnData *conn) {
+	struct AvrRequest *req = conn->cgiData;
 	// Parse command from GET parameters
-	char hours_str[5];
-	char minutes_str[5];
-
-	httpdFindArg(conn->getArgs, "hours", hours_str, sizeof(hours_str));
-	httpdFindArg(conn->getArgs, "minutes", minutes_str, sizeof(minutes_str));
-
-	char command[30];
-	os_sprintf(command, "\r\nopentime_set %s %s\r\n", hours_str, minutes_str);
-
-	// Send command / wait for answer
-	uint8_t i;
-	for (i = 0; i < 4; i++) {
-		os_printf(command);
-		bool res = get_answer(200);
-		if (res == true && os_strcmp("ots_ok", ans_buf) == 0) {
-			httpdSend(conn, "ok", -1);
-			return HTTPD_CGI_DONE;
-		}
+	int hours = httpdGetArgInt(conn, "hours", 0);
+	int minutes = httpdGetArgInt(conn, "minutes", 0);
+	char command[TELEMETRY_LEN];
+
+	if (conn->conn == NULL) return cmd_avr_release(conn);
+	if (req == NULL) {
+		os_sprintf(command, "opentime_set %d %d", hours, minutes);
+		return cmd_avr_request(conn, command, check_opentime_set);
 	}
+	if (!req->answered) return cmd_avr_error(conn);
 
-	httpdSend(conn, "Keine Antwort vom AVR-Controller", -1);
-	return HTTPD_CGI_DONE;
+	format_opentime(command, hours, minutes);
+	telemetry_update(telemetry_opentime, "opentime", command);
+	cgiCacheInvalidate("/opentime_get");
+	httpdSend(conn, "ok", -1);
+	return cmd_avr_release(conn);
 }
 
 int cmd_dcf_info(HttpdConnData *conn) {
@@ -458,16 +653,27 @@ int cmd_dcf_info(HttpdConnData *conn) {
 	return HTTPD_CGI_DONE;
 }
 
+/**
+ * Response cache
+ * Answers of the AVR that are asked for over and over are kept for a while, so that
+ * page refreshes don't keep the serial link busy.
+ */
+const CgiCacheRoute opentime_cache = {cmd_opentime_get, NULL, 60000, NULL};
+const CgiCacheRoute systime_cache = {cmd_systime_get, NULL, 1000, NULL};
+const CgiCacheRoute battery_cache = {cmd_battery_get, NULL, 30000, NULL};
+
 HttpdBuiltInUrl builtInUrls[] = {
-	{"/", cgiRedirect, "/index.html"},
+	{"/", cgiRewrite, "/index.html"},
 	{"/slider_up", cmd_slider_up, NULL},
 	{"/slider_down", cmd_slider_down, NULL},
-	{"/opentime_get", cmd_opentime_get, NULL},
-	{"/systime_get", cmd_systime_get, NULL},
+	{"/opentime_get", cgiCache, &opentime_cache},
+	{"/systime_get", cgiCache, &systime_cache},
 	{"/systime_set", cmd_systime_set, NULL},
-	{"/battery_get", cmd_battery_get, NULL},
+	{"/battery_get", cgiCache, &battery_cache},
 	{"/opentime_set", cmd_opentime_set, NULL},
 	{"/dcf_info", cmd_dcf_info, NULL},
+	{"/events", cgiEventStream, telemetry_connected, HTTPD_METHOD_GET},
+	{"/stats", cgiHttpdStats, NULL},
 	{"*", cgiEspFsHook, NULL},
 	{NULL, NULL, NULL}
 };
@@ -497,6 +703,14 @@ void ICACHE_FLASH_ATTR user_init() {
 	os_timer_setfn(&time_inc_timer, (os_timer_func_t *) time_inc_timer_cb, NULL);
 	os_timer_arm(&time_inc_timer, 1000, 1);
 
+	// AVR answer timeout
+	os_timer_disarm(&avr_timer);
+	os_timer_setfn(&avr_timer, (os_timer_func_t *) avr_timer_cb, NULL);
+
+	// Telemetry poll timer, armed when someone listens to /events
+	os_timer_disarm(&telemetry_timer);
+	os_timer_setfn(&telemetry_timer, (os_timer_func_t *) telemetry_timer_cb, NULL);
+
 	// DCF77 decode timer: decide wheter 1 or 0
 	dcf_decode_timer_adjust();
 